@@ -0,0 +1,132 @@
+# The synthetic templates of bench/render.rb, each one stressing another part of the engine.
+#
+#   ruby -Ilib bench/corpus.rb [dir] [scale]
+#
+# writes the templates into dir to look at them or to feed them to other tools.
+module Corpus
+  # the methods the templates call, answered the same for every workload
+  class Scope
+    def title
+      'Corpus & "friends" <bench>'
+    end
+
+    def name_of(i)
+      "item #{i}"
+    end
+
+    def value(i)
+      "v#{i * 7}"
+    end
+
+    def dirty(i)
+      %Q(<a href="/items/#{i}?a=1&b=2">'#{i}' & "#{i + 1}"</a>)
+    end
+
+    def code
+      "line 1\n  line 2\n    line 3"
+    end
+
+    def parity(i)
+      i.odd? ? 'odd' : 'even'
+    end
+  end
+
+  # [haml, options] by the name of the workload, scale is about the number of lines of each
+  # @param scale [Integer]
+  # @return [Hash{String => Array(String, Hash)}]
+  def self.workloads(scale = 500)
+    {
+      'deep'       => [deep(scale / 4), {}],
+      'wide'       => [wide(scale), {}],
+      'attributes' => [attributes(scale / 4), {}],
+      'escape'     => [escape(scale / 2), {:escape_html => true}],
+      'filters'    => [filters(scale / 10), {}],
+      'preserve'   => [preserve(scale / 4), {}],
+    }
+  end
+
+  # nested tags, a script at every level
+  def self.deep(depth)
+    lines = ["!!! 5", "%html", "  %body"]
+    depth.times do |i|
+      indent = '  ' * (i + 2)
+      lines << "#{indent}%div.level{:id => \"l#{i}\"}"
+      lines << "#{indent}  %span= name_of(#{i})"
+    end
+    lines << '  ' * (depth + 2) + "%p= title"
+    lines.join("\n") << "\n"
+  end
+
+  # a long list of siblings, static and dynamic rows alternating
+  def self.wide(rows)
+    lines = ["%table"]
+    rows.times do |i|
+      lines << (i.even? ? "  %tr.row\n    %td row #{i}" : "  %tr{:class => parity(#{i})}\n    %td= name_of(#{i})")
+    end
+    lines.join("\n") << "\n"
+  end
+
+  # a form whose fields have literal, dynamic and boolean attributes
+  def self.attributes(fields)
+    lines = ["%form{:action => '/items', :method => 'post'}"]
+    fields.times do |i|
+      lines << "  %label{:for => \"f#{i}\"} Field #{i}"
+      lines << "  %input.field.text{:type => 'text', :id => \"f#{i}\", :name => \"item[f#{i}]\", :value => value(#{i})}"
+      lines << "  %input(type=\"checkbox\" name=\"c#{i}\" checked=#{i.even?})"
+      lines << "  %select{:name => 's#{i}', :class => ['a', \"b#{i}\"], :disabled => false}"
+      lines << "    %option{:value => '1', :selected => true} one"
+    end
+    lines.join("\n") << "\n"
+  end
+
+  # script results and interpolations full of characters to escape
+  def self.escape(lines_count)
+    lines = ["%div"]
+    lines_count.times do |i|
+      lines << "  %p= dirty(#{i})"
+      lines << "  %span a & b \#{dirty(#{i})} < c"
+    end
+    lines.join("\n") << "\n"
+  end
+
+  # long filter bodies between tags
+  def self.filters(blocks)
+    lines = []
+    blocks.times do |i|
+      lines << "%section"
+      lines << "  :javascript"
+      lines += Array.new(8) { |j| "    var x#{j} = #{i} + #{j};" }
+      lines << "  :css"
+      lines += Array.new(8) { |j| "    .c#{j} { margin: #{i}px; }" }
+      lines << "  :plain"
+      lines += Array.new(8) { |j| "    plain text #{i} #{j}" }
+      lines << "  :escaped"
+      lines += Array.new(4) { |j| "    <b>#{i} & #{j}</b>" }
+    end
+    lines.join("\n") << "\n"
+  end
+
+  # ~ and :preserve blocks, the newlines in them are encoded
+  def self.preserve(blocks)
+    lines = []
+    blocks.times do |i|
+      lines << "%div"
+      lines << "  ~ \"<pre>\#{code}</pre>\""
+      lines << "  %textarea= code"
+      lines << "  :preserve"
+      lines << "    kept #{i}"
+      lines << "      as it is"
+    end
+    lines.join("\n") << "\n"
+  end
+end
+
+if $0 == __FILE__
+  dir   = ARGV[0] || 'tmp/corpus'
+  scale = (ARGV[1] || 500).to_i
+  require 'fileutils'
+  FileUtils.mkdir_p(dir)
+  Corpus.workloads(scale).each do |name, (haml, _)|
+    File.write(File.join(dir, "#{name}.haml"), haml)
+  end
+end
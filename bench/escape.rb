@@ -0,0 +1,50 @@
+# Measures html escaping of script results with escape_html: true, with each scanner of
+# String::escape_html: the scalar byte loop, SSE2 and AVX2.
+#
+#   ruby -Ilib bench/escape.rb
+#
+# The scanner is picked when the extension is loaded, so each one is measured in a process of
+# its own with CHAML_ESCAPE set. A CPU without AVX2 measures SSE2 twice, one that is not x86
+# the scalar loop thrice.
+require 'benchmark'
+require 'rbconfig'
+
+SCANNERS = %w[scalar sse2 avx2]
+SIZE     = 64 * 1024
+LINES    = 16
+
+PAYLOADS = {
+  'clean'  => 'lorem ipsum dolor sit amet ' * (SIZE / 27),
+  'sparse' => ('a' * 99 + '<') * (SIZE / 100),
+  'dense'  => %q(<a href="x">'&'</a> ) * (SIZE / 20),
+}
+
+unless ENV['CHAML_ESCAPE']
+  results = SCANNERS.to_h do |scanner|
+    out = IO.popen({'CHAML_ESCAPE' => scanner}, [RbConfig.ruby, *$LOAD_PATH.grep(/lib\z/).map { |l| "-I#{l}" }, $0], &:read)
+    [scanner, Marshal.load(out.unpack1('m'))]
+  end
+
+  printf "%-8s %-8s %10s %10s %8s\n", 'payload', 'scanner', 'ms/render', 'MB/s', 'speedup'
+  PAYLOADS.each_key do |name|
+    SCANNERS.each do |scanner|
+      t = results[scanner][name]
+      printf "%-8s %-8s %10.3f %10.1f %7.2fx\n", name, scanner, t * 1000,
+             PAYLOADS[name].bytesize * LINES / t / 1e6, results['scalar'][name] / t
+    end
+  end
+  exit
+end
+
+require 'chaml'
+
+times = PAYLOADS.to_h do |name, payload|
+  scope  = Object.new
+  scope.define_singleton_method(:payload) { payload }
+  engine = CHaml::Engine.new("%div\n" + "  = payload\n" * LINES, :escape_html => true)
+  engine.render(scope)
+
+  n = 50
+  [name, Benchmark.realtime { n.times { engine.render(scope) } } / n]
+end
+print [Marshal.dump(times)].pack('m0')
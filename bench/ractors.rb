@@ -0,0 +1,68 @@
+# Measures the render throughput of N ractors sharing the engines of the haml-spec fixtures.
+#
+#   ruby -Ilib bench/ractors.rb [rounds]
+#
+# Every ractor renders each fixture rounds times. Expect it to scale with the cores.
+require 'benchmark'
+require 'etc'
+require 'json'
+require 'chaml'
+
+Warning[:experimental] = false
+
+# the locals of a fixture, answered as methods like the spec does
+class Scope
+  def initialize(locals)
+    @locals = locals
+  end
+
+  def method_missing(name, *args)
+    @locals.key?(name) ? @locals[name] : super
+  end
+
+  def respond_to_missing?(name, include_private = false)
+    @locals.key?(name) || super
+  end
+end
+
+ROUNDS   = (ARGV[0] || 200).to_i
+FIXTURES = File.expand_path('../test/fixtures/tests.json', __dir__)
+
+# [engine, locals] of every fixture rendering without an error, shared by all ractors
+CASES = JSON.parse(File.read(FIXTURES)).flat_map { |_, tests|
+  tests.map do |_, test|
+    options = Hash[(test['config'] || {}).map { |x, y| [x.to_sym, y] }]
+    options[:format] = options[:format].to_sym if options.key?(:format)
+    locals = Hash[(test['locals'] || {}).map { |x, y| [x.to_sym, y.to_s] }]
+    begin
+      engine = CHaml::Engine.new(test['haml'], options).freeze
+      engine.render(Scope.new(locals))
+      [engine, locals]
+    rescue StandardError, SyntaxError
+      nil
+    end
+  end
+}.compact
+Ractor.make_shareable(CASES)
+
+def run(ractors)
+  Benchmark.realtime do
+    ractors.times.map {
+      Ractor.new(ROUNDS) do |rounds|
+        rounds.times do
+          CASES.each { |engine, locals| engine.render(Scope.new(locals)) }
+        end
+      end
+    }.each(&:take)
+  end
+end
+
+puts "#{CASES.size} fixtures, #{ROUNDS} rounds, #{Etc.nprocessors} cores"
+printf "%-8s %14s %8s\n", 'ractors', 'renders/s', 'speedup'
+base = nil
+[1, 2, 4, 8, Etc.nprocessors].uniq.sort.each do |n|
+  t    = run(n)
+  rate = n * ROUNDS * CASES.size / t
+  base ||= rate
+  printf "%-8d %14.0f %7.2fx\n", n, rate, rate / base
+end
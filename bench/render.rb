@@ -0,0 +1,82 @@
+# Renders the workloads of bench/corpus.rb and prints the throughput, the latency percentiles
+# and the share of each phase of Engine#render, next to the haml gem if it is installed.
+#
+#   rake bench
+#   ruby -Ilib bench/render.rb [seconds per workload] [scale]
+#
+# Run it again on a build of an older revision to measure a change.
+require 'benchmark'
+require 'chaml'
+require_relative 'corpus'
+
+begin
+  require 'haml'
+rescue LoadError
+  warn 'the haml gem is not installed, the comparison is skipped'
+end
+
+SECONDS = (ARGV[0] || 2).to_f
+SCALE   = (ARGV[1] || 500).to_i
+PHASES  = [:evaluate, :static_haml, :html, :flatten]
+
+def percentile(sorted, p)
+  sorted[((sorted.size - 1) * p).round]
+end
+
+# renders for about SECONDS, returns the seconds of each render
+def measure
+  3.times { yield }
+  latencies = []
+  deadline  = Process.clock_gettime(Process::CLOCK_MONOTONIC) + SECONDS
+  loop do
+    start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    yield
+    now = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    latencies << now - start
+    break if now >= deadline
+  end
+  latencies.sort
+end
+
+def haml_renderer(haml, options)
+  if defined?(Haml::Template)
+    template = Haml::Template.new(:escape_html => options.fetch(:escape_html, false)) { haml }
+    lambda { |scope| template.render(scope) }
+  else
+    engine = Haml::Engine.new(haml, options)
+    lambda { |scope| engine.render(scope) }
+  end
+end
+
+printf "%-10s %8s %10s %8s %8s %8s %8s   %-36s %8s\n",
+       'workload', 'KB', 'renders/s', 'MB/s', 'p50 ms', 'p90 ms', 'p99 ms',
+       PHASES.join('/') + ' %', 'vs haml'
+Corpus.workloads(SCALE).each do |name, (haml, options)|
+  scope  = Corpus::Scope.new
+  engine = CHaml::Engine.new(haml, options)
+  size   = engine.render(scope).bytesize
+
+  phases = Hash.new(0.0)
+  latencies = measure do
+    engine.render(scope)
+    engine.last_render_stats.each { |phase, seconds| phases[phase] += seconds }
+  end
+  rate   = latencies.size / latencies.inject(:+)
+  shares = PHASES.map { |phase| (100 * phases[phase] / phases[:total]).round }
+
+  versus = '-'
+  if defined?(Haml)
+    render = haml_renderer(haml, options)
+    begin
+      haml_latencies = measure { render.call(scope) }
+      versus = format('%.2fx', rate / (haml_latencies.size / haml_latencies.inject(:+)))
+    rescue StandardError, SyntaxError => e
+      versus = e.class.name
+    end
+  end
+
+  printf "%-10s %8.1f %10.0f %8.1f %8.3f %8.3f %8.3f   %-36s %8s\n",
+         name, size / 1024.0, rate, rate * size / 1e6,
+         percentile(latencies, 0.5) * 1000, percentile(latencies, 0.9) * 1000, percentile(latencies, 0.99) * 1000,
+         shares.join('/'), versus
+end
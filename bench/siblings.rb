@@ -0,0 +1,87 @@
+# Renders templates of 10k up to 1M sibling rows and prints the time per row and
+# the peak RSS.
+#
+#   ruby -Ilib bench/siblings.rb [max_rows]
+#
+# The template passes walk siblings in a loop and only recurse on nesting, so the
+# time per row stays flat and the renders fit in a small machine stack. The script
+# runs itself again with RUBY_THREAD_MACHINE_STACK_SIZE=256KiB and renders in a
+# thread to check the latter.
+#
+# The rows of 'static', 'dynamic' and 'plain' are children of one %table, the ones
+# of 'flat' are siblings at the top level and the ones of 'mixed' alternate static
+# and dynamic lines at the top level, so that the folding of static siblings is
+# broken up by every other row. Each case runs in a fork of its own where fork is
+# available, so its peak RSS (VmHWM, on Linux only) is not the one of the cases
+# before it.
+require 'benchmark'
+
+STACK_SIZE = 256 * 1024
+
+unless ENV['RUBY_THREAD_MACHINE_STACK_SIZE']
+  exec({'RUBY_THREAD_MACHINE_STACK_SIZE' => STACK_SIZE.to_s}, RbConfig.ruby, *$LOAD_PATH.grep(/lib\z/).map { |l| "-I#{l}" }, $0, *ARGV)
+end
+
+require 'chaml'
+
+max_rows = (ARGV[0] || 1_000_000).to_i
+
+TEMPLATES = {
+  'static'  => ->(rows) { "%table\n" + "  %tr\n    %td row\n" * rows },
+  'dynamic' => ->(rows) { "%table\n" + "  %tr\n    %td= n\n" * rows },
+  'plain'   => ->(rows) { "%table\n" + "  row \#{n}\n" * rows },
+  'flat'    => ->(rows) { "%p row\n" * rows },
+  'mixed'   => ->(rows) { "%p row\n%p= n\n" * (rows / 2) + "%p row\n" * (rows % 2) },
+}
+
+def scope
+  scope = Object.new
+  def scope.n; 1; end
+  scope
+end
+
+def peak_rss
+  File.read('/proc/self/status')[/^VmHWM:\s*(\d+)/, 1].to_i * 1024
+rescue SystemCallError
+  nil
+end
+
+def measure(template)
+  engine = CHaml::Engine.new(template)
+  compile = first = render = nil
+  Thread.new do
+    compile = Benchmark.realtime { engine.compile }
+    # the first render also turns the ruby of the template into a method
+    first   = Benchmark.realtime { engine.render(scope) }
+    render  = Benchmark.realtime { engine.render(scope) }
+  end.join
+  [compile, first, render, peak_rss]
+end
+
+def isolated(template)
+  return measure(template) unless Process.respond_to?(:fork)
+  reader, writer = IO.pipe
+  pid = fork do
+    reader.close
+    Marshal.dump(measure(template), writer)
+    writer.close
+    exit!(0)
+  end
+  writer.close
+  result = Marshal.load(reader)
+  reader.close
+  Process.wait(pid)
+  result
+end
+
+puts "machine stack: #{ENV['RUBY_THREAD_MACHINE_STACK_SIZE']} bytes"
+printf "%-8s %8s %10s %10s %10s %12s %10s\n", 'rows', 'kind', 'compile', '1st render', 'render', 'ns/row', 'peak rss'
+rows = 10_000
+while rows <= max_rows
+  TEMPLATES.each do |kind, template|
+    compile, first, render, rss = isolated(template.(rows))
+    printf "%-8d %8s %9.3fs %9.3fs %9.3fs %12.1f %10s\n", rows, kind, compile, first, render, render * 1e9 / rows,
+           rss ? format('%.1fMiB', rss / 1048576.0) : '-'
+  end
+  rows *= 10
+end
@@ -8,6 +8,9 @@
 #pragma clang diagnostic ignored "-Wsign-conversion"
 #endif
 #include <ruby.h>
+#ifdef HAVE_RUBY_THREAD_NATIVE_H
+#include <ruby/thread_native.h>
+#endif
 #ifdef __CLANG__
 #pragma clang diagnostic pop
 #endif
@@ -18,7 +21,7 @@
 
 #define DATA_READY(type, var, arg)  \
   type* var;                        \
-  Data_Get_Struct(arg, type, var)
+  TypedData_Get_Struct(arg, type, &type##_data_type, var)
 
 #define CLASS(klass) rb_path2class(#klass)
 #define CLASS_READY(klass) AT_STACK(klass, CLASS(klass))
@@ -31,7 +34,12 @@
 #define SYMBOL_P(value) (TYPE(value) == T_SYMBOL)
 #endif
 
+#ifdef RUBY_BACKWARD_CXXANYARGS_HPP
+// ruby.h of 2.7 and later declares the exact prototype, its ANYARGS overload is deprecated
+#define RUBY_EACH_FUNC(f) static_cast<int (*)(VALUE, VALUE, VALUE)>(f)
+#else
 #define RUBY_EACH_FUNC(f) reinterpret_cast<int(*)(...)>(f)
+#endif
 
 #define SIZE_OF(x) static_cast<long>(sizeof(x))
 
@@ -46,7 +54,7 @@ namespace CHaml {
   }
 
   namespace Converter {
-    extern const char* preservation_regexp;
+    struct compiled;
   }
 
   namespace Engine {
@@ -61,17 +69,57 @@ namespace CHaml {
         bool escape_html;
         bool raise_unknown_option;
         int default_indent_depth;
+        bool compile_script;
+        bool reloadable;  // keep the parsed blocks of the template, so reload parses only the changed ones
+        long arena_limit;  // bytes of the arena kept between renders, 0 for all of it
+        VALUE partials;  // the engines of the partials by name, anything responding to [], or nil
       } options;
       VALUE templ;
-      GC::gc* gc_pool;
+      VALUE name;  // the path the template was read from, or nil
+      const char* mapping;  // the template mapped by open(file_name, mmap: true), templ is nil then
+      long mapping_length;
+      GC::gc* arena;  // reused by the renders, the ones not in use linked by next
+      Converter::compiled* compiled;
+      int rendering;  // compiles and renders running right now, they hold the template and the compiled tree
+      struct stats_t {
+        double evaluate;     // seconds running the ruby of the template
+        double static_haml;  // seconds putting the values into a copy of the tree
+        double html;         // seconds building the html of the tree
+        double flatten;      // seconds writing or emitting the html
+        long evals;          // calls of the script, instance_exec and eval made
+        long eval_bytes;     // bytes of ruby parsed, the script only by the first render with a class of scope
+        long arena_chunks;   // chunks of the arena the render used
+        long arena_bytes;    // bytes of those chunks
+        long arena_used;     // bytes the render allocated from them
+        long output_bytes;
+      } stats;  // of the last render finished
+      bool rendered;  // stats is set
+#ifdef HAVE_RUBY_THREAD_NATIVE_H
+      rb_nativethread_lock_t lock;  // guards arena and rendering, a frozen engine is rendered by many ractors
+#endif
     };
 
     VALUE initialize(int argc, VALUE* argv, VALUE self);
 
     VALUE render(int argc, VALUE* argv, VALUE self);
-    VALUE open(VALUE self, VALUE file_name);
+    VALUE write_chunks(int argc, VALUE* argv, VALUE self);
+    VALUE write_chunks_to(int argc, VALUE* argv, VALUE self);
+    VALUE compile(VALUE self);
+    VALUE open(int argc, VALUE* argv, VALUE self);
     VALUE append_option(VALUE self, VALUE options);
     VALUE concat(VALUE self, VALUE templ);
+    VALUE freeze(VALUE self);
+    VALUE dump(VALUE self);
+    VALUE load(VALUE self, VALUE dump);
+    VALUE last_render_stats(VALUE self);
+    VALUE compile_files(VALUE klass, VALUE paths, VALUE options, VALUE threads);
+    VALUE name(VALUE self);
+    VALUE reload(int argc, VALUE* argv, VALUE self);
+    VALUE relink(VALUE self);
+  }
+
+  namespace Watcher {
+    void define(VALUE chaml);
   }
 
   namespace String {
@@ -92,6 +140,7 @@ namespace CHaml {
     bool find_last_valid_index(string* s, long* index);
     long find_last_valid_index(string* s);
     long skip_tag_options(string* s, long* index);
+    bool has_dynamic_part(string* s, long index);
 
     string* tag_options(string* s, long* index, GC::gc* gc_pool);
     string* tok(string* s, long* index, GC::gc* gc_pool);
@@ -100,6 +149,10 @@ namespace CHaml {
     string* rest(string* s, long index, GC::gc* gc_pool);
     string* rest(string* s, long* index, GC::gc* gc_pool);
 
+    string* escape_html(string* s, GC::gc* gc_pool);
+    string* preserve(string* s, GC::gc* gc_pool);
+    string* preserve_all(string* s, GC::gc* gc_pool);
+
     void chomp(string* s);
 
     void print(string* s);
@@ -111,8 +164,15 @@ namespace CHaml {
       String::string* s;
     };
 
+    struct tree;
+
     struct line {
       int indent_depth;
+      int lineno;  // of the template counted from 1, 0 for the lines made by the converter
+      int slot;  // index of the script whose value replaces this line, or -1
+      bool is_html;  // the line is a finished html segment
+      String::string* attr;  // the html of the attributes of a tag line, built by build_attr, or NULL
+      tree* spliced;  // the html of a partial written in place of the line, indented by the line, or NULL
       string_chain *first, *last;
     };
 
@@ -129,27 +189,126 @@ namespace CHaml {
 
     typedef Engine::engine::option_t Option;
 
+#define SLOT_LINE   0  // statements appending to @_, its value is @_
+#define SLOT_SILENT 1  // statements run only for their side effects
+#define SLOT_EXPR   2  // an expression, its value is used as it is
+#define SLOT_TAG    3  // a tag with attributes, its value is [values of attrs..., rest of the line]
+#define SLOT_TEXT   4  // a text with #{}, its value is [values of the expressions] put between texts
+#define SLOT_PARTIAL 5  // "+ name", the code is the name of another template rendered in place of the line
+#define SLOT_CONTENT 6  // "+ content_for name", the code is the name and the subtree of the line the content
+#define SLOT_YIELD   7  // "+ yield [name]" in a layout, the page or its content of the name is written there
+
+#define PRESERVE_NONE 0
+#define PRESERVE_TAGS 1  // the newlines in textarea, pre and code of the value are encoded
+#define PRESERVE_ALL  2  // every newline of the value is encoded
+
+#define ATTR_CLASS 0  // .name
+#define ATTR_ID    1  // #name, the last one is the first id
+#define ATTR_VALUE 2  // name=value in (...), the value is evaluated
+#define ATTR_HASH  3  // {...}, evaluated into an array of hashes of attributes
+#define ATTR_TRUE  4  // name => true, read at compile time
+#define ATTR_FALSE 5  // name => false or nil, read at compile time
+
+    struct attr {
+      attr* next;
+      int kind;
+      String::string* name;  // the class, the id or the name of the attribute, NULL for ATTR_HASH
+      String::string* value;  // the ruby expression of ATTR_VALUE or the content of ATTR_HASH
+    };
+
+    struct attr_set {
+      attr_set* next;
+      String::string* name;
+      VALUE value;
+    };
+
+    struct slot {
+      slot* next;
+      int kind;
+      String::string* code;
+      String::string* tag;  // "%name" of SLOT_TAG
+      attr* attrs;
+      String::string* html;  // the html of attrs if all of their values are literals
+      string_chain* texts;  // the texts around the expressions of SLOT_TEXT
+      int preserve;  // how the value is preserved, one of PRESERVE_*
+      int lineno;  // of the line the slot replaces
+      tree* content;  // of SLOT_CONTENT, left out of the tree of the page
+    };
+
+    // the value of a slot turned into the line replacing its source
+    struct slot_value {
+      String::string* s;
+      String::string* attr;
+      tree* html;  // of a SLOT_PARTIAL or a SLOT_YIELD, built by the render
+    };
+
+    // a line of the template at indent 0 and the lines under it, kept by a reloadable compile
+    struct block {
+      block* next;
+      const char* text;  // into the template of the compiled
+      long length;
+      int lineno;  // the lines of the template before the block
+      tree* haml;  // the tree of the block, slots solved but not folded
+      tree* folded;  // haml folded on its own, as if the line after it removes whitespace iff. trimmed
+      bool trimmed;
+      int slot_first, slot_count;
+      bool partials;  // has slots of SLOT_PARTIAL, parsed again by every recompile so they are linked again
+    };
+
+    // the parsed form of a template, kept by an engine across renders
+    struct compiled {
+      GC::gc* gc_pool;
+      char* templ;
+      long length;
+      tree* t;
+      slot *slots, *slots_last;
+      int slot_count;
+      int directive_count;  // the slots of SLOT_PARTIAL, SLOT_CONTENT and SLOT_YIELD, they run no ruby
+      bool linked;  // the partials are resolved, the static ones put into t
+      VALUE partials;  // the engines of the partials rendered with t by the index of their slots, or nil
+      String::string* script;  // the statements evaluating every slot at once
+      VALUE proc;
+      ID method;  // the script defined on the classes of the scopes, if no proc was loaded
+      const char* name;  // the path of the template given to the probes, "" if it is not known
+      block* blocks;  // of a reloadable compile, or NULL
+    };
+
+    compiled* prepare(const char* buffer, long length, bool copy);
+    void compile(compiled* c, const Option& options);
+    int recompile(compiled* c, compiled* old, const Option& options);
+    void release(compiled* c);
+    tree* clone(tree* t, GC::gc* gc_pool);
+    tree* find_slot(compiled* c, int slot);
+    void inline_partial(compiled* c, int slot, const char* html, long length);
+    void inline_text(compiled* c, int slot, int lineno);
+    void refold(compiled* c, const Option& options);
+    extern const int dump_version;
+    VALUE dump(compiled* c, const Option& options);
+    compiled* load(const char* buffer, long length, Option* options, String::string** iseq);
+    void load_proc(compiled* c, String::string* iseq);
+    // the calls evaluate made into ruby and the bytes of ruby they parsed
+    struct eval_stats {
+      long calls;
+      long bytes;
+    };
+    VALUE evaluate(compiled* c, VALUE location, const Option& options, eval_stats* stats);
+    slot_value* slot_values(compiled* c, VALUE values, const Option& options, GC::gc* gc_pool);
+
+    // everything from here to write_output touches no ruby object and runs without the gvl
     tree* haml_from_haml_plaintext(char* buffer, long length, const Option& options, GC::gc* gc_pool);
-    tree* static_haml_from_haml(tree* t, VALUE location, const Option& options, GC::gc* gc_pool);
-    tree* html_from_static_haml(tree* t, int* max_indent_depth, const Option& options, GC::gc* gc_pool);
-    VALUE flatten(tree* t, int max_indent_depth, GC::gc* gc_pool);
+    tree* static_haml_from_haml(tree* t, slot_value* values);
+    tree* content_html(compiled* c, slot_value* values, const char* name, long length, const Option& options, GC::gc* gc_pool);
+    tree* html_from_static_haml(tree* t, const Option& options, GC::gc* gc_pool);
+    long output_length(tree* t);
+    char* write_output(tree* t, char* out);
+
+    typedef void (*chunk_emitter)(VALUE chunk, VALUE arg);
+    void flatten_each(tree* t, long chunk_size, VALUE flush_after, chunk_emitter emit, VALUE arg);
   }
 
-#define MEMBER_NAME(ns, t)        ns##_##t##_pool
-#define MEMBER_TYPE(ns, t)        ns##_##t##_pool_t
-#define GC_POOL_SIZE(ns, t)       ns##_##t##_pool_size
 #define GCNEW_NAME(ns, t) gcnew_##ns##_##t
 
-#define DECLARE_GC(ns, t)               \
-  const int GC_POOL_SIZE(ns, t) = 1024; \
-  struct MEMBER_TYPE(ns, t) {           \
-    MEMBER_TYPE(ns, t)* next;           \
-    int max_using_heap_index;           \
-    ns::t pool[GC_POOL_SIZE(ns, t)];    \
-  };                                    \
-  ns::t* GCNEW_NAME(ns, t)(struct gc*)
-
-#define DECLARE_MEMBER(ns, t) MEMBER_TYPE(ns, t)* MEMBER_NAME(ns, t)
+#define DECLARE_GC(ns, t) ns::t* GCNEW_NAME(ns, t)(struct gc*)
 
   namespace GC {
     DECLARE_GC(String, string);
@@ -157,6 +316,10 @@ namespace CHaml {
     DECLARE_GC(Converter, line);
     DECLARE_GC(Converter, lines);
     DECLARE_GC(Converter, tree);
+    DECLARE_GC(Converter, slot);
+    DECLARE_GC(Converter, attr);
+    DECLARE_GC(Converter, attr_set);
+    DECLARE_GC(Converter, block);
 
     const int VALUE_pool_size = 1024;
     struct VALUE_t {
@@ -166,23 +329,31 @@ namespace CHaml {
     };
     void gc_register_value(const VALUE& value, gc* pool);
 
-    struct char_t {
-      char_t* next;
-      char pool[];
+    struct chunk_t {
+      chunk_t* next;
+      size_t size;  // bytes of data
+      bool mapped;
+      char data[];
     };
     char* gc_alloc_n_char(long length, gc* pool);
+    String::string** gc_alloc_n_string(long length, gc* pool);
+    Converter::slot_value* gc_alloc_n_slot_value(long length, gc* pool);
 
+    // one bump-pointer arena for all the objects of a compile or a render.
+    // a render resets it instead of freeing it, so the next one reuses its memory.
     struct gc {
-      DECLARE_MEMBER(String, string);
-      DECLARE_MEMBER(Converter, string_chain);
-      DECLARE_MEMBER(Converter, line);
-      DECLARE_MEMBER(Converter, lines);
-      DECLARE_MEMBER(Converter, tree);
+      chunk_t* chunks;  // the current chunk first
+      char* cursor;
+      char* limit;
+      size_t used;      // bytes handed out since the last reset
+      size_t peak;      // the most bytes handed out between two resets
       VALUE_t* value;
-      char_t* ch;
+      bool without_gvl; // running without the gvl, a failed allocation throws std::bad_alloc
+      gc* next;         // the next free arena of an engine
     };
 
     gc* init();
+    void reset(gc* pool, long limit);
     void final(gc* pool);
   }
 
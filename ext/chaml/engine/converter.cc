@@ -1,7 +1,13 @@
 #include "./chaml.h"
+#include "./probes.h"
+#include <atomic>
 
 #define GCNEW(t, pool) GCNEW_NAME(Converter, t)(pool)
 
+// walk the pieces of line l, l->last ends the line even if it has a next
+#define EACH_PIECE(var, l) \
+  for (auto var = (l)->first; var != NULL; var = (var == (l)->last ? NULL : var->next))
+
 namespace CHaml {
   namespace Converter {
 
@@ -19,6 +25,11 @@ namespace CHaml {
     static line* gcnew(int indent_depth, String::string* s, GC::gc* gc_pool) {
       auto ret = GCNEW(line, gc_pool);
       ret->indent_depth = indent_depth;
+      ret->lineno = 0;
+      ret->slot = -1;
+      ret->is_html = false;
+      ret->attr = NULL;
+      ret->spliced = NULL;
       ret->first = ret->last = gcnew(s, gc_pool);
       return ret;
     }
@@ -26,6 +37,11 @@ namespace CHaml {
     static line* gcnew(int indent_depth, const char* s, GC::gc* gc_pool) {
       auto ret = GCNEW(line, gc_pool);
       ret->indent_depth = indent_depth;
+      ret->lineno = 0;
+      ret->slot = -1;
+      ret->is_html = false;
+      ret->attr = NULL;
+      ret->spliced = NULL;
       ret->first = ret->last = gcnew(String::gcnew(s, gc_pool), gc_pool);
       return ret;
     }
@@ -71,8 +87,10 @@ namespace CHaml {
       auto *s = buffer, *p = buffer, *e = buffer + length;
       lines *ret = NULL, *ret_last = NULL;
       int indent_depth;
+      int lineno = 0;
 
       while (p < e) {
+        lineno++;
         /// initialize
         indent_depth = 0;
 
@@ -91,19 +109,35 @@ namespace CHaml {
           }
         }
         // continue if line.empty?
-        if (*p == '\n') {
+        if (p < e && *p == '\n') {
           p++;
           continue;
         }
         // find end of line
-        for (s = p; p < e && *p != '\n'; p++) {}
+        s = p;
+        p = static_cast<char*>(memchr(p, '\n', static_cast<size_t>(e - p)));
+        if (p == NULL) {
+          p = e;
+        }
         // skip carriage return iff. it was carriage return.
-        if (*p == '\n') {
+        String::string* str;
+        if (p < e) {
           p++;
+          str = String::gcnew(s, p - s, gc_pool);
+        } else if (p != s) {
+          // the last line lacks cr, end it with cr on a copy since the buffer may be read only
+          auto buffer = GC::gc_alloc_n_char(p - s + 2, gc_pool);
+          memcpy(buffer, s, static_cast<size_t>(p - s));
+          buffer[p - s]     = '\n';
+          buffer[p - s + 1] = '\0';
+          str = String::gcnew(buffer, p - s + 1, gc_pool);
+        } else {
+          break;
         }
 
         /// final
-        auto l = gcnew(indent_depth, String::gcnew(s, p - s, gc_pool), gc_pool);
+        auto l = gcnew(indent_depth, str, gc_pool);
+        l->lineno = lineno;
         if (ret) {
           ret_last->next = gcnew(l, gc_pool);
           ret_last = ret_last->next;
@@ -136,19 +170,22 @@ namespace CHaml {
     }
 
     static tree* remove_comments(tree* t) {
-      if (t == NULL) {
-        return NULL;
-      }
-
-      t->subtree = remove_comments(t->subtree);
-      t->next    = remove_comments(t->next);
-
-      // delete iff. line start with '-#'
-      auto s = t->l->first->s;
-      if (s->length >= 2 && s->buffer[0] == '-' && s->buffer[1] == '#') {
-        t = t->next;
+      tree *ret = t, *prev = NULL;
+      for (; t != NULL; t = t->next) {
+        // delete iff. line start with '-#'
+        auto s = t->l->first->s;
+        if (s->length >= 2 && s->buffer[0] == '-' && s->buffer[1] == '#') {
+          if (prev != NULL) {
+            prev->next = t->next;
+          } else {
+            ret = t->next;
+          }
+          continue;
+        }
+        t->subtree = remove_comments(t->subtree);
+        prev = t;
       }
-      return t;
+      return ret;
     }
 
     static lines* solve_multiline(lines* ls, GC::gc* gc_pool) {
@@ -161,10 +198,10 @@ namespace CHaml {
         if (s->buffer[i] == '|') {
           i--;
           find_last_valid_index(s, &i);
-          s->length = i + 2;
-          s->buffer[s->length - 1] = ' ';
-          auto l      = gcnew(ls->l->indent_depth, s, gc_pool);
+          // "%line |\n" -> "%line "
+          auto l      = gcnew(ls->l->indent_depth, String::gcnew(s->buffer, i + 1, gc_pool), gc_pool);
           auto sc     = l->first;
+          sc = sc->next = gcnew(" ", gc_pool);
           auto old_ls = ls;
           ls = ls->next;
           while (ls != NULL) {
@@ -175,12 +212,13 @@ namespace CHaml {
             }
             i--;
             find_last_valid_index(s, &i);
-            s->length = i + 2;
-            s->buffer[s->length - 1] = ' ';
-            sc = sc->next = gcnew(s, gc_pool);
+            sc = sc->next = gcnew(String::gcnew(s->buffer, i + 1, gc_pool), gc_pool);
+            sc = sc->next = gcnew(" ", gc_pool);
             ls = ls->next;
           }
+          auto lineno  = old_ls->l->lineno;
           old_ls->l = gcnew(l->indent_depth, connect_chain(l->first, gc_pool), gc_pool);
+          old_ls->l->lineno = lineno;
           old_ls->next = ls;
           ls = old_ls;
           s = ls->l->first->s;
@@ -236,11 +274,13 @@ namespace CHaml {
                     }
                     break;
                   case '\n':
-                    if (!inside_string && parents == 0) {
+                    if ((!inside_string && parents == 0) || ls->next == NULL) {
                       attr_ends = true;
                       break;
                     }
-                    s->buffer[i] = ' ';
+                    // "%tag{a,\n" -> "%tag{a, "
+                    sc->s = String::gcnew(s->buffer, i, gc_pool);
+                    sc = sc->next = gcnew(" ", gc_pool);
                     ls = ls->next;
                     s = ls->l->first->s;
                     sc = sc->next = gcnew(s, gc_pool);
@@ -255,7 +295,9 @@ namespace CHaml {
                 i++;
               }
               if (old_ls != ls) {
+                auto lineno = old_ls->l->lineno;
                 old_ls->l = gcnew(l->indent_depth, connect_chain(l->first, gc_pool), gc_pool);
+                old_ls->l->lineno = lineno;
                 old_ls->next = ls->next;
                 ls = old_ls;
               }
@@ -301,13 +343,10 @@ namespace CHaml {
     }
 
     static void increment_indents(tree* t, int indent_depth) {
-      if (t == NULL) {
-        return;
+      for (; t != NULL; t = t->next) {
+        increment_indents(t->subtree, indent_depth);
+        t->l->indent_depth += indent_depth;
       }
-
-      increment_indents(t->subtree, indent_depth);
-      increment_indents(t->next,    indent_depth);
-      t->l->indent_depth += indent_depth;
       return;
     }
 
@@ -324,114 +363,337 @@ namespace CHaml {
     }
 
     static void decrement_indents(tree* t, int indent_depth) {
-      if (t == NULL) {
-        return;
+      for (; t != NULL; t = t->next) {
+        decrement_indents(t->subtree, indent_depth);
+        decrement_indents(t->l, indent_depth);
       }
+      return;
+    }
 
-      decrement_indents(t->subtree, indent_depth);
-      decrement_indents(t->next,    indent_depth);
-      t->l->indent_depth -= indent_depth;
-      if (t->l->indent_depth < 0) {
-        t->l->indent_depth = 0;
+    // the value of `code' will replace l at render
+    static slot* add_slot(compiled* c, line* l, int kind, String::string* code, GC::gc* gc_pool) {
+      auto ret = GCNEW(slot, gc_pool);
+      ret->next  = NULL;
+      ret->kind  = kind;
+      ret->code  = code;
+      ret->tag   = NULL;
+      ret->attrs = NULL;
+      ret->html  = NULL;
+      ret->texts = NULL;
+      ret->preserve = PRESERVE_NONE;
+      ret->lineno   = l->lineno;
+      ret->content  = NULL;
+      if (kind >= SLOT_PARTIAL) {
+        c->directive_count++;
       }
-      return;
+      if (c->slots) {
+        c->slots_last = c->slots_last->next = ret;
+      } else {
+        c->slots = c->slots_last = ret;
+      }
+      l->slot = c->slot_count++;
+      return ret;
     }
 
-    // return true iff. s ~ /\\|#{/
-    static bool is_dynamic_part(String::string* s, long index) {
-      for (; index < s->length; index++) {
-        switch (s->buffer[index]) {
-          case '\\':
-            return true;
-          case '#':
-            if (index + 1 < s->length && s->buffer[index + 1] == '{') {
-              return true;
-            }
-            break;
-        }
+    static int hex_digit(char ch) {
+      if ('0' <= ch && ch <= '9') {
+        return ch - '0';
       }
-      return false;
+      if ('a' <= ch && ch <= 'f') {
+        return ch - 'a' + 10;
+      }
+      if ('A' <= ch && ch <= 'F') {
+        return ch - 'A' + 10;
+      }
+      return -1;
     }
 
-    // return t.map &:plain
-    static void plainize(tree* t, VALUE location, GC::gc* gc_pool) {
-      if (t == NULL) {
-        return;
+    static bool put_utf8(long code, char* out, long* length) {
+      if (code < 0 || code > 0x10ffff || (0xd800 <= code && code <= 0xdfff)) {
+        return false;
       }
+      auto p = out + *length;
+      if (code < 0x80) {
+        p[0] = static_cast<char>(code);
+        *length += 1;
+      } else if (code < 0x800) {
+        p[0] = static_cast<char>(0xc0 | (code >> 6));
+        p[1] = static_cast<char>(0x80 | (code & 0x3f));
+        *length += 2;
+      } else if (code < 0x10000) {
+        p[0] = static_cast<char>(0xe0 | (code >> 12));
+        p[1] = static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+        p[2] = static_cast<char>(0x80 | (code & 0x3f));
+        *length += 3;
+      } else {
+        p[0] = static_cast<char>(0xf0 | (code >> 18));
+        p[1] = static_cast<char>(0x80 | ((code >> 12) & 0x3f));
+        p[2] = static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+        p[3] = static_cast<char>(0x80 | (code & 0x3f));
+        *length += 4;
+      }
+      return true;
+    }
 
-      plainize(t->subtree, location, gc_pool);
-      plainize(t->next   , location, gc_pool);
+    // the escape at s[*index] == '\\' read as in a ruby double quoted string, its bytes are put at
+    // out + *length. return false for \c, \C- and \M-, which are left to ruby
+    static bool read_escape(String::string* s, long* index, char* out, long* length) {
+      auto p = s->buffer;
+      auto i = *index + 1;
+      if (i >= s->length) {
+        return false;
+      }
+      auto ch = p[i++];
+      switch (ch) {
+        case 'n': out[(*length)++] = '\n'; break;
+        case 't': out[(*length)++] = '\t'; break;
+        case 'r': out[(*length)++] = '\r'; break;
+        case 'f': out[(*length)++] = '\f'; break;
+        case 'v': out[(*length)++] = '\v'; break;
+        case 'a': out[(*length)++] = '\a'; break;
+        case 'b': out[(*length)++] = '\b'; break;
+        case 'e': out[(*length)++] = '\033'; break;
+        case 's': out[(*length)++] = ' '; break;
+        case '\n':
+          // continues the line
+          break;
+        case 'x': {
+          int code = 0, n = 0;
+          for (; n < 2 && i < s->length && hex_digit(p[i]) != -1; n++, i++) {
+            code = code * 16 + hex_digit(p[i]);
+          }
+          if (n == 0) {
+            return false;
+          }
+          out[(*length)++] = static_cast<char>(code);
+          break;
+        }
+        case 'u':
+          if (i < s->length && p[i] == '{') {
+            // \u{h h ...}, code points separated by spaces
+            i++;
+            while (true) {
+              while (i < s->length && p[i] == ' ') {
+                i++;
+              }
+              if (i >= s->length) {
+                return false;
+              }
+              if (p[i] == '}') {
+                i++;
+                break;
+              }
+              long code = 0;
+              int n = 0;
+              for (; n < 6 && i < s->length && hex_digit(p[i]) != -1; n++, i++) {
+                code = code * 16 + hex_digit(p[i]);
+              }
+              if (n == 0 || !put_utf8(code, out, length)) {
+                return false;
+              }
+            }
+          } else {
+            long code = 0;
+            for (auto n = 0; n < 4; n++, i++) {
+              if (i >= s->length || hex_digit(p[i]) == -1) {
+                return false;
+              }
+              code = code * 16 + hex_digit(p[i]);
+            }
+            if (!put_utf8(code, out, length)) {
+              return false;
+            }
+          }
+          break;
+        case 'c':
+        case 'C':
+        case 'M':
+          return false;
+        default:
+          if ('0' <= ch && ch <= '7') {
+            int code = ch - '0';
+            for (auto n = 1; n < 3 && i < s->length && '0' <= p[i] && p[i] <= '7'; n++, i++) {
+              code = code * 8 + p[i] - '0';
+            }
+            out[(*length)++] = static_cast<char>(code);
+          } else {
+            // others stand for themselves
+            out[(*length)++] = ch;
+          }
+      }
+      *index = i;
+      return true;
+    }
 
-      if (is_dynamic_part(t->l->first->s, 0)) {
-        auto expr_t = gcnew(0, "\"\\\\ ", gc_pool);
-        auto sc     = expr_t->first;
-        sc = sc->next = gcnew(t->l->first->s, gc_pool);
-        sc = sc->next = gcnew("\"", gc_pool);
-        auto expr_s = connect_chain(expr_t->first, gc_pool);
-        AT_STACK(expr, rb_str_new(expr_s->buffer, expr_s->length));
-        AT_STACK(ret, METHOD_CALL(location, METHOD(instance_eval), expr));
+    // the end of the expression of #{ at s[*index], just after its '}'. false unless it is closed
+    static bool skip_interpolation(String::string* s, long* index) {
+      auto i = *index + 2;
+      auto parents = 1;
+      char string_type = 0;
+      auto inside_string = false;
+      for (; i < s->length; i++) {
+        auto ch = s->buffer[i];
+        if (inside_string) {
+          if (ch == '\\') {
+            i++;
+          } else if (ch == string_type) {
+            inside_string = false;
+          }
+        } else if (ch == '"' || ch == '\'') {
+          string_type   = ch;
+          inside_string = true;
+        } else if (ch == '{') {
+          parents++;
+        } else if (ch == '}' && --parents == 0) {
+          *index = i + 1;
+          return true;
+        }
+      }
+      return false;
+    }
 
-        gc_register_value(ret, gc_pool);
-        auto rs = StringValuePtr(ret);
-        t->l->first->s = String::gcnew(rs, gc_pool);
+    // prefix + s[index..] + suffix, read as the content of a ruby double quoted string, split at
+    // #{}: texts has the unescaped texts around the expressions, code evaluates the expressions
+    // into an array, or is NULL if there are none. false if s has an escape not read here
+    static bool split_interpolation(String::string* s,
+                                    long index,
+                                    const char* prefix,
+                                    const char* suffix,
+                                    string_chain** texts,
+                                    String::string** code,
+                                    GC::gc* gc_pool) {
+      auto prefix_length = static_cast<long>(strlen(prefix));
+      auto suffix_length = static_cast<long>(strlen(suffix));
+      // no escape is longer than the bytes it is read into
+      auto buffer = GC::gc_alloc_n_char(prefix_length + s->length - index + suffix_length, gc_pool);
+      memcpy(buffer, prefix, static_cast<size_t>(prefix_length));
+      long length = prefix_length, start = 0;
+
+      string_chain *first = NULL, *last = NULL;
+      auto sc = gcnew("[", gc_pool);
+      auto expr = sc;
+      for (auto i = index; i < s->length;) {
+        auto ch = s->buffer[i];
+        if (ch == '\\') {
+          if (!read_escape(s, &i, buffer, &length)) {
+            return false;
+          }
+        } else if (ch == '#' && i + 1 < s->length && s->buffer[i + 1] == '{') {
+          auto j = i;
+          if (!skip_interpolation(s, &i)) {
+            return false;
+          }
+          auto text = gcnew(String::gcnew(buffer + start, length - start, gc_pool), gc_pool);
+          if (last != NULL) {
+            last = last->next = text;
+          } else {
+            first = last = text;
+          }
+          start = length;
+          // a comment in the expression ends at the newline
+          sc = sc->next = gcnew("(", gc_pool);
+          sc = sc->next = gcnew(String::gcnew(s->buffer + j + 2, i - j - 3, gc_pool), gc_pool);
+          sc = sc->next = gcnew("\n),", gc_pool);
+        } else {
+          buffer[length++] = ch;
+          i++;
+        }
+      }
+      memcpy(buffer + length, suffix, static_cast<size_t>(suffix_length));
+      length += suffix_length;
+
+      auto text = gcnew(String::gcnew(buffer + start, length - start, gc_pool), gc_pool);
+      if (last != NULL) {
+        last->next = text;
+        sc = sc->next = gcnew("]", gc_pool);
+        *code = connect_chain(expr, gc_pool);
       } else {
-        auto old_first = t->l->first;
-        t->l->first = gcnew("\\ ", gc_pool);
-        t->l->first->next = old_first;
+        first = text;
+        *code = NULL;
       }
-      return;
+      *texts = first;
+      return true;
     }
 
-    // return t.map &:escape_html
-    static void escapilze(tree* t, GC::gc* gc_pool) {
-      if (t == NULL) {
-        return;
+    // replace l by the texts of its interpolation and a SLOT_TEXT evaluating only its expressions,
+    // or by its text if it has none. return false if ruby has to evaluate all of l
+    static bool solve_interpolation(compiled* c,
+                                    line* l,
+                                    String::string* s,
+                                    long index,
+                                    const char* prefix,
+                                    const char* suffix,
+                                    GC::gc* gc_pool) {
+      string_chain* texts;
+      String::string* code;
+      if (!split_interpolation(s, index, prefix, suffix, &texts, &code, gc_pool)) {
+        return false;
       }
-
-      escapilze(t->subtree, gc_pool);
-      escapilze(t->next   , gc_pool);
-      auto old_first = t->l->first;
-      t->l->first = gcnew("& ", gc_pool);
-      t->l->first->next = old_first;
-      t->l->first->s = connect_chain(t->l->first, gc_pool);
-      t->l->first->next = NULL;
-      return;
+      if (code == NULL) {
+        l->first = l->last = texts;
+      } else {
+        auto sl = add_slot(c, l, SLOT_TEXT, code, gc_pool);
+        sl->texts = texts;
+      }
+      return true;
     }
 
-    static int calc_max_indent_depth(tree* t) {
-      if (t == NULL) {
-        return 0;
+    // return t.map &:plain
+    static void plainize(tree* t, compiled* c, GC::gc* gc_pool) {
+      for (; t != NULL; t = t->next) {
+        if (String::has_dynamic_part(t->l->first->s, 0)) {
+          if (solve_interpolation(c, t->l, t->l->first->s, 0, "\\ ", "", gc_pool)) {
+            plainize(t->subtree, c, gc_pool);
+            continue;
+          }
+          auto expr_t = gcnew(0, "\"\\\\ ", gc_pool);
+          auto sc     = expr_t->first;
+          sc = sc->next = gcnew(t->l->first->s, gc_pool);
+          sc = sc->next = gcnew("\"", gc_pool);
+          add_slot(c, t->l, SLOT_EXPR, connect_chain(expr_t->first, gc_pool), gc_pool);
+        } else {
+          auto old_first = t->l->first;
+          t->l->first = gcnew("\\ ", gc_pool);
+          t->l->first->next = old_first;
+        }
+        plainize(t->subtree, c, gc_pool);
       }
+      return;
+    }
 
-      auto max     = t->l->indent_depth;
-      auto subtree = calc_max_indent_depth(t->subtree);
-      auto next    = calc_max_indent_depth(t->next);
-      if (max < subtree) {
-        max = subtree;
-      }
-      if (max < next) {
-        max = next;
+    // return t.map &:escape_html
+    static void escapilze(tree* t, GC::gc* gc_pool) {
+      for (; t != NULL; t = t->next) {
+        escapilze(t->subtree, gc_pool);
+        auto old_first = t->l->first;
+        t->l->first = gcnew("& ", gc_pool);
+        t->l->first->next = old_first;
+        t->l->first->s = connect_chain(t->l->first, gc_pool);
+        t->l->first->next = NULL;
+        t->l->last = t->l->first;
       }
-      return max;
+      return;
     }
 
-    static String::string* flatten_(tree* t, int max_indent_depth, GC::gc* gc_pool);
+    static String::string* flatten_(tree* t, GC::gc* gc_pool);
     // return t.map &:preserve
-    static void preservate(tree* t, VALUE location, GC::gc* gc_pool) {
-      auto max_indent_depth = calc_max_indent_depth(t);
-      auto expr_t = gcnew(0, "\"\\\\ ", gc_pool);
-      auto sc     = expr_t->first;
-      sc = sc->next = gcnew(0, flatten_(t, max_indent_depth, gc_pool), gc_pool)->first;
-      sc = sc->next = gcnew("\".gsub(/\\n/,'&#x000A;')"
-                            ".gsub(/\\r/,'')"
-                            ".concat(\"\\n\")", gc_pool);
-      auto expr_s = connect_chain(expr_t->first, gc_pool);
-      AT_STACK(expr, rb_str_new(expr_s->buffer, expr_s->length));
-      AT_STACK(ret, METHOD_CALL(location, METHOD(instance_eval), expr));
-
-      gc_register_value(ret, gc_pool);
-      auto rs = StringValuePtr(ret);
-      t->l->first->s = String::gcnew(rs, gc_pool);
+    static void preservate(tree* t, compiled* c, GC::gc* gc_pool) {
+      auto s = flatten_(t, gc_pool);
+      string_chain* texts;
+      String::string* code;
+      if (!split_interpolation(s, 0, "\\ ", "", &texts, &code, gc_pool)) {
+        auto expr_t = gcnew(0, "\"\\\\ ", gc_pool);
+        auto sc     = expr_t->first;
+        sc = sc->next = gcnew(s, gc_pool);
+        sc = sc->next = gcnew("\"", gc_pool);
+        add_slot(c, t->l, SLOT_EXPR, connect_chain(expr_t->first, gc_pool), gc_pool)->preserve = PRESERVE_ALL;
+      } else if (code == NULL) {
+        t->l->first = gcnew(String::preserve_all(texts->s, gc_pool), gc_pool);
+      } else {
+        auto sl = add_slot(c, t->l, SLOT_TEXT, code, gc_pool);
+        sl->texts    = texts;
+        sl->preserve = PRESERVE_ALL;
+      }
       t->l->last = t->l->first;
       t->l->first->next = NULL;
       t->subtree = NULL;
@@ -439,7 +701,7 @@ namespace CHaml {
       return;
     }
 
-    static tree* solve_filter(tree* t, VALUE location, const Option& options, GC::gc* gc_pool) {
+    static tree* solve_filter(tree* t, compiled* c, const Option& options, GC::gc* gc_pool) {
       auto s = t->l->first->s;
       long index = 1;
       auto filter = String::tok(s, &index, gc_pool);
@@ -470,7 +732,7 @@ namespace CHaml {
           } else if (String::eq(filter, "plain")) {
             t->l->first->s = String::gcnew("", gc_pool);
             decrement_indents(t->subtree, options.default_indent_depth);
-            plainize(t->subtree, location, gc_pool);
+            plainize(t->subtree, c, gc_pool);
           }
           break;
         case 7:
@@ -485,7 +747,7 @@ namespace CHaml {
             t->l->first->s = String::gcnew("", gc_pool);
             if (t->subtree != NULL) {
               decrement_indents(t->subtree, t->subtree->l->indent_depth);
-              preservate(t->subtree, location, gc_pool);
+              preservate(t->subtree, c, gc_pool);
             }
           }
           break;
@@ -567,16 +829,27 @@ namespace CHaml {
           }
           index++;
       }
-      return is_dynamic_part(s, index);
+      return String::has_dynamic_part(s, index);
     }
 
-    // haml-formed attributes -> inner-formed attributes
-    static line* solve_attr(String::string* s, long* index, const Option& options, GC::gc* gc_pool) {
-      auto ret = gcnew(0, "@_h={};@_s={id:[nil],class:[]};", gc_pool);
-      auto sc  = ret->first;
+    static attr* gcnew_attr(int kind, String::string* name, String::string* value, GC::gc* gc_pool) {
+      auto ret = GCNEW(attr, gc_pool);
+      ret->next  = NULL;
+      ret->kind  = kind;
+      ret->name  = name;
+      ret->value = value;
+      return ret;
+    }
+
+    // haml-formed attributes -> the attributes of the tag. the ruby expressions of their values are
+    // put into values as the elements of an array literal, in the order of the attributes.
+    static attr* solve_attr(String::string* s, long* index, string_chain** values, GC::gc* gc_pool) {
+      attr *ret = NULL, *last = NULL;
+      auto sc = *values;
       auto i = *index;
       while (i < s->length) {
         auto ch = s->buffer[i];
+        attr* a;
         if (ch == '{') {
           auto j = i++;
           auto parents = 1;
@@ -617,17 +890,12 @@ namespace CHaml {
             }
             i++;
           }
-          s->buffer[j] = '[';
-          s->buffer[i - 1] = ']';
-          sc = sc->next = gcnew(String::gcnew(s->buffer + j, i - j, gc_pool), gc_pool);
-          sc = sc->next = gcnew(".each{|h|h.each{|k,v|k=k.to_sym;"
-              "if k==:id||k==:class;"
-                "@_s[k]<<v;"
-              "elsif v.is_a?Hash;"
-                "v.each{|s,t|@_h[[k,s].map{|x|x.to_s}.join('-').gsub('_','-')]=t};"
-              "else;"
-                "@_h[k]=v;"
-              "end}};", gc_pool);
+          // {...} -> [...], an array of the hashes
+          auto content = String::gcnew(s->buffer + j + 1, i - j - 2, gc_pool);
+          sc = sc->next = gcnew("[", gc_pool);
+          sc = sc->next = gcnew(content, gc_pool);
+          sc = sc->next = gcnew("],", gc_pool);
+          a = gcnew_attr(ATTR_HASH, NULL, content, gc_pool);
         } else if (ch == '(') {
           i++;
           while (i < s->length && ch != ')') {
@@ -643,261 +911,2004 @@ namespace CHaml {
               find_first_invalid_index(s, &i);
             }
             auto value = String::gcnew(s->buffer + j, i - j, gc_pool);
-            if (String::eq(key, "id") || String::eq(key, "class")) {
-              sc = sc->next = gcnew("@_s[:", gc_pool);
-              sc = sc->next = gcnew(key, gc_pool);
-              sc = sc->next = gcnew("]<<((", gc_pool);
-              sc = sc->next = gcnew(value, gc_pool);
-              sc = sc->next = gcnew(").to_s);", gc_pool);
+            sc = sc->next = gcnew("(", gc_pool);
+            sc = sc->next = gcnew(value, gc_pool);
+            sc = sc->next = gcnew("),", gc_pool);
+            a = gcnew_attr(ATTR_VALUE, key, value, gc_pool);
+            if (last != NULL) {
+              last = last->next = a;
             } else {
-              sc = sc->next = gcnew("@_h[:'", gc_pool);
-              sc = sc->next = gcnew(key, gc_pool);
-              sc = sc->next = gcnew("']=(", gc_pool);
-              sc = sc->next = gcnew(value, gc_pool);
-              sc = sc->next = gcnew(");", gc_pool);
+              ret = last = a;
             }
             find_first_valid_index(s, &i);
             ch = s->buffer[i];
           }
           i++;
+          continue;
         } else if (ch == '.') {
           auto j = ++i;
           find_first_invalid_index(s, &i);
-          auto klass = String::gcnew(s->buffer + j, i - j, gc_pool);
-          sc = sc->next = gcnew("@_s[:class]<<'", gc_pool);
-          sc = sc->next = gcnew(klass, gc_pool);
-          sc = sc->next = gcnew("';", gc_pool);
+          a = gcnew_attr(ATTR_CLASS, String::gcnew(s->buffer + j, i - j, gc_pool), NULL, gc_pool);
         } else if (ch == '#') {
           auto j = ++i;
           find_first_invalid_index(s, &i);
-          auto id = String::gcnew(s->buffer + j, i - j, gc_pool);
-          sc = sc->next = gcnew("@_s[:id][0]='", gc_pool);
-          sc = sc->next = gcnew(id, gc_pool);
-          sc = sc->next = gcnew("';", gc_pool);
+          a = gcnew_attr(ATTR_ID, String::gcnew(s->buffer + j, i - j, gc_pool), NULL, gc_pool);
         } else {
           break;
         }
+        if (last != NULL) {
+          last = last->next = a;
+        } else {
+          ret = last = a;
+        }
       }
-      if (options.format == FORMAT_XHTML) {
-        sc = sc->next = gcnew("@_attr=' '<<(("
-            "(@_h.to_a.map{|p|p[1]=p[0]if p[1]==true;\"#{p[0]}='#{p[1]}'\"})"
-            "<<(@_s[:class].empty??nil:'class=\\''<<(@_s[:class].flatten.sort.join' ')<<'\\'')"
-            "<<(@_s[:id].keep_if{|i|i}.empty??nil:'id=\\''<<(@_s[:id].join'_')<<'\\'')"
-            ").keep_if{|i|i}.join(' ').gsub('}','\\}'));", gc_pool);
-      } else {
-        sc = sc->next = gcnew("@_attr=' '<<(("
-            "(@_h.to_a.map{|p|if p[1]==true;p[0].to_s;else;\"#{p[0]}='#{p[1]}'\";end})"
-            "<<(@_s[:class].empty??nil:'class=\\''<<(@_s[:class].flatten.sort.join' ')<<'\\'')"
-            "<<(@_s[:id].keep_if{|i|i}.empty??nil:'id=\\''<<(@_s[:id].join'_')<<'\\'')"
-            ").keep_if{|i|i}.join(' ').gsub('}','\\}'));", gc_pool);
-      }
-      ret->last = sc;
-      *index = i;
+      *values = sc;
+      *index  = i;
       return ret;
     }
 
-#define PRESERVE ".gsub(@_r){|s|"                                                                     \
-                   "s=~@_r;"                                                                          \
-                   "r1,r2,r3=$1,$2,$3;"                                                               \
-                   "\"<#{r1}#{r2}>#{r3.chomp(\"\\n\").gsub(/\\n/,'&#x000A;').gsub(/\\r/,'')}</#{r1}>\"" \
-                 "}"
-    static line* convert_to_ruby_form_support(line* ret, string_chain* sc, String::string* s, long index, GC::gc* gc_pool) {
-      // opt
-      auto i = index;
-      auto j = String::skip_tag_options(s, &index);
-      auto opt = String::gcnew(s->buffer + i, index - i, gc_pool);
-      bool preserve = false;
-      if (j != -1) {  // '=' in tag options
-        if (s->buffer[j] == '~') {
-          preserve = true;
-        }
-        opt->buffer[j - i] = opt->buffer[opt->length - 1];
-        opt->length--;
-      }
-      sc = sc->next = gcnew(opt, gc_pool);
-      sc = sc->next = gcnew(" ' << ", gc_pool);
+    struct attr_builder {
+      attr_set *first, *last;  // the other attributes, in the order they were given first
+      VALUE classes;  // ids and classes may be arrays, they are flattened when the html is built
+      VALUE ids;
+      GC::gc* gc_pool;
+    };
+
+    static String::string* string_value(VALUE value, GC::gc* gc_pool) {
+      AT_STACK(rs, rb_obj_as_string(value));
+      gc_register_value(rs, gc_pool);
+      return String::gcnew(RSTRING_PTR(rs), RSTRING_LEN(rs), gc_pool);
+    }
 
-      // rest
-      auto rest = String::rest(s, &index, gc_pool);
-      if (j != -1) {  // '=' in tag options
-        sc = sc->next = gcnew("(", gc_pool);
-        sc = sc->next = gcnew(rest, gc_pool);
-        if (preserve) {
-          sc = sc->next = gcnew(").to_s" PRESERVE " << \"\\n\";", gc_pool);
-        } else {
-          sc = sc->next = gcnew(").to_s << \"\\n\";", gc_pool);
+    // a later value of an attribute replaces the earlier one, but keeps its place
+    static void set_attr(attr_builder* b, String::string* name, VALUE value) {
+      for (auto p = b->first; p != NULL; p = p->next) {
+        if (String::eq(p->name, name)) {
+          p->value = value;
+          return;
         }
+      }
+      auto p = GCNEW(attr_set, b->gc_pool);
+      p->next  = NULL;
+      p->name  = name;
+      p->value = value;
+      if (b->last != NULL) {
+        b->last = b->last->next = p;
       } else {
-        sc = sc->next = gcnew("\"", gc_pool);
-        sc = sc->next = gcnew(rest, gc_pool);
-        sc = sc->next = gcnew("\\n\";", gc_pool);
+        b->first = b->last = p;
       }
-      ret->last = sc;
-      return ret;
+      return;
     }
 
-    // haml -> ruby expression
-    static line* convert_to_ruby_form(line* l, const Option& options, GC::gc* gc_pool) {
-      auto s = l->first->s;
-      long index = 0;
-      find_first_valid_index(s, &index);
-      switch (s->buffer[index]) {
-        case '-': {
-          // "%buffer"
-          auto ret = gcnew(0, String::rest(s, index + 1, gc_pool), gc_pool);
-          auto sc  = ret->first;
-          sc = sc->next = gcnew(";", gc_pool);
-          ret->last = sc;
-          return ret;
-        }
-        case '=': {
-          // "@_ << (%buffer).to_s"
-          auto ret = gcnew(0, "@_ << ((", gc_pool);
-          auto sc  = ret->first;
-          sc = sc->next = gcnew(String::rest(s, index + 1, gc_pool), gc_pool);
-          sc = sc->next = gcnew(").to_s) << \"\\n\";", gc_pool);
-          ret->last = sc;
-          return ret;
+    struct data_attr_t {
+      attr_builder* b;
+      String::string* prefix;
+    };
+
+    // {:data => {:foo_bar => 1}} -> data-foo-bar='1'
+    static int build_data_attr(VALUE key, VALUE value, VALUE arg) {
+      auto d      = reinterpret_cast<data_attr_t*>(arg);
+      auto name   = string_value(key, d->b->gc_pool);
+      auto length = d->prefix->length + 1 + name->length;
+      auto buffer = GC::gc_alloc_n_char(length, d->b->gc_pool);
+      memcpy(buffer, d->prefix->buffer, static_cast<size_t>(d->prefix->length));
+      buffer[d->prefix->length] = '-';
+      memcpy(buffer + d->prefix->length + 1, name->buffer, static_cast<size_t>(name->length));
+      for (long i = 0; i < length; i++) {
+        if (buffer[i] == '_') {
+          buffer[i] = '-';
         }
-        case '~': {
-          // "@_ << (%buffer).to_s.preserve"
-          auto ret = gcnew(0, "@_ << ((", gc_pool);
-          auto sc  = ret->first;
-          sc = sc->next = gcnew(String::rest(s, index + 1, gc_pool), gc_pool);
-          sc = sc->next = gcnew(").to_s" PRESERVE ") << \"\\n\";", gc_pool);
-          ret->last = sc;
-          return ret;
-        }
-        case '&': {
-          // one of
-          // "@_ << '& ' << (%rest).to_s"
-          // "@_ << '& ' << \"%rest\""
-          auto ret = gcnew(0, "@_ << '& ' << ", gc_pool);
-          auto sc  = ret->first;
-
-          index++;
-          if (s->buffer[index] == '=') {
-            sc = sc->next = gcnew("((", gc_pool);
-            sc = sc->next = gcnew(String::rest(s, index + 1, gc_pool), gc_pool);
-            sc = sc->next = gcnew(").to_s) << \"\\n\";", gc_pool);
-          } else {
-            sc = sc->next = gcnew("\"", gc_pool);
-            sc = sc->next = gcnew(String::rest(s, index, gc_pool), gc_pool);
-            sc = sc->next = gcnew("\\n\";", gc_pool);
-          }
+      }
+      set_attr(d->b, String::gcnew(buffer, length, d->b->gc_pool), value);
+      return ST_CONTINUE;
+    }
 
-          ret->last = sc;
-          return ret;
-        }
-        case '!': {
-          // one of
-          // "@_ << '! ' << (%rest).to_s"
-          // "@_ << '! ' << \"%rest\""
-          auto ret = gcnew(0, "@_ << '! ' << ", gc_pool);
-          auto sc  = ret->first;
+    static int build_hash_attr(VALUE key, VALUE value, VALUE arg) {
+      auto b    = reinterpret_cast<attr_builder*>(arg);
+      auto name = string_value(key, b->gc_pool);
+      if (String::eq(name, "class")) {
+        rb_ary_push(b->classes, value);
+      } else if (String::eq(name, "id")) {
+        rb_ary_push(b->ids, value);
+      } else if (RB_TYPE_P(value, T_HASH)) {
+        data_attr_t d;
+        d.b      = b;
+        d.prefix = name;
+        rb_hash_foreach(value, RUBY_EACH_FUNC(build_data_attr), reinterpret_cast<VALUE>(&d));
+      } else {
+        set_attr(b, name, value);
+      }
+      return ST_CONTINUE;
+    }
 
-          index++;
-          if (s->buffer[index] == '=') {
-            sc = sc->next = gcnew("((", gc_pool);
-            sc = sc->next = gcnew(String::rest(s, index + 1, gc_pool), gc_pool);
-            sc = sc->next = gcnew(").to_s) << \"\\n\";", gc_pool);
-          } else {
-            sc = sc->next = gcnew("\"", gc_pool);
-            sc = sc->next = gcnew(String::rest(s, index, gc_pool), gc_pool);
-            sc = sc->next = gcnew("\\n\";", gc_pool);
+    // the strings of the classes or the ids in values, nested arrays are flattened
+    static long collect_names(VALUE values, String::string** names, long n, GC::gc* gc_pool) {
+      for (long i = 0; i < RARRAY_LEN(values); i++) {
+        AT_STACK(value, rb_ary_entry(values, i));
+        if (RB_TYPE_P(value, T_ARRAY)) {
+          n = collect_names(value, names, n, gc_pool);
+        } else if (RTEST(value)) {
+          auto name = string_value(value, gc_pool);
+          if (name->length > 0) {
+            if (names != NULL) {
+              names[n] = name;
+            }
+            n++;
           }
-
-          ret->last = sc;
-          return ret;
         }
-        case '.':
-        case '#': {
-          // "@_ << '%%div{' << %attr << '}' << %opt << ' ' << %rest"
+      }
+      return n;
+    }
 
-          // 'div' tag
-          auto ret = gcnew(0, "@_ << '%div{';", gc_pool);
-          auto sc = ret->first;
+    static long count_names(VALUE values) {
+      long n = 0;
+      for (long i = 0; i < RARRAY_LEN(values); i++) {
+        AT_STACK(value, rb_ary_entry(values, i));
+        n += RB_TYPE_P(value, T_ARRAY) ? count_names(value) : 1;
+      }
+      return n;
+    }
 
-          // attr
-          auto attr = solve_attr(s, &index, options, gc_pool);
-          sc->next = attr->first;
-          sc = attr->last;
-          sc = sc->next = gcnew("@_ << @_attr << '}", gc_pool);
+    static int compare_names(const void* a, const void* b) {
+      auto s1 = *static_cast<String::string* const*>(a);
+      auto s2 = *static_cast<String::string* const*>(b);
+      auto n  = s1->length < s2->length ? s1->length : s2->length;
+      auto r  = memcmp(s1->buffer, s2->buffer, static_cast<size_t>(n));
+      if (r != 0) {
+        return r;
+      }
+      return s1->length < s2->length ? -1 : s1->length > s2->length ? 1 : 0;
+    }
 
-          return convert_to_ruby_form_support(ret, sc, s, index, gc_pool);
-        }
-        case '%': {
-          // one of
-          // "@_ << '%tag'                  << %opt << ' ' << %rest"
-          // "@_ << '%tag{' << %attr << '}' << %opt << ' ' << %rest"
+    static void append_attr(string_chain** sc, String::string* name, String::string* value, GC::gc* gc_pool) {
+      *sc = (*sc)->next = gcnew(" ", gc_pool);
+      *sc = (*sc)->next = gcnew(name, gc_pool);
+      *sc = (*sc)->next = gcnew("='", gc_pool);
+      *sc = (*sc)->next = gcnew(String::escape_html(value, gc_pool), gc_pool);
+      *sc = (*sc)->next = gcnew("'", gc_pool);
+      return;
+    }
 
-          // tag
-          auto ret = gcnew(0, "@_ << '", gc_pool);
-          auto sc  = ret->first;
-          sc = sc->next = gcnew(String::tok(s, &index, gc_pool), gc_pool);
+    // a boolean attribute is written as its name, or name='name' in xhtml
+    static void append_boolean_attr(string_chain** sc, String::string* name, const Option& options, GC::gc* gc_pool) {
+      if (options.format == FORMAT_XHTML) {
+        append_attr(sc, name, name, gc_pool);
+      } else {
+        *sc = (*sc)->next = gcnew(" ", gc_pool);
+        *sc = (*sc)->next = gcnew(name, gc_pool);
+      }
+      return;
+    }
 
-          // attr
+    // n names joined by sep, sorted if sort
+    static String::string* join_strings(String::string** names, long n, const char* sep, bool sort, GC::gc* gc_pool) {
+      if (n == 0) {
+        return NULL;
+      }
+      if (sort) {
+        qsort(names, static_cast<size_t>(n), sizeof(String::string*), compare_names);
+      }
+      auto ret = gcnew(names[0], gc_pool);
+      auto sc  = ret;
+      for (long i = 1; i < n; i++) {
+        sc = sc->next = gcnew(sep, gc_pool);
+        sc = sc->next = gcnew(names[i], gc_pool);
+      }
+      return connect_chain(ret, gc_pool);
+    }
+
+    // the names in values joined by sep, sorted if sort
+    static String::string* join_names(VALUE values, const char* sep, bool sort, GC::gc* gc_pool) {
+      auto n = count_names(values);
+      if (n == 0) {
+        return NULL;
+      }
+      auto names = GC::gc_alloc_n_string(n, gc_pool);
+      n = collect_names(values, names, 0, gc_pool);
+      return join_strings(names, n, sep, sort, gc_pool);
+    }
+
+    // the html of the attributes of a tag: the other attributes in the order given, the sorted
+    // classes and the ids joined by '_'. values has the values of the dynamic attributes of a.
+    static String::string* build_attr(attr* a, VALUE values, const Option& options, GC::gc* gc_pool) {
+      attr_builder b;
+      b.first   = b.last = NULL;
+      AT_STACK(classes, rb_ary_new());
+      AT_STACK(ids, rb_ary_new());
+      b.classes = classes;
+      b.ids     = ids;
+      b.gc_pool = gc_pool;
+
+      long k = 0;
+      VALUE shorthand_id = Qnil;
+      for (; a != NULL; a = a->next) {
+        switch (a->kind) {
+          case ATTR_CLASS:
+            rb_ary_push(classes, rb_str_new(a->name->buffer, a->name->length));
+            break;
+          case ATTR_ID:
+            // the last #id wins
+            shorthand_id = rb_str_new(a->name->buffer, a->name->length);
+            break;
+          case ATTR_VALUE: {
+            AT_STACK(value, rb_ary_entry(values, k++));
+            if (String::eq(a->name, "class")) {
+              rb_ary_push(classes, value);
+            } else if (String::eq(a->name, "id")) {
+              rb_ary_push(ids, value);
+            } else {
+              set_attr(&b, a->name, value);
+            }
+            break;
+          }
+          case ATTR_HASH: {
+            AT_STACK(hashes, rb_ary_entry(values, k++));
+            for (long i = 0; i < RARRAY_LEN(hashes); i++) {
+              AT_STACK(hash, rb_convert_type(rb_ary_entry(hashes, i), T_HASH, "Hash", "to_hash"));
+              rb_hash_foreach(hash, RUBY_EACH_FUNC(build_hash_attr), reinterpret_cast<VALUE>(&b));
+            }
+            break;
+          }
+        }
+      }
+      if (!NIL_P(shorthand_id)) {
+        rb_ary_unshift(ids, shorthand_id);
+      }
+
+      auto ret = gcnew("", gc_pool);
+      auto sc  = ret;
+      for (auto p = b.first; p != NULL; p = p->next) {
+        if (p->value == Qtrue) {
+          append_boolean_attr(&sc, p->name, options, gc_pool);
+        } else if (RTEST(p->value)) {
+          append_attr(&sc, p->name, string_value(p->value, gc_pool), gc_pool);
+        }
+      }
+      auto klass = join_names(classes, " ", true, gc_pool);
+      if (klass != NULL) {
+        append_attr(&sc, String::gcnew("class", gc_pool), klass, gc_pool);
+      }
+      auto id = join_names(ids, "_", false, gc_pool);
+      if (id != NULL) {
+        append_attr(&sc, String::gcnew("id", gc_pool), id, gc_pool);
+      }
+      return connect_chain(ret, gc_pool);
+    }
+
+    // literals in the values of attributes, read at compile time. a reader returns false unless
+    // s has one at *index, the expressions of other values are left to ruby.
+
+    static bool is_name_char(char ch) {
+      return ('a' <= ch && ch <= 'z') || ('A' <= ch && ch <= 'Z') || ('0' <= ch && ch <= '9') || ch == '_';
+    }
+
+    // 'string' or "string", a double quoted string is read unless it may be interpolated or escaped
+    static bool read_quoted(String::string* s, long* index, String::string** value, GC::gc* gc_pool) {
+      auto i     = *index;
+      auto quote = s->buffer[i++];
+      auto j     = i;
+      auto escaped = false;
+      for (; i < s->length && s->buffer[i] != quote; i++) {
+        if (quote == '"' && (s->buffer[i] == '\\' || s->buffer[i] == '#')) {
+          return false;
+        }
+        if (s->buffer[i] == '\\') {
+          escaped = true;
+          i++;
+        }
+      }
+      if (i >= s->length) {
+        return false;
+      }
+      if (escaped) {
+        // only \\ and \' are escapes in single quotes
+        auto buffer = GC::gc_alloc_n_char(i - j, gc_pool);
+        long length = 0;
+        for (auto k = j; k < i; k++) {
+          if (s->buffer[k] == '\\' && (s->buffer[k + 1] == '\\' || s->buffer[k + 1] == '\'')) {
+            k++;
+          }
+          buffer[length++] = s->buffer[k];
+        }
+        *value = String::gcnew(buffer, length, gc_pool);
+      } else {
+        *value = String::gcnew(s->buffer + j, i - j, gc_pool);
+      }
+      *index = i + 1;
+      return true;
+    }
+
+    // the name of a symbol or a label
+    static bool read_name(String::string* s, long* index, String::string** value, GC::gc* gc_pool) {
+      auto i = *index;
+      if (i >= s->length || !is_name_char(s->buffer[i]) || ('0' <= s->buffer[i] && s->buffer[i] <= '9')) {
+        return false;
+      }
+      while (i < s->length && is_name_char(s->buffer[i])) {
+        i++;
+      }
+      if (i < s->length && (s->buffer[i] == '?' || s->buffer[i] == '!')) {
+        i++;
+      }
+      *value  = String::gcnew(s->buffer + *index, i - *index, gc_pool);
+      *index = i;
+      return true;
+    }
+
+    // a decimal integer written as its to_s is
+    static bool read_integer(String::string* s, long* index, String::string** value, GC::gc* gc_pool) {
+      auto i = *index;
+      if (i < s->length && s->buffer[i] == '-') {
+        i++;
+      }
+      auto j = i;
+      while (i < s->length && '0' <= s->buffer[i] && s->buffer[i] <= '9') {
+        i++;
+      }
+      if (i == j || (s->buffer[j] == '0' && i - j > 1) || (i < s->length && (is_name_char(s->buffer[i]) || s->buffer[i] == '.'))) {
+        return false;
+      }
+      *value  = String::gcnew(s->buffer + *index, i - *index, gc_pool);
+      *index = i;
+      return true;
+    }
+
+    // a string, a symbol, an integer, true, false or nil. kind is ATTR_VALUE, ATTR_TRUE or ATTR_FALSE
+    static bool read_literal(String::string* s, long* index, int* kind, String::string** value, GC::gc* gc_pool) {
+      find_first_valid_index(s, index);
+      if (*index >= s->length) {
+        return false;
+      }
+      *kind = ATTR_VALUE;
+      switch (s->buffer[*index]) {
+        case '\'':
+        case '"':
+          return read_quoted(s, index, value, gc_pool);
+        case ':':
+          ++*index;
+          if (*index < s->length && (s->buffer[*index] == '\'' || s->buffer[*index] == '"')) {
+            return read_quoted(s, index, value, gc_pool);
+          }
+          return read_name(s, index, value, gc_pool);
+      }
+      if (read_integer(s, index, value, gc_pool)) {
+        return true;
+      }
+      auto i = *index;
+      if (!read_name(s, &i, value, gc_pool)) {
+        return false;
+      }
+      if (String::eq(*value, "true")) {
+        *kind = ATTR_TRUE;
+      } else if (String::eq(*value, "false") || String::eq(*value, "nil")) {
+        *kind = ATTR_FALSE;
+      } else {
+        return false;
+      }
+      *index = i;
+      return true;
+    }
+
+    // :name =>, 'name' =>, name: or 'name':
+    static bool read_key(String::string* s, long* index, String::string** name, GC::gc* gc_pool) {
+      auto i = *index;
+      find_first_valid_index(s, &i);
+      if (i >= s->length) {
+        return false;
+      }
+      auto label = false;
+      switch (s->buffer[i]) {
+        case ':':
+          i++;
+          if (i < s->length && (s->buffer[i] == '\'' || s->buffer[i] == '"')) {
+            if (!read_quoted(s, &i, name, gc_pool)) {
+              return false;
+            }
+          } else if (!read_name(s, &i, name, gc_pool)) {
+            return false;
+          }
+          break;
+        case '\'':
+        case '"':
+          if (!read_quoted(s, &i, name, gc_pool)) {
+            return false;
+          }
+          label = i < s->length && s->buffer[i] == ':';
+          break;
+        default:
+          if (!read_name(s, &i, name, gc_pool) || i >= s->length || s->buffer[i] != ':') {
+            return false;
+          }
+          label = true;
+      }
+      if (label) {
+        if (i + 1 < s->length && s->buffer[i + 1] == ':') {
+          return false;
+        }
+        *index = i + 1;
+        return true;
+      }
+      find_first_valid_index(s, &i);
+      if (i + 1 >= s->length || s->buffer[i] != '=' || s->buffer[i + 1] != '>') {
+        return false;
+      }
+      *index = i + 2;
+      return true;
+    }
+
+    struct literal_builder {
+      attr *first, *last;  // the other attributes, with the kinds of their values
+      string_chain *classes, *classes_last;
+      string_chain *ids, *ids_last;
+      long class_count, id_count;
+      GC::gc* gc_pool;
+    };
+
+    static void push_name(string_chain** first, string_chain** last, long* count, String::string* name, GC::gc* gc_pool) {
+      auto sc = gcnew(name, gc_pool);
+      if (*last != NULL) {
+        *last = (*last)->next = sc;
+      } else {
+        *first = *last = sc;
+      }
+      ++*count;
+      return;
+    }
+
+    // the same as set_attr and the class and id arrays of build_attr do for the values from ruby
+    static void set_literal(literal_builder* b, String::string* name, int kind, String::string* value) {
+      auto is_class = String::eq(name, "class");
+      if (is_class || String::eq(name, "id")) {
+        if (kind == ATTR_TRUE) {
+          value = String::gcnew("true", b->gc_pool);
+        } else if (kind == ATTR_FALSE || value->length == 0) {
+          return;
+        }
+        if (is_class) {
+          push_name(&b->classes, &b->classes_last, &b->class_count, value, b->gc_pool);
+        } else {
+          push_name(&b->ids, &b->ids_last, &b->id_count, value, b->gc_pool);
+        }
+        return;
+      }
+      for (auto p = b->first; p != NULL; p = p->next) {
+        if (String::eq(p->name, name)) {
+          p->kind  = kind;
+          p->value = value;
+          return;
+        }
+      }
+      auto p = gcnew_attr(kind, name, value, b->gc_pool);
+      if (b->last != NULL) {
+        b->last = b->last->next = p;
+      } else {
+        b->first = b->last = p;
+      }
+      return;
+    }
+
+    static String::string* join_chain(string_chain* sc, long n, const char* sep, bool sort, GC::gc* gc_pool) {
+      if (n == 0) {
+        return NULL;
+      }
+      auto names = GC::gc_alloc_n_string(n, gc_pool);
+      for (long i = 0; sc != NULL; sc = sc->next) {
+        names[i++] = sc->s;
+      }
+      return join_strings(names, n, sep, sort, gc_pool);
+    }
+
+    // the html build_attr would build for a, if all of the values of a are literals. NULL otherwise
+    static String::string* literal_attr(attr* a, const Option& options, GC::gc* gc_pool) {
+      literal_builder b;
+      b.first   = b.last = NULL;
+      b.classes = b.classes_last = b.ids = b.ids_last = NULL;
+      b.class_count = b.id_count = 0;
+      b.gc_pool = gc_pool;
+
+      String::string* shorthand_id = NULL;
+      for (; a != NULL; a = a->next) {
+        switch (a->kind) {
+          case ATTR_CLASS:
+            if (a->name->length > 0) {
+              push_name(&b.classes, &b.classes_last, &b.class_count, a->name, gc_pool);
+            }
+            break;
+          case ATTR_ID:
+            shorthand_id = a->name;
+            break;
+          case ATTR_VALUE: {
+            long i = 0;
+            int kind;
+            String::string* value;
+            if (!read_literal(a->value, &i, &kind, &value, gc_pool)) {
+              return NULL;
+            }
+            find_first_valid_index(a->value, &i);
+            if (i != a->value->length) {
+              return NULL;
+            }
+            set_literal(&b, a->name, kind, value);
+            break;
+          }
+          case ATTR_HASH: {
+            auto s = a->value;
+            long i = 0;
+            while (find_first_valid_index(s, &i)) {
+              int kind;
+              String::string *name, *value;
+              if (!read_key(s, &i, &name, gc_pool) || !read_literal(s, &i, &kind, &value, gc_pool)) {
+                return NULL;
+              }
+              set_literal(&b, name, kind, value);
+              find_first_valid_index(s, &i);
+              if (i < s->length) {
+                if (s->buffer[i] != ',') {
+                  return NULL;
+                }
+                i++;
+              }
+            }
+            break;
+          }
+        }
+      }
+      if (shorthand_id != NULL && shorthand_id->length > 0) {
+        auto sc = gcnew(shorthand_id, gc_pool);
+        sc->next = b.ids;
+        b.ids = sc;
+        b.id_count++;
+      }
+
+      auto ret = gcnew("", gc_pool);
+      auto sc  = ret;
+      for (auto p = b.first; p != NULL; p = p->next) {
+        if (p->kind == ATTR_TRUE) {
+          append_boolean_attr(&sc, p->name, options, gc_pool);
+        } else if (p->kind == ATTR_VALUE) {
+          append_attr(&sc, p->name, p->value, gc_pool);
+        }
+      }
+      auto klass = join_chain(b.classes, b.class_count, " ", true, gc_pool);
+      if (klass != NULL) {
+        append_attr(&sc, String::gcnew("class", gc_pool), klass, gc_pool);
+      }
+      auto id = join_chain(b.ids, b.id_count, "_", false, gc_pool);
+      if (id != NULL) {
+        append_attr(&sc, String::gcnew("id", gc_pool), id, gc_pool);
+      }
+      return connect_chain(ret, gc_pool);
+    }
+
+    static line* convert_to_ruby_form_support(line* ret, string_chain* sc, String::string* s, long index, GC::gc* gc_pool) {
+      // opt
+      auto i = index;
+      auto j = String::skip_tag_options(s, &index);
+      auto opt = String::gcnew(s->buffer + i, index - i, gc_pool);
+      if (j != -1) {  // '=' or '~' in tag options
+        // drop '=' from a copy, the source line is kept for the next render
+        auto buffer = GC::gc_alloc_n_char(opt->length, gc_pool);
+        memcpy(buffer, opt->buffer, static_cast<size_t>(opt->length));
+        buffer[j - i] = buffer[opt->length - 1];
+        opt = String::gcnew(buffer, opt->length - 1, gc_pool);
+      }
+      sc = sc->next = gcnew(opt, gc_pool);
+      sc = sc->next = gcnew(" ' << ", gc_pool);
+
+      // rest
+      auto rest = String::rest(s, &index, gc_pool);
+      if (j != -1) {  // '=' in tag options
+        sc = sc->next = gcnew("(", gc_pool);
+        sc = sc->next = gcnew(rest, gc_pool);
+        sc = sc->next = gcnew(").to_s << \"\\n\";", gc_pool);
+      } else {
+        sc = sc->next = gcnew("\"", gc_pool);
+        sc = sc->next = gcnew(rest, gc_pool);
+        sc = sc->next = gcnew("\\n\";", gc_pool);
+      }
+      ret->last = sc;
+      return ret;
+    }
+
+    // "(_chaml_a=[%values];@_='';@_ << '%opt ' << %rest\n_chaml_a<<@_)"
+    // ruby evaluates the values of the attributes and the rest only, build_attr does the others
+    static line* convert_tag_to_ruby_form(String::string* s, long index, attr** attrs, GC::gc* gc_pool) {
+      auto ret = gcnew(0, "(_chaml_a=[", gc_pool);
+      auto sc  = ret->first;
+      *attrs = solve_attr(s, &index, &sc, gc_pool);
+      sc = sc->next = gcnew("];@_='';@_ << '", gc_pool);
+
+      ret = convert_to_ruby_form_support(ret, sc, s, index, gc_pool);
+      ret->last = ret->last->next = gcnew("\n_chaml_a<<@_)", gc_pool);
+      return ret;
+    }
+
+    // haml -> ruby expression, a tag with attributes sets tag and attrs
+    static line* convert_to_ruby_form(line* l, String::string** tag, attr** attrs, GC::gc* gc_pool) {
+      auto s = l->first->s;
+      long index = 0;
+      find_first_valid_index(s, &index);
+      switch (s->buffer[index]) {
+        case '-': {
+          // "%buffer"
+          auto ret = gcnew(0, String::rest(s, index + 1, gc_pool), gc_pool);
+          auto sc  = ret->first;
+          sc = sc->next = gcnew(";", gc_pool);
+          ret->last = sc;
+          return ret;
+        }
+        case '=': {
+          // "@_ << (%buffer).to_s"
+          auto ret = gcnew(0, "@_ << ((", gc_pool);
+          auto sc  = ret->first;
+          sc = sc->next = gcnew(String::rest(s, index + 1, gc_pool), gc_pool);
+          sc = sc->next = gcnew(").to_s) << \"\\n\";", gc_pool);
+          ret->last = sc;
+          return ret;
+        }
+        case '~': {
+          // "@_ << (%buffer).to_s", the value is preserved by slot_values
+          auto ret = gcnew(0, "@_ << ((", gc_pool);
+          auto sc  = ret->first;
+          sc = sc->next = gcnew(String::rest(s, index + 1, gc_pool), gc_pool);
+          sc = sc->next = gcnew(").to_s) << \"\\n\";", gc_pool);
+          ret->last = sc;
+          return ret;
+        }
+        case '&': {
+          // one of
+          // "@_ << '& ' << (%rest).to_s"
+          // "@_ << '& ' << \"%rest\""
+          auto ret = gcnew(0, "@_ << '& ' << ", gc_pool);
+          auto sc  = ret->first;
+
+          index++;
+          if (s->buffer[index] == '=') {
+            sc = sc->next = gcnew("((", gc_pool);
+            sc = sc->next = gcnew(String::rest(s, index + 1, gc_pool), gc_pool);
+            sc = sc->next = gcnew(").to_s) << \"\\n\";", gc_pool);
+          } else {
+            sc = sc->next = gcnew("\"", gc_pool);
+            sc = sc->next = gcnew(String::rest(s, index, gc_pool), gc_pool);
+            sc = sc->next = gcnew("\\n\";", gc_pool);
+          }
+
+          ret->last = sc;
+          return ret;
+        }
+        case '!': {
+          // one of
+          // "@_ << '! ' << (%rest).to_s"
+          // "@_ << '! ' << \"%rest\""
+          auto ret = gcnew(0, "@_ << '! ' << ", gc_pool);
+          auto sc  = ret->first;
+
+          index++;
+          if (s->buffer[index] == '=') {
+            sc = sc->next = gcnew("((", gc_pool);
+            sc = sc->next = gcnew(String::rest(s, index + 1, gc_pool), gc_pool);
+            sc = sc->next = gcnew(").to_s) << \"\\n\";", gc_pool);
+          } else {
+            sc = sc->next = gcnew("\"", gc_pool);
+            sc = sc->next = gcnew(String::rest(s, index, gc_pool), gc_pool);
+            sc = sc->next = gcnew("\\n\";", gc_pool);
+          }
+
+          ret->last = sc;
+          return ret;
+        }
+        case '.':
+        case '#':
+          // 'div' tag
+          *tag = String::gcnew("%div", gc_pool);
+          return convert_tag_to_ruby_form(s, index, attrs, gc_pool);
+        case '%': {
+          // "@_ << '%tag' << %opt << ' ' << %rest" unless the tag has attributes
+          auto name = String::tok(s, &index, gc_pool);
           switch (s->buffer[index]) {
             case '{':
             case '(':
             case '.':
-            case '#': {
-              sc = sc->next = gcnew("{';", gc_pool);
-              auto attr = solve_attr(s, &index, options, gc_pool);
-              sc->next = attr->first;
-              sc = attr->last;
-              sc = sc->next = gcnew("@_ << @_attr << '}", gc_pool);
-              break;
-            }
+            case '#':
+              *tag = name;
+              return convert_tag_to_ruby_form(s, index, attrs, gc_pool);
           }
 
-          return convert_to_ruby_form_support(ret, sc, s, index, gc_pool);
+          auto ret = gcnew(0, "@_ << '", gc_pool);
+          auto sc  = ret->first;
+          sc = sc->next = gcnew(name, gc_pool);
+          return convert_to_ruby_form_support(ret, sc, s, index, gc_pool);
+        }
+        default: {
+          // "@_ << \"%buffer\""
+          String::chomp(s);
+          auto ret = gcnew(0, "@_ << \"", gc_pool);
+          auto sc  = ret->first;
+          sc = sc->next = gcnew(s, gc_pool);
+          sc = sc->next = gcnew("\\n\";", gc_pool);
+          ret->last = sc;
+          return ret;
+        }
+      }
+    }
+
+    static long skip_attributes(String::string* s, long index);
+
+    // "%tag" + the options and the rest of s, the line of a tag whose attributes are literals.
+    // NULL if the rest is a script or has a dynamic part.
+    static String::string* static_tag_line(String::string* s, String::string* tag, GC::gc* gc_pool) {
+      long index = 0;
+      find_first_valid_index(s, &index);
+      if (s->buffer[index] == '%') {
+        String::tok(s, &index, gc_pool);
+      }
+      index = skip_attributes(s, index);
+      auto i = index;
+      if (String::skip_tag_options(s, &i) != -1 || String::has_dynamic_part(s, i)) {
+        return NULL;
+      }
+      auto length = tag->length + s->length - index;
+      auto buffer = GC::gc_alloc_n_char(length, gc_pool);
+      memcpy(buffer, tag->buffer, static_cast<size_t>(tag->length));
+      memcpy(buffer + tag->length, s->buffer + index, static_cast<size_t>(s->length - index));
+      return String::gcnew(buffer, length, gc_pool);
+    }
+
+    // return true iff. l ~ /^~/ or its tag options have '~'
+    static bool preserved_script(line* l) {
+      auto s = l->first->s;
+      long index = 0;
+      find_first_valid_index(s, &index);
+      switch (s->buffer[index]) {
+        case '~':
+          return true;
+        case '%':
+          index++;
+          find_first_invalid_index(s, &index);
+          break;
+        case '.':
+        case '#':
+          break;
+        default:
+          return false;
+      }
+      index = skip_attributes(s, index);
+      auto j = String::skip_tag_options(s, &index);
+      return j != -1 && s->buffer[j] == '~';
+    }
+
+    // a text line, or a '&' or '!' one, with #{} or escapes -> its texts and a SLOT_TEXT.
+    // return false for the other lines
+    static bool solve_text(compiled* c, line* l, GC::gc* gc_pool) {
+      auto s = l->first->s;
+      long index = 0;
+      find_first_valid_index(s, &index);
+      switch (s->buffer[index]) {
+        case '-':
+        case '=':
+        case '~':
+        case ':':
+        case '.':
+        case '#':
+        case '%':
+        case '\\':
+          return false;
+        case '&':
+        case '!': {
+          auto prefix = s->buffer[index] == '&' ? "& " : "! ";
+          index++;
+          if (index < s->length && s->buffer[index] == '=') {
+            return false;
+          }
+          find_first_valid_index(s, &index);
+          return solve_interpolation(c, l, s, index, prefix, "\n", gc_pool);
+        }
+      }
+      String::chomp(s);
+      return solve_interpolation(c, l, s, 0, "", "\n", gc_pool);
+    }
+
+    static bool is_partial_name_char(char ch) {
+      return is_name_char(ch) || ch == '-' || ch == '.' || ch == '/';
+    }
+
+    // "+ name" without a subtree, "+ content_for name" or "+ yield [name]" without a subtree.
+    // return the kind of its slot and set name, or return -1 if the line is a text.
+    static int directive(tree* t, String::string** name, GC::gc* gc_pool) {
+      auto s = t->l->first->s;
+      long index = 0;
+      if (t->l->first != t->l->last || !find_first_valid_index(s, &index) || s->buffer[index] != '+' ||
+          index + 1 >= s->length || s->buffer[index + 1] != ' ') {
+        return -1;
+      }
+
+      String::string* words[2];
+      long n   = 0;
+      auto end = find_last_valid_index(s) + 1;
+      for (index++; find_first_valid_index(s, &index) && index < end; n++) {
+        auto start = index;
+        while (index < end && is_partial_name_char(s->buffer[index])) {
+          index++;
+        }
+        if (index == start || n == 2 || (index < end && s->buffer[index] != ' ' && s->buffer[index] != '\t')) {
+          return -1;
+        }
+        words[n] = String::gcnew(s->buffer + start, index - start, gc_pool);
+      }
+
+      if (n >= 1 && String::eq(words[0], "yield") && t->subtree == NULL) {
+        *name = n == 2 ? words[1] : String::gcnew("", gc_pool);
+        return SLOT_YIELD;
+      }
+      if (n == 2 && String::eq(words[0], "content_for")) {
+        *name = words[1];
+        return SLOT_CONTENT;
+      }
+      if (n == 1 && t->subtree == NULL) {
+        *name = words[0];
+        return SLOT_PARTIAL;
+      }
+      return -1;
+    }
+
+    // haml -> haml whose dynamic lines are replaced by slots
+    static tree* solve_scripts(tree* t, compiled* c, const Option& options, GC::gc* gc_pool) {
+      for (auto p = t; p != NULL; p = p->next) {
+        String::string* name = NULL;
+        auto kind = directive(p, &name, gc_pool);
+        if (kind != -1) {
+          // the line is left empty, the html of the directive is written in place of it
+          auto lineno = p->l->lineno;
+          p->l = gcnew(p->l->indent_depth, "", gc_pool);
+          p->l->lineno  = lineno;
+          p->l->is_html = true;
+          auto sl = add_slot(c, p->l, kind, name, gc_pool);
+          if (kind == SLOT_CONTENT) {
+            // the content is built apart from the page and written where the layout yields it
+            if (p->subtree != NULL) {
+              decrement_indents(p->subtree, p->subtree->l->indent_depth);
+            }
+            sl->content = solve_scripts(p->subtree, c, options, gc_pool);
+            p->subtree  = NULL;
+            p->l->slot  = -1;
+            p->l->indent_depth = 0;
+          }
+        } else if (is_dynamic(p->l->first->s)) {
+          if (is_filter(p->l)) {
+            // skip the closing lines put after the filter
+            p = solve_filter(p, c, options, gc_pool);
+          } else if (p->subtree != NULL && is_script(p->l)) {
+            // TODO: implement
+          } else if (solve_text(c, p->l, gc_pool)) {
+            solve_scripts(p->subtree, c, options, gc_pool);
+          } else {
+            String::string* tag = NULL;
+            attr* attrs = NULL;
+            auto code = connect_chain(convert_to_ruby_form(p->l, &tag, &attrs, gc_pool)->first, gc_pool);
+            if (silent_script(p->l)) {
+              auto lineno = p->l->lineno;
+              p->l = gcnew(0, "", gc_pool);
+              p->l->lineno = lineno;
+              add_slot(c, p->l, SLOT_SILENT, code, gc_pool);
+            } else if (tag != NULL) {
+              auto html = literal_attr(attrs, options, gc_pool);
+              auto s    = html != NULL ? static_tag_line(p->l->first->s, tag, gc_pool) : NULL;
+              if (s != NULL) {
+                // nothing to evaluate, the line is left to fold_static
+                p->l->first->s = s;
+                p->l->attr     = html;
+              } else {
+                auto sl = add_slot(c, p->l, SLOT_TAG, code, gc_pool);
+                sl->tag      = tag;
+                sl->attrs    = attrs;
+                sl->html     = html;
+                sl->preserve = preserved_script(p->l) ? PRESERVE_TAGS : PRESERVE_NONE;
+              }
+            } else {
+              auto sl = add_slot(c, p->l, SLOT_LINE, code, gc_pool);
+              sl->preserve = preserved_script(p->l) ? PRESERVE_TAGS : PRESERVE_NONE;
+            }
+            solve_scripts(p->subtree, c, options, gc_pool);
+          }
+        } else {
+          solve_scripts(p->subtree, c, options, gc_pool);
+        }
+      }
+      return t;
+    }
+
+    static tree* fold_static(tree* t, bool safe, bool trim_after, const Option& options, GC::gc* gc_pool);
+    static bool may_remove_whitespace(line* l, GC::gc* gc_pool);
+
+    // slots -> the statements returning the values of all slots in an array
+    // the newlines putting the next code of the script on line lineno of the template
+    static string_chain* pad_script(int* line, int lineno, GC::gc* gc_pool) {
+      auto length = lineno - *line;
+      if (length <= 0) {
+        return NULL;
+      }
+      auto buffer = GC::gc_alloc_n_char(length, gc_pool);
+      memset(buffer, '\n', static_cast<size_t>(length));
+      *line = lineno;
+      return gcnew(String::gcnew(buffer, length, gc_pool), gc_pool);
+    }
+
+    // the code of each slot starts on the line of the slot, so that the backtraces point into the
+    // template. the statements between them go on the lines of the codes, a code may end with a
+    // comment so a newline still follows each.
+    static String::string* build_script(compiled* c, GC::gc* gc_pool) {
+      auto script = gcnew(0, "_chaml=[];", gc_pool);
+      auto sc     = script->first;
+      auto line   = 1;
+      for (auto p = c->slots; p != NULL; p = p->next) {
+        auto pad = pad_script(&line, p->lineno, gc_pool);
+        if (pad != NULL) {
+          sc = sc->next = pad;
+        }
+        switch (p->kind) {
+          case SLOT_LINE:
+            sc = sc->next = gcnew("@_='';", gc_pool);
+            sc = sc->next = gcnew(p->code, gc_pool);
+            sc = sc->next = gcnew("\n_chaml<<@_;", gc_pool);
+            break;
+          case SLOT_SILENT:
+            sc = sc->next = gcnew("@_='';", gc_pool);
+            sc = sc->next = gcnew(p->code, gc_pool);
+            sc = sc->next = gcnew("\n_chaml<<nil;", gc_pool);
+            break;
+          case SLOT_PARTIAL:
+          case SLOT_CONTENT:
+          case SLOT_YIELD:
+            // keeps the index of the slots, a directive is not a ruby expression
+            sc = sc->next = gcnew("_chaml<<nil;", gc_pool);
+            continue;
+          case SLOT_EXPR:
+          case SLOT_TAG:
+          case SLOT_TEXT:
+            sc = sc->next = gcnew("_chaml<<(", gc_pool);
+            sc = sc->next = gcnew(p->code, gc_pool);
+            sc = sc->next = gcnew("\n);", gc_pool);
+            break;
+        }
+        line++;
+        for (auto q = p->code->buffer, e = q + p->code->length;
+             (q = static_cast<char*>(memchr(q, '\n', static_cast<size_t>(e - q)))) != NULL; q++) {
+          line++;
+        }
+      }
+      sc = sc->next = gcnew("\n_chaml\n", gc_pool);
+      return connect_chain(script->first, gc_pool);
+    }
+
+    // numbers the methods of the scripts, a method is never taken by another script. the ractors
+    // compile at the same time.
+    static std::atomic<unsigned long> script_count(0);
+
+    // the part of a compile that needs the gvl, compile does the rest without it
+    compiled* prepare(const char* buffer, long length, bool copy) {
+      auto gc_pool = GC::init();
+
+      // the compiled tree points into the buffer, copy it unless it outlives the tree
+      auto templ = const_cast<char*>(buffer);
+      if (copy) {
+        templ = GC::gc_alloc_n_char(length + 1, gc_pool);
+        memcpy(templ, buffer, static_cast<size_t>(length));
+        templ[length] = '\0';
+      }
+
+      auto ret = ALLOC(compiled);
+      ret->gc_pool    = gc_pool;
+      ret->templ      = templ;
+      ret->length     = length;
+      ret->t          = NULL;
+      ret->slots      = ret->slots_last = NULL;
+      ret->slot_count = 0;
+      ret->directive_count = 0;
+      ret->linked     = false;
+      ret->partials   = Qnil;
+      ret->script     = NULL;
+      ret->proc       = Qnil;
+      ret->method     = rb_intern_str(rb_sprintf("_chaml_%lu", ++script_count));
+      ret->name       = "";
+      ret->blocks     = NULL;
+      return ret;
+    }
+
+    // reloadable compiles
+    //
+    // the template is split into blocks, a line at indent 0 and the lines under it. each block is
+    // parsed, solved and folded on its own, its slots numbered after the ones of the blocks before
+    // it. recompile carries the blocks whose text is the same over from the old compile, with
+    // their folded trees, and parses only the others. the script is built again as a whole.
+
+    // the attributes of a tag going on over lines, as solve_multiline joins them
+    struct continuation {
+      int parents;
+      char string_type;
+      bool inside_string;
+      bool attrs;
+    };
+
+    // return true iff. solve_multiline may join the line from s to e, its indent skipped, with
+    // the next one. a block is never split in the middle of a line it joins.
+    static bool continues(const char* s, const char* e, continuation* k) {
+      String::string l = {const_cast<char*>(s), e - s};
+      long i = 0;
+      if (!k->attrs && s[0] == '%') {
+        i = 1;
+        find_first_invalid_index(&l, &i);
+        if (i < l.length && (s[i] == '.' || s[i] == '#' || s[i] == '(' || s[i] == '{')) {
+          k->parents       = 0;
+          k->inside_string = false;
+          k->attrs         = true;
+        }
+      }
+      for (; k->attrs && i < l.length && s[i] != '\n'; i++) {
+        switch (s[i]) {
+          case '(':
+          case '{':
+          case '[':
+            if (!k->inside_string) {
+              k->parents++;
+            }
+            break;
+          case ')':
+          case '}':
+          case ']':
+            if (!k->inside_string) {
+              k->parents--;
+            }
+            break;
+          case '\\':
+            if (k->inside_string) {
+              i++;
+            }
+            break;
+          case '"':
+          case '\'':
+            if (k->inside_string) {
+              if (k->string_type == s[i]) {
+                k->inside_string = false;
+              }
+            } else {
+              k->string_type   = s[i];
+              k->inside_string = true;
+            }
+            break;
+          case ' ':
+            if (!k->inside_string && k->parents == 0) {
+              k->attrs = false;
+            }
+            break;
+        }
+      }
+      if (k->attrs && !k->inside_string && k->parents == 0) {
+        k->attrs = false;
+      }
+      return k->attrs || s[find_last_valid_index(&l)] == '|';
+    }
+
+    // split buffer before every line at indent 0 that no line before it goes on into. a template
+    // starting with an indented line is one block, parse drops the lines at indent 0 after it.
+    static block* split_blocks(const char* buffer, long length, GC::gc* gc_pool) {
+      block *ret = NULL, *last = NULL;
+      continuation k = {0, 0, false, false};
+      auto continued = false, indented = false;
+      auto lineno = 0;
+      for (auto p = buffer, e = buffer + length; p < e; lineno++) {
+        auto eol = static_cast<const char*>(memchr(p, '\n', static_cast<size_t>(e - p)));
+        eol = eol != NULL ? eol + 1 : e;
+        auto s = p;
+        while (s < eol && (*s == ' ' || *s == '\t')) {
+          s++;
+        }
+        // blank lines are left to the block before them
+        if (s < eol && *s != '\n') {
+          if (ret == NULL || (s == p && !continued && !indented)) {
+            auto b = GCNEW(block, gc_pool);
+            b->next       = NULL;
+            b->text       = ret == NULL ? buffer : p;
+            b->lineno     = ret == NULL ? 0 : lineno;
+            b->haml       = NULL;
+            b->slot_first = b->slot_count = 0;
+            b->folded     = NULL;
+            b->trimmed    = false;
+            b->partials   = false;
+            if (ret != NULL) {
+              last = last->next = b;
+            } else {
+              ret = last = b;
+              indented = s != p;
+            }
+          }
+          continued = continues(s, eol, &k);
+        }
+        p = eol;
+      }
+      for (auto b = ret; b != NULL; b = b->next) {
+        b->length = (b->next != NULL ? b->next->text : buffer + length) - b->text;
+      }
+      return ret;
+    }
+
+    static void shift_linenos(tree* t, int lineno) {
+      for (; t != NULL; t = t->next) {
+        if (t->l->lineno != 0) {
+          t->l->lineno += lineno;
+        }
+        shift_linenos(t->subtree, lineno);
+      }
+      return;
+    }
+
+    // a block of the old compile copied into the new one, whose text is the same
+    struct carrier {
+      compiled* c;
+      const block* from;
+      const block* to;
+      int slot_shift;
+      int lineno_shift;
+    };
+
+    // a string into the text of the old block points into the new one, the others are copied
+    static String::string* carry(carrier* k, String::string* s) {
+      if (s == NULL || s->length == 0) {
+        return s;
+      }
+      auto from = k->from->text;
+      if (s->buffer >= from && s->buffer + s->length <= from + k->from->length) {
+        return String::gcnew(k->to->text + (s->buffer - from), s->length, k->c->gc_pool);
+      }
+      auto buffer = GC::gc_alloc_n_char(s->length, k->c->gc_pool);
+      memcpy(buffer, s->buffer, static_cast<size_t>(s->length));
+      return String::gcnew(buffer, s->length, k->c->gc_pool);
+    }
+
+    static string_chain* carry(carrier* k, string_chain* sc) {
+      string_chain *ret = NULL, *last = NULL;
+      for (; sc != NULL; sc = sc->next) {
+        auto p = gcnew(carry(k, sc->s), k->c->gc_pool);
+        if (last != NULL) {
+          last = last->next = p;
+        } else {
+          ret = last = p;
+        }
+      }
+      return ret;
+    }
+
+    static tree* carry(carrier* k, tree* t);
+
+    static line* carry(carrier* k, line* l) {
+      auto ret = GCNEW(line, k->c->gc_pool);
+      ret->indent_depth = l->indent_depth;
+      ret->lineno  = l->lineno != 0 ? l->lineno + k->lineno_shift : 0;
+      ret->slot    = l->slot != -1 ? l->slot + k->slot_shift : -1;
+      ret->is_html = l->is_html;
+      ret->attr    = carry(k, l->attr);
+      ret->spliced = carry(k, l->spliced);
+      ret->first   = carry(k, l->first);
+      ret->last    = ret->first;
+      for (auto p = l->first; p != l->last; p = p->next) {
+        ret->last = ret->last->next;
+      }
+      return ret;
+    }
+
+    static tree* carry(carrier* k, tree* t) {
+      tree *ret = NULL, *last = NULL;
+      for (; t != NULL; t = t->next) {
+        auto p = gcnew_tree(carry(k, t->l), k->c->gc_pool);
+        p->subtree = carry(k, t->subtree);
+        if (last != NULL) {
+          last = last->next = p;
+        } else {
+          ret = last = p;
+        }
+      }
+      return ret;
+    }
+
+    static attr* carry(carrier* k, attr* a) {
+      attr *ret = NULL, *last = NULL;
+      for (; a != NULL; a = a->next) {
+        auto p = gcnew_attr(a->kind, carry(k, a->name), carry(k, a->value), k->c->gc_pool);
+        if (last != NULL) {
+          last = last->next = p;
+        } else {
+          ret = last = p;
+        }
+      }
+      return ret;
+    }
+
+    // append a copy of the slot s of the old block to the slots of c
+    static void carry(carrier* k, slot* s) {
+      auto c   = k->c;
+      auto ret = GCNEW(slot, c->gc_pool);
+      ret->next     = NULL;
+      ret->kind     = s->kind;
+      ret->code     = carry(k, s->code);
+      ret->tag      = carry(k, s->tag);
+      ret->attrs    = carry(k, s->attrs);
+      ret->html     = carry(k, s->html);
+      ret->texts    = carry(k, s->texts);
+      ret->preserve = s->preserve;
+      ret->lineno   = s->lineno != 0 ? s->lineno + k->lineno_shift : 0;
+      ret->content  = carry(k, s->content);
+      if (ret->kind >= SLOT_PARTIAL) {
+        c->directive_count++;
+      }
+      if (c->slots) {
+        c->slots_last = c->slots_last->next = ret;
+      } else {
+        c->slots = c->slots_last = ret;
+      }
+      c->slot_count++;
+      return;
+    }
+
+    // the block o of the old compile can be taken for b
+    static bool same_block(block* b, block* o) {
+      return o != NULL && !o->partials && b->length == o->length &&
+             memcmp(b->text, o->text, static_cast<size_t>(b->length)) == 0;
+    }
+
+    static block* nth_block(block* b, long n) {
+      for (; b != NULL && n > 0; n--) {
+        b = b->next;
+      }
+      return b;
+    }
+
+    // compile c block by block, carrying the blocks the same from the start and from the end of
+    // the template of old over, and in between the ones found in the same order. each block is
+    // folded on its own, a carried one is folded again only if the line after it changed its
+    // mind about removing whitespace. return the blocks parsed.
+    static int compile_blocks(compiled* c, compiled* old, const Option& options) {
+      auto gc_pool = c->gc_pool;
+      c->blocks = split_blocks(c->templ, c->length, gc_pool);
+
+      auto olds = old != NULL ? old->blocks : NULL;
+      long n = 0, m = 0, head = 0;
+      for (auto b = c->blocks; b != NULL; b = b->next) {
+        n++;
+      }
+      for (auto o = olds; o != NULL; o = o->next) {
+        m++;
+      }
+      for (auto b = c->blocks, o = olds; b != NULL && same_block(b, o); b = b->next, o = o->next) {
+        head++;
+      }
+      // from tail on the block i of c is the block i + m - n of old, one after the ones of head
+      auto tail = head + (n > m ? n - m : 0);
+      auto i = tail;
+      for (auto b = nth_block(c->blocks, tail), o = nth_block(olds, tail + m - n); b != NULL; b = b->next, o = o->next, i++) {
+        if (!same_block(b, o)) {
+          tail = i + 1;
+        }
+      }
+
+      auto prefix = olds, middle = nth_block(olds, head), suffix = nth_block(olds, tail + m - n);
+      auto os     = old != NULL ? old->slots : NULL;
+      auto oi     = 0;
+      auto parsed = 0;
+      i = 0;
+      for (auto b = c->blocks; b != NULL; b = b->next, i++) {
+        block* o = NULL;
+        if (i < head) {
+          o = prefix;
+          prefix = prefix->next;
+        } else if (i >= tail) {
+          o = suffix;
+          suffix = suffix->next;
+        } else {
+          for (auto p = middle; p != suffix; p = p->next) {
+            if (same_block(b, p)) {
+              o = p;
+              middle = p->next;
+              break;
+            }
+          }
+        }
+
+        b->slot_first = c->slot_count;
+        if (o != NULL) {
+          carrier k = {c, o, b, c->slot_count - o->slot_first, b->lineno - o->lineno};
+          for (; oi < o->slot_first; oi++) {
+            os = os->next;
+          }
+          for (; oi < o->slot_first + o->slot_count; oi++, os = os->next) {
+            carry(&k, os);
+          }
+          b->haml    = carry(&k, o->haml);
+          b->folded  = carry(&k, o->folded);
+          b->trimmed = o->trimmed;
+        } else {
+          auto last = c->slots_last;
+          auto haml = haml_from_haml_plaintext(const_cast<char*>(b->text), b->length, options, gc_pool);
+          shift_linenos(haml, b->lineno);
+          b->haml = solve_scripts(haml, c, options, gc_pool);
+          for (auto p = last != NULL ? last->next : c->slots; p != NULL; p = p->next) {
+            p->content  = fold_static(p->content, true, false, options, gc_pool);
+            b->partials = b->partials || p->kind == SLOT_PARTIAL;
+          }
+          parsed++;
+        }
+        b->slot_count = c->slot_count - b->slot_first;
+      }
+
+      tree *t = NULL, *t_last = NULL;
+      for (auto b = c->blocks; b != NULL; b = b->next) {
+        auto next = b->next;
+        while (next != NULL && next->haml == NULL) {
+          next = next->next;
+        }
+        auto trimmed = next != NULL && may_remove_whitespace(next->haml->l, gc_pool);
+        if (b->folded == NULL || b->trimmed != trimmed) {
+          // fold_static is destructive, haml is kept as it is for the next recompile
+          b->folded  = fold_static(clone(b->haml, gc_pool), true, trimmed, options, gc_pool);
+          b->trimmed = trimmed;
+        }
+        // linking and refold change the tree, folded is kept as it is too
+        for (auto p = clone(b->folded, gc_pool); p != NULL; p = p->next) {
+          if (t_last != NULL) {
+            t_last = t_last->next = p;
+          } else {
+            t = t_last = p;
+          }
+        }
+      }
+
+      c->t      = t;
+      c->script = build_script(c, gc_pool);
+      c->linked = c->directive_count == 0;
+      return parsed;
+    }
+
+    // compile c, whose template is a changed one of old, parsing only the blocks that changed.
+    // old must have been compiled with the same options and reloadable. return the blocks parsed.
+    int recompile(compiled* c, compiled* old, const Option& options) {
+      return compile_blocks(c, old, options);
+    }
+
+    // touches no ruby object, so it can run without the gvl
+    void compile(compiled* c, const Option& options) {
+      if (options.reloadable) {
+        compile_blocks(c, NULL, options);
+        return;
+      }
+      auto gc_pool = c->gc_pool;
+      c->t      = solve_scripts(haml_from_haml_plaintext(c->templ, c->length, options, gc_pool), c, options, gc_pool);
+      c->script = build_script(c, gc_pool);
+      c->t      = fold_static(c->t, true, false, options, gc_pool);
+      for (auto p = c->slots; p != NULL; p = p->next) {
+        p->content = fold_static(p->content, true, false, options, gc_pool);
+      }
+      c->linked = c->directive_count == 0;
+      return;
+    }
+
+    // the line replaced by slot in t, or NULL if it is gone
+    static tree* find_slot(tree* t, int slot) {
+      for (; t != NULL; t = t->next) {
+        if (t->l->slot == slot) {
+          return t;
+        }
+        auto ret = find_slot(t->subtree, slot);
+        if (ret != NULL) {
+          return ret;
+        }
+      }
+      return NULL;
+    }
+
+    // the line replaced by slot in the tree or the contents of c
+    tree* find_slot(compiled* c, int slot) {
+      auto ret = find_slot(c->t, slot);
+      for (auto p = c->slots; ret == NULL && p != NULL; p = p->next) {
+        ret = find_slot(p->content, slot);
+      }
+      return ret;
+    }
+
+    // put the html of a static partial in place of the line of slot. refold joins it with the
+    // segments around it, so a render copies it along with them.
+    void inline_partial(compiled* c, int slot, const char* html, long length) {
+      auto t = find_slot(c, slot);
+      if (t == NULL) {
+        return;
+      }
+      auto buffer = GC::gc_alloc_n_char(length, c->gc_pool);
+      memcpy(buffer, html, static_cast<size_t>(length));
+      auto l = gcnew(0, String::gcnew(buffer, length, c->gc_pool), c->gc_pool);
+      l->is_html = true;
+      t->l->spliced = gcnew_tree(l, c->gc_pool);
+      t->l->slot    = -1;
+      return;
+    }
+
+    // put the line lineno of the template back in place of the slot, as the text it was. a
+    // "+ name" naming no partial is a line of text.
+    void inline_text(compiled* c, int slot, int lineno) {
+      auto p = static_cast<const char*>(c->templ);
+      auto e = p + c->length;
+      for (auto i = 1; i < lineno && p != NULL; i++) {
+        p = static_cast<const char*>(memchr(p, '\n', static_cast<size_t>(e - p)));
+        p = p != NULL ? p + 1 : NULL;
+      }
+      if (p == NULL) {
+        return;
+      }
+      auto eol = static_cast<const char*>(memchr(p, '\n', static_cast<size_t>(e - p)));
+      eol = eol != NULL ? eol : e;
+      while (p < eol && (*p == ' ' || *p == '\t')) {
+        p++;
+      }
+      while (eol > p && (eol[-1] == ' ' || eol[-1] == '\t' || eol[-1] == '\r')) {
+        eol--;
+      }
+      auto length = eol - p;
+      auto buffer = GC::gc_alloc_n_char(length + 1, c->gc_pool);
+      memcpy(buffer, p, static_cast<size_t>(length));
+      buffer[length] = '\n';
+      inline_partial(c, slot, buffer, length + 1);
+      return;
+    }
+
+    void refold(compiled* c, const Option& options) {
+      c->t = fold_static(c->t, true, false, options, c->gc_pool);
+      for (auto p = c->slots; p != NULL; p = p->next) {
+        p->content = fold_static(p->content, true, false, options, c->gc_pool);
+      }
+      return;
+    }
+
+    void release(compiled* c) {
+      if (c == NULL) {
+        return;
+      }
+      GC::final(c->gc_pool);
+      xfree(c);
+      return;
+    }
+
+    static line* clone(line* l, GC::gc* gc_pool) {
+      auto ret = GCNEW(line, gc_pool);
+      ret->indent_depth = l->indent_depth;
+      ret->lineno = l->lineno;
+      ret->slot = l->slot;
+      ret->is_html = l->is_html;
+      ret->attr = l->attr;
+      ret->spliced = l->spliced;
+      ret->first = ret->last = gcnew(String::gcnew(l->first->s->buffer, l->first->s->length, gc_pool), gc_pool);
+      for (auto p = l->first->next; p != NULL; p = p->next) {
+        ret->last = ret->last->next = gcnew(String::gcnew(p->s->buffer, p->s->length, gc_pool), gc_pool);
+      }
+      return ret;
+    }
+
+    // the later passes are destructive, so every render works on its own copy
+    tree* clone(tree* t, GC::gc* gc_pool) {
+      tree *ret = NULL, *last = NULL;
+      for (; t != NULL; t = t->next) {
+        auto p = gcnew_tree(clone(t->l, gc_pool), gc_pool);
+        p->subtree = clone(t->subtree, gc_pool);
+        if (last != NULL) {
+          last = last->next = p;
+        } else {
+          ret = last = p;
+        }
+      }
+      return ret;
+    }
+
+    static VALUE wrap_script(compiled* c, const char* head, const char* tail) {
+      AT_STACK(ret, rb_str_buf_new(c->script->length + 16));
+      rb_str_cat2(ret, head);
+      rb_str_cat(ret, c->script->buffer, c->script->length);
+      rb_str_cat2(ret, tail);
+      return ret;
+    }
+
+    // the file of the backtraces of the script
+    static VALUE script_file(compiled* c) {
+      return rb_str_new2(*c->name != '\0' ? c->name : "(chaml)");
+    }
+
+    // the script is the private method c->method of the class of location, or without
+    // compile_script a method returning a binding the slots are evaluated in one by one. it is
+    // defined by the first render with an instance of the class, in its body, so that the
+    // constants of the class are found as by instance_eval. a method body sees none of the locals
+    // of the code calling render, and has a frame of its own for each render, so the ractors
+    // rendering an engine do not share $~. its first line is line 0, the ones of the script are
+    // the ones of the template.
+    static VALUE call_script(compiled* c, VALUE location, const Option& options, eval_stats* stats) {
+      AT_STACK(klass, rb_obj_class(location));
+      AT_STACK(method, ID2SYM(c->method));
+      if (!RTEST(METHOD_CALL(klass, rb_intern("private_method_defined?"), method, Qfalse))) {
+        AT_STACK(head, rb_sprintf("def %" PRIsVALUE "\n", rb_sym2str(method)));
+        AT_STACK(body, options.compile_script ? wrap_script(c, StringValueCStr(head), "end")
+                                              : rb_str_plus(head, rb_str_new2("binding\nend")));
+        METHOD_CALL(klass, METHOD(class_eval), body, script_file(c), INT2FIX(0));
+        METHOD_CALL(klass, METHOD(private), method);
+        if (options.compile_script) {
+          stats->bytes = c->script->length;
+        }
+      }
+      return rb_funcall(location, c->method, 0);
+    }
+
+    // dump and load
+    //
+    // a compiled template is written as the options it was compiled with, its source, its slots
+    // and its tree. numbers are 32 bit ints in the byte order of the machine, a string
+    // is its length (-1 for NULL) and its bytes. load copies a dump into the pool of the compiled
+    // template once and points every string into the copy, nothing is parsed again.
+
+    const int dump_version = 3;
+
+    static void dump_int(VALUE out, long n) {
+      auto v = static_cast<int32_t>(n);
+      rb_str_cat(out, reinterpret_cast<const char*>(&v), sizeof(v));
+      return;
+    }
+
+    static void dump_string(VALUE out, const char* buffer, long length) {
+      dump_int(out, length);
+      rb_str_cat(out, buffer, length);
+      return;
+    }
+
+    static void dump_string(VALUE out, String::string* s) {
+      if (s == NULL) {
+        dump_int(out, -1);
+      } else {
+        dump_string(out, s->buffer, s->length);
+      }
+      return;
+    }
+
+    static void dump_tree(VALUE out, tree* t);
+
+    static void dump_line(VALUE out, line* l) {
+      dump_int(out, l->indent_depth);
+      dump_int(out, l->slot);
+      dump_int(out, l->is_html);
+      dump_string(out, l->attr);
+      dump_tree(out, l->spliced);
+      long n = 0;
+      EACH_PIECE(p, l) {
+        n++;
+      }
+      dump_int(out, n);
+      EACH_PIECE(p, l) {
+        dump_string(out, p->s);
+      }
+      return;
+    }
+
+    static void dump_tree(VALUE out, tree* t) {
+      long n = 0;
+      for (auto p = t; p != NULL; p = p->next) {
+        n++;
+      }
+      dump_int(out, n);
+      for (; t != NULL; t = t->next) {
+        dump_line(out, t->l);
+        dump_tree(out, t->subtree);
+      }
+      return;
+    }
+
+    static void dump_slot(VALUE out, slot* s) {
+      dump_int(out, s->kind);
+      dump_int(out, s->preserve);
+      dump_int(out, s->lineno);
+      dump_string(out, s->code);
+      dump_string(out, s->tag);
+      dump_string(out, s->html);
+      long n = 0;
+      for (auto a = s->attrs; a != NULL; a = a->next) {
+        n++;
+      }
+      dump_int(out, n);
+      for (auto a = s->attrs; a != NULL; a = a->next) {
+        dump_int(out, a->kind);
+        dump_string(out, a->name);
+        dump_string(out, a->value);
+      }
+      n = 0;
+      for (auto p = s->texts; p != NULL; p = p->next) {
+        n++;
+      }
+      dump_int(out, n);
+      for (auto p = s->texts; p != NULL; p = p->next) {
+        dump_string(out, p->s);
+      }
+      dump_tree(out, s->content);
+      return;
+    }
+
+    // the instruction sequence class, nil unless it can be written into a binary
+    static VALUE iseq_class() {
+      if (!rb_const_defined(rb_cObject, rb_intern("RubyVM"))) {
+        return Qnil;
+      }
+      AT_STACK(vm, rb_const_get(rb_cObject, rb_intern("RubyVM")));
+      if (!rb_const_defined(vm, rb_intern("InstructionSequence"))) {
+        return Qnil;
+      }
+      AT_STACK(iseq, rb_const_get(vm, rb_intern("InstructionSequence")));
+      if (!rb_respond_to(iseq, rb_intern("load_from_binary"))) {
+        return Qnil;
+      }
+      return iseq;
+    }
+
+    // the dump of c compiled with options. the proc of the script goes with it as an instruction
+    // sequence, so that a load does not parse the script either.
+    VALUE dump(compiled* c, const Option& options) {
+      AT_STACK(out, rb_str_buf_new(c->length * 2 + 64));
+      dump_int(out, dump_version);
+      dump_int(out, options.format);
+      dump_int(out, options.escape_html);
+      dump_int(out, options.default_indent_depth);
+      dump_int(out, options.compile_script);
+      dump_string(out, c->templ, c->length);
+      dump_int(out, c->slot_count);
+      for (auto p = c->slots; p != NULL; p = p->next) {
+        dump_slot(out, p);
+      }
+      dump_tree(out, c->t);
+
+      AT_STACK(iseq, iseq_class());
+      if (c->slot_count > 0 && options.compile_script && !NIL_P(iseq)) {
+        AT_STACK(compiled_script, METHOD_CALL(iseq, METHOD(compile), wrap_script(c, "proc{\n", "}"), script_file(c),
+                                              script_file(c), INT2FIX(0)));
+        AT_STACK(binary, METHOD_CALL(compiled_script, METHOD(to_binary)));
+        dump_string(out, RSTRING_PTR(binary), RSTRING_LEN(binary));
+      } else {
+        dump_int(out, -1);
+      }
+      return out;
+    }
+
+    struct reader {
+      char* buffer;
+      long length;
+      long index;
+      bool failed;
+      GC::gc* gc_pool;
+    };
+
+    static long load_int(reader* r) {
+      int32_t v = 0;
+      if (r->failed || r->index + static_cast<long>(sizeof(v)) > r->length) {
+        r->failed = true;
+        return 0;
+      }
+      memcpy(&v, r->buffer + r->index, sizeof(v));
+      r->index += sizeof(v);
+      return v;
+    }
+
+    // a count of things taking at least one int each
+    static long load_count(reader* r) {
+      auto n = load_int(r);
+      if (n < 0 || n > (r->length - r->index) / static_cast<long>(sizeof(int32_t))) {
+        r->failed = true;
+        return 0;
+      }
+      return n;
+    }
+
+    static String::string* load_string(reader* r) {
+      auto n = load_int(r);
+      if (r->failed || n == -1) {
+        return NULL;
+      }
+      if (n < 0 || n > r->length - r->index) {
+        r->failed = true;
+        return NULL;
+      }
+      auto ret = String::gcnew(r->buffer + r->index, n, r->gc_pool);
+      r->index += n;
+      return ret;
+    }
+
+    // a string that can not be NULL
+    static String::string* load_text(reader* r) {
+      auto ret = load_string(r);
+      if (ret == NULL) {
+        r->failed = true;
+        return String::gcnew("", r->gc_pool);
+      }
+      return ret;
+    }
+
+    static tree* load_tree(reader* r, int slot_count);
+
+    static line* load_line(reader* r, int slot_count) {
+      auto ret = GCNEW(line, r->gc_pool);
+      ret->indent_depth = static_cast<int>(load_int(r));
+      ret->lineno       = 0;
+      ret->slot         = static_cast<int>(load_int(r));
+      ret->is_html      = load_int(r) != 0;
+      ret->attr         = load_string(r);
+      ret->spliced      = load_tree(r, slot_count);
+      ret->first = ret->last = NULL;
+      if (ret->slot < -1 || ret->slot >= slot_count) {
+        r->failed = true;
+      }
+      auto n = load_count(r);
+      for (long i = 0; i < n; i++) {
+        auto sc = gcnew(load_text(r), r->gc_pool);
+        if (ret->last != NULL) {
+          ret->last = ret->last->next = sc;
+        } else {
+          ret->first = ret->last = sc;
         }
-        default: {
-          // "@_ << \"%buffer\""
-          String::chomp(s);
-          auto ret = gcnew(0, "@_ << \"", gc_pool);
-          auto sc  = ret->first;
-          sc = sc->next = gcnew(s, gc_pool);
-          sc = sc->next = gcnew("\\n\";", gc_pool);
-          ret->last = sc;
-          return ret;
+      }
+      if (ret->first == NULL) {
+        // every line has a piece
+        r->failed = true;
+      }
+      return ret;
+    }
+
+    static tree* load_tree(reader* r, int slot_count) {
+      tree *ret = NULL, *last = NULL;
+      auto n = load_count(r);
+      for (long i = 0; i < n && !r->failed; i++) {
+        auto t = gcnew_tree(load_line(r, slot_count), r->gc_pool);
+        t->subtree = load_tree(r, slot_count);
+        if (last != NULL) {
+          last = last->next = t;
+        } else {
+          ret = last = t;
         }
       }
+      return ret;
     }
 
-    tree* static_haml_from_haml(tree* t, VALUE location, const Option& options, GC::gc* gc_pool) {
-      if (t == NULL) {
+    // slot_count: of the dump, the content of a slot refers to the slots after it
+    static void load_slot(reader* r, compiled* c, long slot_count) {
+      auto kind = static_cast<int>(load_int(r));
+      if (kind < SLOT_LINE || kind > SLOT_YIELD) {
+        r->failed = true;
+      }
+      auto sl = GCNEW(slot, r->gc_pool);
+      sl->next     = NULL;
+      sl->kind     = kind;
+      sl->preserve = static_cast<int>(load_int(r));
+      sl->lineno   = static_cast<int>(load_int(r));
+      sl->code     = load_text(r);
+      sl->tag      = load_string(r);
+      sl->html     = load_string(r);
+      sl->attrs    = NULL;
+      sl->texts    = NULL;
+      if (c->slots) {
+        c->slots_last = c->slots_last->next = sl;
+      } else {
+        c->slots = c->slots_last = sl;
+      }
+      c->slot_count++;
+      if (kind >= SLOT_PARTIAL) {
+        c->directive_count++;
+      }
+
+      attr* last = NULL;
+      auto n = load_count(r);
+      for (long i = 0; i < n; i++) {
+        auto kind = static_cast<int>(load_int(r));
+        auto name = load_string(r);
+        auto a    = gcnew_attr(kind, name, load_string(r), r->gc_pool);
+        if (last != NULL) {
+          last = last->next = a;
+        } else {
+          sl->attrs = last = a;
+        }
+      }
+      string_chain* texts = NULL;
+      n = load_count(r);
+      for (long i = 0; i < n; i++) {
+        auto sc = gcnew(load_text(r), r->gc_pool);
+        if (texts != NULL) {
+          texts = texts->next = sc;
+        } else {
+          sl->texts = texts = sc;
+        }
+      }
+      sl->content = load_tree(r, static_cast<int>(slot_count));
+      if ((kind == SLOT_TAG && sl->tag == NULL) || (kind == SLOT_TEXT && sl->texts == NULL)) {
+        r->failed = true;
+      }
+      return;
+    }
+
+    // the compiled template of a dump, options are set to the ones it was compiled with and iseq
+    // to the binary of the proc of its script or NULL. return NULL if buffer is not a dump of this
+    // version
+    compiled* load(const char* buffer, long length, Option* options, String::string** iseq) {
+      auto c = prepare(buffer, length, true);
+      reader r;
+      r.buffer  = c->templ;
+      r.length  = length;
+      r.index   = 0;
+      r.failed  = false;
+      r.gc_pool = c->gc_pool;
+
+      if (load_int(&r) != dump_version) {
+        release(c);
         return NULL;
       }
+      options->format               = static_cast<int>(load_int(&r));
+      options->escape_html          = load_int(&r) != 0;
+      options->default_indent_depth = static_cast<int>(load_int(&r));
+      options->compile_script       = load_int(&r) != 0;
+      auto templ = load_text(&r);
+      auto slot_count = load_count(&r);
+      for (long i = 0; i < slot_count && !r.failed; i++) {
+        load_slot(&r, c, slot_count);
+      }
+      c->t = load_tree(&r, c->slot_count);
+      *iseq = load_string(&r);
+      if (r.failed || r.index != r.length) {
+        release(c);
+        return NULL;
+      }
+      c->templ  = templ->buffer;
+      c->length = templ->length;
+      // the static partials are in the tree already, the others are resolved again
+      c->linked = c->directive_count == 0;
+      // the script is only joined from the codes of the slots
+      c->script = build_script(c, c->gc_pool);
+      return c;
+    }
+
+    // the proc of the script of c from the binary of its instruction sequence
+    void load_proc(compiled* c, String::string* iseq) {
+      AT_STACK(klass, iseq_class());
+      if (NIL_P(klass)) {
+        return;
+      }
+      AT_STACK(binary, rb_str_new(iseq->buffer, iseq->length));
+      AT_STACK(loaded, METHOD_CALL(klass, METHOD(load_from_binary), binary));
+      c->proc = METHOD_CALL(loaded, METHOD(eval));
+      return;
+    }
+
+    // return the values of all slots of c, evaluated in location
+    VALUE evaluate(compiled* c, VALUE location, const Option& options, eval_stats* stats) {
+      stats->calls = 0;
+      stats->bytes = 0;
+      if (c->slot_count == c->directive_count) {
+        // nothing to run, the partials are rendered on their own
+        return Qnil;
+      }
+
+      stats->calls = 1;
+      if (options.compile_script) {
+        // the script is parsed once for each class of location, each render only calls it. a dump
+        // brings a proc compiled at the top level instead.
+        PROBE(eval__start, c->name, 0);
+        AT_STACK(ret, NIL_P(c->proc) ? call_script(c, location, options, stats)
+                                     : rb_funcall_with_block(location, METHOD(instance_exec), 0, NULL, c->proc));
+        PROBE(eval__done, c->name, 0);
+        return ret;
+      }
+
+      // the locals the lines set are kept in the binding for the lines after them
+      METHOD_READY(eval);
+      AT_STACK(binding, call_script(c, location, options, stats));
+      AT_STACK(file, script_file(c));
+      AT_STACK(ret, rb_ary_new2(c->slot_count));
+      stats->calls = 0;
+      for (auto p = c->slots; p != NULL; p = p->next) {
+        if (p->kind >= SLOT_PARTIAL) {
+          rb_ary_push(ret, Qnil);
+          continue;
+        }
+        if (p->kind != SLOT_EXPR) {
+          METHOD_CALL(binding, eval, rb_str_new2("@_ = ''"));
+          stats->calls++;
+          stats->bytes += 7;
+        }
+        stats->calls++;
+        stats->bytes += p->code->length;
+        PROBE(eval__start, c->name, p->lineno);
+        AT_STACK(value, METHOD_CALL(binding, eval, rb_str_new(p->code->buffer, p->code->length), file, INT2FIX(p->lineno)));
+        PROBE(eval__done, c->name, p->lineno);
+        rb_ary_push(ret, p->kind == SLOT_SILENT ? Qnil : value);
+      }
+      return ret;
+    }
+
+    // "%tag" + the rest of the line evaluated by a SLOT_TAG
+    static String::string* tag_line(String::string* tag, VALUE rest, GC::gc* gc_pool) {
+      auto rs     = StringValuePtr(rest);
+      auto length = tag->length + RSTRING_LEN(rest);
+      auto buffer = GC::gc_alloc_n_char(length, gc_pool);
+      memcpy(buffer, tag->buffer, static_cast<size_t>(tag->length));
+      memcpy(buffer + tag->length, rs, static_cast<size_t>(RSTRING_LEN(rest)));
+      return String::gcnew(buffer, length, gc_pool);
+    }
+
+    // the texts of a SLOT_TEXT with the values of its expressions between them
+    static String::string* interpolated_text(string_chain* texts, VALUE values, GC::gc* gc_pool) {
+      auto ret = gcnew(texts->s, gc_pool);
+      auto sc  = ret;
+      long k = 0;
+      for (auto p = texts->next; p != NULL; p = p->next) {
+        AT_STACK(value, rb_ary_entry(values, k++));
+        sc = sc->next = gcnew(string_value(value, gc_pool), gc_pool);
+        sc = sc->next = gcnew(p->s, gc_pool);
+      }
+      return connect_chain(ret, gc_pool);
+    }
 
-      auto old_t = t;
+    // the lines made of the values of all slots, indexed by slot. the values are registered in
+    // gc_pool, which has to be marked as long as the lines are used. values is nil if evaluate
+    // had nothing to run.
+    slot_value* slot_values(compiled* c, VALUE values, const Option& options, GC::gc* gc_pool) {
+      if (c->slot_count == 0) {
+        return NULL;
+      }
 
-      if (is_dynamic(t->l->first->s)) {
-        if (is_filter(t->l)) {
-          t = solve_filter(t, location, options, gc_pool);
-        } else if (t->subtree != NULL && is_script(t->l)) {
-          // TODO: implement
+      auto ret = GC::gc_alloc_n_slot_value(c->slot_count, gc_pool);
+      auto p   = c->slots;
+      for (auto i = 0; i < c->slot_count; i++, p = p->next) {
+        AT_STACK(value, NIL_P(values) ? Qnil : rb_ary_entry(values, i));
+        ret[i].s    = NULL;
+        ret[i].attr = NULL;
+        ret[i].html = NULL;
+        if (NIL_P(value)) {
+          continue;
+        }
+        gc_register_value(value, gc_pool);
+        if (p->kind == SLOT_TAG) {
+          // only the values of the attributes came from ruby, the html of them is built here
+          Check_Type(value, T_ARRAY);
+          AT_STACK(rest, rb_ary_entry(value, RARRAY_LEN(value) - 1));
+          ret[i].attr = p->html != NULL ? p->html : build_attr(p->attrs, value, options, gc_pool);
+          ret[i].s    = tag_line(p->tag, rest, gc_pool);
+        } else if (p->kind == SLOT_TEXT) {
+          // only the expressions came from ruby, they are put between the texts here
+          Check_Type(value, T_ARRAY);
+          ret[i].s = interpolated_text(p->texts, value, gc_pool);
         } else {
-          METHOD_READY(instance_eval);
-          METHOD_CALL(location, instance_eval, rb_str_new2("@_ = ''"));
-          auto expr_s = connect_chain(convert_to_ruby_form(t->l, options, gc_pool)->first, gc_pool);
-          AT_STACK(expr, rb_str_new(expr_s->buffer, expr_s->length));
-          AT_STACK(ret, METHOD_CALL(location, instance_eval, expr));
-          if (silent_script(t->l)) {
-            t->l = gcnew(0, "", gc_pool);
-          } else {
-            gc_register_value(ret, gc_pool);
-            auto rs = StringValuePtr(ret);
-            t->l->first->s = String::gcnew(rs, gc_pool);
-          }
-          static_haml_from_haml(t->subtree, location, options, gc_pool);
+          auto rs = StringValuePtr(value);
+          ret[i].s = String::gcnew(rs, RSTRING_LEN(value), gc_pool);
         }
-      } else {
-        static_haml_from_haml(t->subtree, location, options, gc_pool);
+        switch (p->preserve) {
+          case PRESERVE_TAGS:
+            ret[i].s = String::preserve(ret[i].s, gc_pool);
+            break;
+          case PRESERVE_ALL:
+            ret[i].s = String::preserve_all(ret[i].s, gc_pool);
+            break;
+        }
+      }
+      return ret;
+    }
+
+    // put the values of slots into their lines
+    tree* static_haml_from_haml(tree* t, slot_value* values) {
+      for (auto p = t; p != NULL; p = p->next) {
+        if (p->l->slot != -1 && values[p->l->slot].s != NULL) {
+          p->l->first->s = values[p->l->slot].s;
+          p->l->attr     = values[p->l->slot].attr;
+        }
+        if (p->l->slot != -1 && values[p->l->slot].html != NULL) {
+          p->l->spliced = values[p->l->slot].html;
+        } else if (p->l->slot != -1 && p->l->is_html) {
+          // a yield of nothing writes no indent either
+          p->l->indent_depth = 0;
+        }
+        static_haml_from_haml(p->subtree, values);
       }
-      static_haml_from_haml(t->next, location, options, gc_pool);
-      return old_t;
+      return t;
     }
 
     static bool is_void_tag(String::string* s) {
@@ -939,13 +2950,12 @@ namespace CHaml {
       return false;
     }
 
-    static String::string* convert_escape_html(String::string* s, GC::gc* gc_pool);
     static String::string* escaped_rest(String::string* s, int index, GC::gc* gc_pool) {
-      return convert_escape_html(String::rest(s, index, gc_pool), gc_pool);
+      return String::escape_html(String::rest(s, index, gc_pool), gc_pool);
     }
 
     static String::string* escape(String::string* s, GC::gc* gc_pool) {
-      return convert_escape_html(s, gc_pool);
+      return String::escape_html(s, gc_pool);
     }
 
     /// haml '!!! xxxx' -> html/xml/xhtml doctype
@@ -1052,7 +3062,6 @@ namespace CHaml {
       return p;
     }
 
-    const char* preservation_regexp = "@_r = /<(textarea|pre|code)([^>]*)>(.*?)(<\\/\\1>)/im";
     static bool is_preserve_tag(String::string* s) {
       // [textarea, pre, code] tags are preserve tags.
       auto l = s->length;
@@ -1079,13 +3088,10 @@ namespace CHaml {
     }
 
     static void remove_indents(tree* t) {
-      if (t == NULL) {
-        return;
+      for (; t != NULL; t = t->next) {
+        remove_indents(t->subtree);
+        t->l->indent_depth = 0;
       }
-
-      remove_indents(t->subtree);
-      remove_indents(t->next);
-      t->l->indent_depth = 0;
       return;
     }
 
@@ -1099,7 +3105,9 @@ namespace CHaml {
       auto tag = String::tok(p->s, &index, gc_pool);
 
       String::string *attr;
-      if (p->s->buffer[index] == '{') {
+      if (t->l->attr != NULL) {
+        attr = t->l->attr;
+      } else if (p->s->buffer[index] == '{') {
         auto i = index;
         String::find(p->s, &index, '}');
         attr = String::gcnew(p->s->buffer + i + 1, index - i - 1, gc_pool);
@@ -1140,7 +3148,7 @@ namespace CHaml {
         String::chomp(s);
       }
 
-      if (preserve) {
+      if (preserve && t->subtree != NULL) {
         remove_indents(t->subtree);
 
         // make lastline.end_with_cr? == false
@@ -1252,70 +3260,18 @@ namespace CHaml {
       return p;
     }
 
-    static string_chain* sprit_escapes(string_chain* p, GC::gc* gc_pool) {
-      auto buffer = p->s->buffer;
-      auto length = p->s->length;
-      auto next_start_index = 0;
-      auto q = gcnew("", gc_pool);
-      auto ret = q;
-      for (auto i = 0; i < length; i++) {
-        switch (buffer[i]) {
-          case '&':
-          case '>':
-          case '<':
-          case '"':
-            q->s = String::gcnew(buffer + next_start_index, i - next_start_index, gc_pool);
-            q = q->next = gcnew(String::gcnew(buffer + i, 1, gc_pool), gc_pool);
-            q = q->next = gcnew("", gc_pool);
-            next_start_index = i + 1;
-            break;
-        }
-      }
-      q->s = String::gcnew(buffer + next_start_index, length - next_start_index, gc_pool);
-      return ret;
-    }
-
-    static void convert_escape_html(string_chain* p, GC::gc* gc_pool) {
-      auto chain = sprit_escapes(p, gc_pool);
-      for (auto q = chain; q != NULL; q = q->next) {
-        if (q->s->length == 1) {
-          if (String::eq(q->s, "&")) {
-            q->s = String::gcnew("&amp;",  gc_pool);
-          } else if (String::eq(q->s, ">")) {
-            q->s = String::gcnew("&gt;",   gc_pool);
-          } else if (String::eq(q->s, "<")) {
-            q->s = String::gcnew("&lt;",   gc_pool);
-          } else if (String::eq(q->s, "\"")) {
-            q->s = String::gcnew("&quot;", gc_pool);
-          }
-        }
-      }
-      p->s = connect_chain(chain, gc_pool);
-      return;
-    }
-
-    static String::string* convert_escape_html(String::string* s, GC::gc* gc_pool) {
-      auto sc = gcnew(s, gc_pool);
-      convert_escape_html(sc, gc_pool);
-      return sc->s;
-    }
+    static tree* html_from_static_haml(tree* t, bool* opt_gt, const Option& options, GC::gc* gc_pool);
 
-    // haml -> html
+    // haml line -> html line, opt_gt: true iff. the line removes the whitespace around it
     // NOTE: it has destructive modifications ...
-    static tree* html_from_static_haml(tree* t, int* max_indent_depth, bool* opt_gt, const Option& options, GC::gc* gc_pool) {
-      if (t == NULL) {
-        return NULL;
-      }
-
+    static void html_from_static_haml_line(tree* t, bool* opt_gt, const Option& options, GC::gc* gc_pool) {
       bool child_opt_gt = false;
-      bool next_opt_gt = false;
-      t->subtree = html_from_static_haml(t->subtree, max_indent_depth, &child_opt_gt, options, gc_pool);
-      t->next    = html_from_static_haml(t->next,    max_indent_depth, &next_opt_gt, options, gc_pool);
+      t->subtree = html_from_static_haml(t->subtree, &child_opt_gt, options, gc_pool);
 
       auto p = t->l->first;
       auto s = p->s->buffer;
       auto sl = p->s->length;
-      if (sl != 0) {
+      if (sl != 0 && !t->l->is_html) {
         if (s[0] == '!') {
           if (sl >= 3 && s[1] == '!' && s[2] == '!') {
             // line starts with '!!!' => Doctype
@@ -1337,95 +3293,499 @@ namespace CHaml {
         }
       }
 
-      if (child_opt_gt || next_opt_gt) {
-        auto last = t->l->last->s;
-        String::chomp(last);
-        if (child_opt_gt) {
-          decrement_indents(t->subtree, options.default_indent_depth);
+      if (child_opt_gt) {
+        String::chomp(t->l->last->s);
+        decrement_indents(t->subtree, options.default_indent_depth);
+      }
+      return;
+    }
+
+    // the html of the contents named name of the page c, in the order they are in c
+    tree* content_html(compiled* c, slot_value* values, const char* name, long length, const Option& options, GC::gc* gc_pool) {
+      tree *ret = NULL, *last = NULL;
+      for (auto p = c->slots; p != NULL; p = p->next) {
+        if (p->kind != SLOT_CONTENT || p->code->length != length || memcmp(p->code->buffer, name, static_cast<size_t>(length)) != 0) {
+          continue;
+        }
+        auto l = gcnew(0, "", gc_pool);
+        l->is_html = true;
+        l->spliced = html_from_static_haml(static_haml_from_haml(clone(p->content, gc_pool), values), options, gc_pool);
+        auto t = gcnew_tree(l, gc_pool);
+        if (last != NULL) {
+          last = last->next = t;
+        } else {
+          ret = last = t;
         }
       }
+      return ret;
+    }
 
-      if (*max_indent_depth < t->l->indent_depth) {
-        *max_indent_depth = t->l->indent_depth;
+    // haml -> html, opt_gt: true iff. the first line removes the whitespace around it
+    // NOTE: it has destructive modifications ...
+    static tree* html_from_static_haml(tree* t, bool* opt_gt, const Option& options, GC::gc* gc_pool) {
+      tree* prev = NULL;
+      for (auto p = t; p != NULL;) {
+        // the closing lines put after p are html already
+        auto next = p->next;
+        bool p_opt_gt = false;
+        html_from_static_haml_line(p, &p_opt_gt, options, gc_pool);
+        if (p_opt_gt) {
+          if (prev != NULL) {
+            String::chomp(prev->l->last->s);
+          } else {
+            *opt_gt = true;
+          }
+        }
+        prev = p;
+        p = next;
       }
       return t;
     }
 
-    tree* html_from_static_haml(tree* t, int* max_indent_depth, const Option& options, GC::gc* gc_pool) {
+    tree* html_from_static_haml(tree* t, const Option& options, GC::gc* gc_pool) {
       bool dummy = false;
-      return html_from_static_haml(t, max_indent_depth, &dummy, options, gc_pool);
+      return html_from_static_haml(t, &dummy, options, gc_pool);
     }
 
-    static line* flatten_(tree* subtree, tree* next, line* l, String::string* sp, GC::gc* gc_pool);
-    static line* flatten_(tree* t, String::string* sp, GC::gc* gc_pool) {
-      if (t == NULL) {
-        return NULL;
+    static long skip_attributes(String::string* s, long index) {
+      while (index < s->length) {
+        switch (s->buffer[index]) {
+          case '{':
+          case '(': {
+            auto parents = 0;
+            char string_type = 0;
+            auto inside_string = false;
+            do {
+              switch (s->buffer[index]) {
+                case '(':
+                case '{':
+                case '[':
+                  if (!inside_string) {
+                    parents++;
+                  }
+                  break;
+                case ')':
+                case '}':
+                case ']':
+                  if (!inside_string) {
+                    parents--;
+                  }
+                  break;
+                case '\\':
+                  if (inside_string) {
+                    index++;
+                  }
+                  break;
+                case '"':
+                case '\'':
+                  if (inside_string) {
+                    if (string_type == s->buffer[index]) {
+                      inside_string = false;
+                    }
+                  } else {
+                    string_type = s->buffer[index];
+                    inside_string = true;
+                  }
+                  break;
+              }
+              index++;
+            } while (index < s->length && parents != 0);
+            break;
+          }
+          case '.':
+          case '#':
+            index++;
+            find_first_invalid_index(s, &index);
+            break;
+          default:
+            return index;
+        }
       }
-      return flatten_(t->subtree, t->next, t->l, sp, gc_pool);
+      return index;
     }
 
-    // NOTE: it has destructive modifications ...
-    static line* flatten_(tree* subtree, tree* next, line* l, String::string* sp, GC::gc* gc_pool) {
-      auto ret = GCNEW(line, gc_pool);
-      ret->first = ret->last = NULL;
-      ret->indent_depth = 0;
+    // the tag and the tag options l will have at render
+    // return false iff. they depend on the values of scripts
+    static bool tag_of(line* l, String::string** tag, String::string** opt, GC::gc* gc_pool) {
+      auto s = l->first->s;
+      *tag = *opt = String::gcnew("", gc_pool);
+      if (s->length == 0 || l->is_html) {
+        return true;
+      }
+      if (l->slot == -1) {
+        if (s->buffer[0] == '%') {
+          long index = 1;
+          *tag = String::tok(s, &index, gc_pool);
+          *opt = String::tag_options(s, &index, gc_pool);
+        }
+        return true;
+      }
 
-      if (l) {
-        auto indent = gcnew(String::gcnew(sp->buffer, l->indent_depth, gc_pool), gc_pool);
-        ret->first = ret->last = indent;
-        ret->last->next = l->first;
-        ret->last       = l->last;
+      // a dynamic line keeps its tag and options, other lines never turn into tags
+      // except scripts whose values are put at the head of their lines
+      long index = 0;
+      find_first_valid_index(s, &index);
+      switch (s->buffer[index]) {
+        case '=':
+        case '~':
+          return false;
+        case '%':
+          index++;
+          *tag = String::tok(s, &index, gc_pool);
+          break;
+        case '.':
+        case '#':
+          *tag = String::gcnew("div", gc_pool);
+          break;
+        default:
+          return true;
       }
+      index = skip_attributes(s, index);
+      *opt = String::tag_options(s, &index, gc_pool);
+      return true;
+    }
 
-      auto ls = flatten_(subtree, sp, gc_pool);
-      if (ls) {
-        if (l) {
-          ret->last->next = ls->first;
-        } else {
-          ret->first = ls->first;
+    static bool has_option(String::string* opt, char ch) {
+      return memchr(opt->buffer, ch, static_cast<size_t>(opt->length)) != NULL;
+    }
+
+    // return true iff. '>' of l may chomp its previous line or decrement the indents of its siblings
+    static bool may_remove_whitespace(line* l, GC::gc* gc_pool) {
+      String::string *tag, *opt;
+      return !tag_of(l, &tag, &opt, gc_pool) || has_option(opt, '>');
+    }
+
+    // return true iff. t or any of its subtree is replaced by a slot
+    static bool has_slot(tree* t) {
+      if (t->l->slot != -1) {
+        return true;
+      }
+      for (auto p = t->subtree; p != NULL; p = p->next) {
+        if (has_slot(p)) {
+          return true;
         }
-        ret->last = ls->last;
       }
+      return false;
+    }
 
-      auto ln = flatten_(next, sp, gc_pool);
-      if (ln) {
-        if (l || ls) {
-          ret->last->next = ln->first;
-        } else {
-          ret->first = ln->first;
-        }
-        ret->last = ln->last;
+    // static haml t and its subtree -> a line of finished html
+    static line* fold(tree* t, const Option& options, GC::gc* gc_pool) {
+      auto old_next = t->next;
+      t->next = NULL;
+      auto html = html_from_static_haml(t, options, gc_pool);
+      auto ret  = gcnew(0, flatten_(html, gc_pool), gc_pool);
+      ret->is_html = true;
+      t->next = old_next;
+      return ret;
+    }
+
+    // replace the subtrees that have no slots by html segments built at compile time
+    // safe: the ancestors of t never change the indents or the last cr of t
+    // the segments joined into prev by fold_static become one string, once the run of them ends
+    static void end_run(tree* prev, string_chain** run, GC::gc* gc_pool) {
+      if (*run != NULL) {
+        prev->l->first->s = connect_chain(*run, gc_pool);
+        *run = NULL;
       }
+      return;
+    }
 
-      if (ret->last) {
-        ret->last->next = NULL;
+    // trim_after tells whether the line after the last one of t may remove the whitespace around it
+    static tree* fold_static(tree* t, bool safe, bool trim_after, const Option& options, GC::gc* gc_pool) {
+      tree *ret = t, *prev = NULL;
+      string_chain *run = NULL, *run_last = NULL;  // the segments joined into prev so far
+      while (t != NULL) {
+        String::string *tag, *opt;
+        auto known = tag_of(t->l, &tag, &opt, gc_pool);
+        auto foldable = safe && known && !has_option(opt, '>') && !has_slot(t) &&
+                        !(t->next != NULL ? may_remove_whitespace(t->next->l, gc_pool) : trim_after);
+
+        if (foldable) {
+          auto l = fold(t, options, gc_pool);
+          if (prev != NULL && prev->l->is_html && prev->l->slot == -1 && prev->l->spliced == NULL) {
+            // join with the previous segment, a partial is written instead of its line.
+            // connecting them one by one would copy the run so far for each of them.
+            if (run == NULL) {
+              run = run_last = gcnew(prev->l->first->s, gc_pool);
+            }
+            for (run_last->next = l->first; run_last->next != NULL;) {
+              run_last = run_last->next;
+            }
+            prev->next = t->next;
+            t = prev->next;
+            continue;
+          }
+          t->l       = l;
+          t->subtree = NULL;
+        } else if (t->subtree != NULL) {
+          // '<' and preserve tags change the indents of the subtree,
+          // '>' of the first line in the subtree decrements the indents of its siblings
+          auto subtree_safe = safe && known && !has_option(opt, '<') && !is_preserve_tag(tag) &&
+                              !may_remove_whitespace(t->subtree->l, gc_pool);
+          t->subtree = fold_static(t->subtree, subtree_safe, false, options, gc_pool);
+        }
+        if (prev != NULL) {
+          end_run(prev, &run, gc_pool);
+        }
+        prev = t;
+        t = t->next;
+      }
+      if (prev != NULL) {
+        end_run(prev, &run, gc_pool);
       }
       return ret;
     }
 
-    static String::string* flatten_(tree* t, int max_indent_depth, GC::gc* gc_pool) {
-      if (t == NULL) {
-        return String::gcnew("", gc_pool);
+    // the writers below walk the lines the same way, only their sinks differ.
+    // the html of a spliced line is written in its place, each line of it indented by the line.
+    // extra is the indent of the spliced lines around, bol is true at the beginning of a line.
+
+    struct length_sink {
+      long length;
+    };
+
+    static void put(length_sink* sink, const char* s, long n) {
+      (void)s;
+      sink->length += n;
+      return;
+    }
+
+    static void pad(length_sink* sink, long n) {
+      sink->length += n;
+      return;
+    }
+
+    struct buffer_sink {
+      char* out;
+    };
+
+    static void put(buffer_sink* sink, const char* s, long n) {
+      memcpy(sink->out, s, static_cast<size_t>(n));
+      sink->out += n;
+      return;
+    }
+
+    static void pad(buffer_sink* sink, long n) {
+      memset(sink->out, ' ', static_cast<size_t>(n));
+      sink->out += n;
+      return;
+    }
+
+    template <typename Sink>
+    static void write_piece(Sink* sink, String::string* s, long extra, bool* bol) {
+      if (s->length == 0) {
+        return;
+      }
+      if (extra == 0) {
+        put(sink, s->buffer, s->length);
+        *bol = s->buffer[s->length - 1] == '\n';
+        return;
+      }
+      auto p = s->buffer;
+      auto n = s->length;
+      while (n > 0) {
+        if (*bol) {
+          pad(sink, extra);
+        }
+        auto cr = static_cast<const char*>(memchr(p, '\n', static_cast<size_t>(n)));
+        auto m  = cr != NULL ? cr - p + 1 : n;
+        put(sink, p, m);
+        p += m;
+        n -= m;
+        *bol = cr != NULL;
       }
+      return;
+    }
 
-      // create buffer for the indents that filled by spaces
-      auto spaces_ = GC::gc_alloc_n_char(max_indent_depth, gc_pool);
-      for (int i = 0; i < max_indent_depth; i++) {
-        spaces_[i] = ' ';
+    template <typename Sink>
+    static void write_lines(tree* t, long extra, bool* bol, Sink* sink) {
+      for (; t != NULL; t = t->next) {
+        if (t->l->spliced != NULL) {
+          write_lines(t->l->spliced, extra + t->l->indent_depth, bol, sink);
+          continue;
+        }
+        auto indent = t->l->indent_depth + (*bol ? extra : 0);
+        if (indent > 0) {
+          pad(sink, indent);
+          *bol = false;
+        }
+        EACH_PIECE(p, t->l) {
+          write_piece(sink, p->s, extra, bol);
+        }
+        write_lines(t->subtree, extra, bol, sink);
       }
-      auto spaces = String::gcnew(spaces_, max_indent_depth, gc_pool);
+      return;
+    }
 
-      // tree -> string-chain
-      auto sc = flatten_(t->subtree, t->next, t->l, spaces, gc_pool)->first;
+    // return the byte length of the indented lines of t and its siblings
+    long output_length(tree* t) {
+      length_sink sink = {0};
+      bool bol = true;
+      write_lines(t, 0, &bol, &sink);
+      return sink.length;
+    }
 
-      // string-chain -> string
-      return connect_chain(sc, gc_pool);
+    // write the indented lines of t and its siblings to out, returns the end of them
+    char* write_output(tree* t, char* out) {
+      buffer_sink sink = {out};
+      bool bol = true;
+      write_lines(t, 0, &bol, &sink);
+      return sink.out;
     }
 
-    VALUE flatten(tree* t, int max_indent_depth, GC::gc* gc_pool) {
-      auto str = flatten_(t, max_indent_depth, gc_pool);
-      AT_STACK(ret, rb_str_new(str->buffer, str->length));
-      return ret;
+    static String::string* flatten_(tree* t, GC::gc* gc_pool) {
+      auto length = output_length(t);
+      auto buffer = GC::gc_alloc_n_char(length, gc_pool);
+      write_output(t, buffer);
+      return String::gcnew(buffer, length, gc_pool);
+    }
+
+    // hand the first length bytes of chunk to emit, returns a new chunk holding the rest
+    static VALUE emit_chunk(VALUE chunk, long length, long chunk_size, chunk_emitter emit, VALUE arg) {
+      AT_STACK(rest, rb_str_buf_new(chunk_size));
+      rb_str_cat(rest, RSTRING_PTR(chunk) + length, RSTRING_LEN(chunk) - length);
+      rb_str_set_len(chunk, length);
+      emit(chunk, arg);
+      return rest;
+    }
+
+    struct chunk_writer {
+      VALUE chunk;
+      long chunk_size;
+      long checked;  // no mark starts before chunk[checked], tail[tail_length + checked] if negative
+      VALUE tail;  // the last mark_length - 1 bytes emitted before the chunk, a mark may start in them
+      const char* mark;
+      long mark_length;
+      chunk_emitter emit;
+      VALUE arg;
+    };
+
+    // returns the index just after the first mark starting at w->checked or later, or -1. a mark
+    // starting in the tail ends in the chunk.
+    static long find_mark(chunk_writer* w) {
+      const char* p = RSTRING_PTR(w->chunk);
+      const char* e = p + RSTRING_LEN(w->chunk);
+      auto tail        = RSTRING_PTR(w->tail);
+      auto tail_length = RSTRING_LEN(w->tail);
+      for (auto from = w->checked; from < 0; from++) {
+        auto k = -from;
+        if (e - p < w->mark_length - k) {
+          // the later ones need more of the chunk still
+          return -1;
+        }
+        if (memcmp(tail + tail_length - k, w->mark, static_cast<size_t>(k)) == 0 &&
+            memcmp(p, w->mark + k, static_cast<size_t>(w->mark_length - k)) == 0) {
+          return w->mark_length - k;
+        }
+      }
+      for (auto q = p + (w->checked > 0 ? w->checked : 0); e - q >= w->mark_length; q++) {
+        q = static_cast<const char*>(memchr(q, w->mark[0], static_cast<size_t>(e - q)));
+        if (q == NULL || e - q < w->mark_length) {
+          break;
+        }
+        if (memcmp(q, w->mark, static_cast<size_t>(w->mark_length)) == 0) {
+          return q - p + w->mark_length;
+        }
+      }
+      return -1;
+    }
+
+    // keep the end of chunk[0...length] in the tail before it is emitted
+    static void keep_tail(chunk_writer* w, long length) {
+      auto keep = w->mark_length - 1;
+      auto p    = RSTRING_PTR(w->chunk);
+      rb_str_modify(w->tail);
+      if (length >= keep) {
+        rb_str_set_len(w->tail, 0);
+        rb_str_cat(w->tail, p + length - keep, keep);
+      } else {
+        auto old  = RSTRING_LEN(w->tail);
+        auto drop = old + length - keep;
+        if (drop > 0) {
+          memmove(RSTRING_PTR(w->tail), RSTRING_PTR(w->tail) + drop, static_cast<size_t>(old - drop));
+          rb_str_set_len(w->tail, old - drop);
+        }
+        rb_str_cat(w->tail, p, length);
+      }
+      w->checked = -RSTRING_LEN(w->tail);
+      return;
+    }
+
+    static void write_chunk(chunk_writer* w, const char* s, long n) {
+      while (n > 0) {
+        auto room = w->chunk_size - RSTRING_LEN(w->chunk);
+        auto m    = n < room ? n : room;
+        rb_str_cat(w->chunk, s, m);
+        s += m;
+        n -= m;
+
+        if (w->mark != NULL) {
+          long end;
+          while ((end = find_mark(w)) != -1) {
+            w->chunk = emit_chunk(w->chunk, end, w->chunk_size, w->emit, w->arg);
+            // the mark is used up, the next one starts after it
+            rb_str_set_len(w->tail, 0);
+            w->checked = 0;
+          }
+          w->checked = RSTRING_LEN(w->chunk) - w->mark_length + 1;
+          if (w->checked < -RSTRING_LEN(w->tail)) {
+            w->checked = -RSTRING_LEN(w->tail);
+          }
+        }
+        if (RSTRING_LEN(w->chunk) == w->chunk_size) {
+          w->checked = 0;
+          if (w->mark != NULL) {
+            keep_tail(w, w->chunk_size);
+          }
+          w->chunk = emit_chunk(w->chunk, w->chunk_size, w->chunk_size, w->emit, w->arg);
+        }
+      }
+      return;
+    }
+
+    static void put(chunk_writer* w, const char* s, long n) {
+      write_chunk(w, s, n);
+      return;
+    }
+
+    static void pad(chunk_writer* w, long n) {
+      static const char spaces[] = "                                ";
+      const long spaces_length = SIZE_OF(spaces) - 1;
+      for (; n > 0; n -= spaces_length) {
+        write_chunk(w, spaces, n < spaces_length ? n : spaces_length);
+      }
+      return;
+    }
+
+    // same as flatten, but the document goes to emit in chunks of at most chunk_size bytes
+    // instead of being joined into one string. a chunk also ends right after each flush_after.
+    void flatten_each(tree* t, long chunk_size, VALUE flush_after, chunk_emitter emit, VALUE arg) {
+      if (t == NULL) {
+        return;
+      }
+
+      chunk_writer w;
+      AT_STACK(tail, rb_str_buf_new(0));
+      w.chunk_size  = chunk_size;
+      w.checked     = 0;
+      w.tail        = tail;
+      w.mark        = NULL;
+      w.mark_length = 0;
+      w.emit        = emit;
+      w.arg         = arg;
+      if (!NIL_P(flush_after) && RSTRING_LEN(flush_after) > 0) {
+        w.mark        = RSTRING_PTR(flush_after);
+        w.mark_length = RSTRING_LEN(flush_after);
+      }
+
+      AT_STACK(chunk, rb_str_buf_new(chunk_size));
+      w.chunk = chunk;
+      bool bol = true;
+      write_lines(t, 0, &bol, &w);
+      if (RSTRING_LEN(w.chunk) > 0) {
+        emit(w.chunk, arg);
+      }
+      return;
     }
 
   }
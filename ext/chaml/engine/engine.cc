@@ -1,4 +1,20 @@
 #include "./chaml.h"
+#include "./probes.h"
+#include <new>
+#ifdef HAVE_RUBY_THREAD_H
+#include <ruby/thread.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
 
 /* # abstruct
  * module CHaml
@@ -7,7 +23,7 @@
  *       # do something ...
  *     end
  *
- *     def open(file_name)
+ *     def open(file_name, options = {})
  *       # do something ...
  *     end
  *
@@ -19,10 +35,47 @@
  *       # do something ...
  *     end
  *
- *     def render(location = self)
+ *     def compile
  *       # do something ...
  *     end
  *
+ *     def render(location = self, layout: nil)
+ *       # do something ...
+ *     end
+ *
+ *     def write_chunks(location = self, chunk_size: 16384, flush_after: nil, layout: nil)
+ *       # render, then yield the output in chunks ...
+ *     end
+ *
+ *     def write_chunks_to(io, location = self, chunk_size: 16384, flush_after: nil, layout: nil)
+ *       # render, then write the output to io in chunks ...
+ *     end
+ *
+ *     def name
+ *       # the path the template was read from, or nil ...
+ *     end
+ *
+ *     def reload(templ = nil)
+ *       # compile templ or the file again, only its changed blocks if reloadable ...
+ *     end
+ *
+ *     def relink
+ *       # look the partials up again and put the static ones into the tree ...
+ *     end
+ *
+ *     def last_render_stats
+ *       # the seconds of each phase, the evals, the arena and the output size of the last render ...
+ *     end
+ *
+ *     def freeze
+ *       # compile, then freeze so that Ractor.make_shareable can share it ...
+ *     end
+ *
+ *     def self.compile_files(paths, options, threads)
+ *       # read and compile the files on native threads ...
+ *       # [[engine or nil, seconds, error or nil], ...]
+ *     end
+ *
  *     class UnknownOptionError < StandardError
  *     end
  *
@@ -35,7 +88,11 @@
 static VALUE chaml, engine;
 static VALUE err_unknown_option, err_unknown_param;
 
-static VALUE sym_format, sym_escape_html, sym_raise_unknown_option, sym_default_indent_depth;
+static VALUE sym_format, sym_escape_html, sym_raise_unknown_option, sym_default_indent_depth, sym_compile_script;
+static VALUE sym_arena_limit, sym_partials, sym_reloadable;
+static VALUE sym_mmap, sym_chunk_size, sym_flush_after, sym_layout;
+static VALUE sym_evaluate, sym_static_haml, sym_html, sym_flatten, sym_total;
+static VALUE sym_evals, sym_eval_bytes, sym_arena_chunks, sym_arena_bytes, sym_arena_used, sym_output_bytes;
 
 namespace CHaml {
   namespace Engine {
@@ -60,6 +117,11 @@ namespace CHaml {
   sym_##sym = SYMBOL(sym)
 
 extern "C" void Init_engine(void) {
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  // the globals below are set once here and only read afterwards
+  rb_ext_ractor_safe(true);
+#endif
+
   rb_gc_register_address(&chaml);
   rb_gc_register_address(&engine);
 
@@ -69,18 +131,53 @@ extern "C" void Init_engine(void) {
   rb_define_alloc_func(engine, CHaml::Engine::alloc);
 
   DEFINE_PRIVATE_METHOD(engine, initialize, -1);
-  DEFINE_METHOD(engine, open, 1);
+  DEFINE_METHOD(engine, open, -1);
   DEFINE_METHOD(engine, concat, 1);
   DEFINE_METHOD(engine, append_option, 1);
+  DEFINE_METHOD(engine, compile, 0);
   DEFINE_METHOD(engine, render, -1);
+  DEFINE_METHOD(engine, write_chunks, -1);
+  DEFINE_METHOD(engine, write_chunks_to, -1);
+  DEFINE_METHOD(engine, freeze, 0);
+  DEFINE_METHOD(engine, dump, 0);
+  DEFINE_METHOD(engine, load, 1);
+  DEFINE_METHOD(engine, last_render_stats, 0);
+  DEFINE_METHOD(engine, name, 0);
+  DEFINE_METHOD(engine, reload, -1);
+  DEFINE_METHOD(engine, relink, 0);
+  rb_define_singleton_method(engine, "compile_files", RUBY_METHOD_FUNC(CHaml::Engine::compile_files), 3);
+
+  // the version of Engine#dump, a dump of another version is not loaded
+  rb_define_const(engine, "DUMP_VERSION", INT2FIX(CHaml::Converter::dump_version));
 
   DECLARE_ERROR_CLASS_UNDER(unknown_option, "UnknownOptionError",    chaml);
   DECLARE_ERROR_CLASS_UNDER(unknown_param,  "UnknownParameterError", chaml);
 
+  CHaml::Watcher::define(chaml);
+
   PRELOAD_SYMBOL(format);
   PRELOAD_SYMBOL(escape_html);
   PRELOAD_SYMBOL(raise_unknown_option);
   PRELOAD_SYMBOL(default_indent_depth);
+  PRELOAD_SYMBOL(compile_script);
+  PRELOAD_SYMBOL(arena_limit);
+  PRELOAD_SYMBOL(partials);
+  PRELOAD_SYMBOL(reloadable);
+  PRELOAD_SYMBOL(mmap);
+  PRELOAD_SYMBOL(chunk_size);
+  PRELOAD_SYMBOL(flush_after);
+  PRELOAD_SYMBOL(layout);
+  PRELOAD_SYMBOL(evaluate);
+  PRELOAD_SYMBOL(static_haml);
+  PRELOAD_SYMBOL(html);
+  PRELOAD_SYMBOL(flatten);
+  PRELOAD_SYMBOL(total);
+  PRELOAD_SYMBOL(evals);
+  PRELOAD_SYMBOL(eval_bytes);
+  PRELOAD_SYMBOL(arena_chunks);
+  PRELOAD_SYMBOL(arena_bytes);
+  PRELOAD_SYMBOL(arena_used);
+  PRELOAD_SYMBOL(output_bytes);
   return;
 }
 
@@ -104,9 +201,19 @@ namespace CHaml {
       return;
     }
 
+    static void mark(Converter::compiled* c) {
+      if (c != NULL) {
+        rb_gc_mark(c->proc);
+        rb_gc_mark(c->partials);
+      }
+      return;
+    }
+
     static void mark(engine* e) {
       rb_gc_mark(e->templ);
-      mark(e->gc_pool);
+      rb_gc_mark(e->name);
+      rb_gc_mark(e->options.partials);
+      mark(e->compiled);
       return;
     }
 
@@ -115,8 +222,147 @@ namespace CHaml {
       return;
     }
 
+    static void unmap(engine* e);
+
+    static void final(engine* e) {
+      Converter::release(e->compiled);
+      unmap(e);
+      while (e->arena != NULL) {
+        auto next = e->arena->next;
+        GC::final(e->arena);
+        e->arena = next;
+      }
+#ifdef HAVE_RUBY_THREAD_NATIVE_H
+      rb_nativethread_lock_destroy(&e->lock);
+#endif
+      xfree(e);
+      return;
+    }
+
+    static void final(void* e) {
+      final(static_cast<engine*>(e));
+      return;
+    }
+
+#ifndef RUBY_TYPED_FROZEN_SHAREABLE
+#define RUBY_TYPED_FROZEN_SHAREABLE 0
+#endif
+
+    static const rb_data_type_t engine_data_type = {
+#ifdef __CLANG__
+      .wrap_struct_name = "CHaml::Engine",
+      .function         = {
+        .dmark = mark,
+        .dfree = final,
+      },
+      .flags            = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE,
+#else
+      wrap_struct_name: "CHaml::Engine",
+      function        : {
+        dmark: mark,
+        dfree: final,
+      },
+      parent          : NULL,
+      data            : NULL,
+      flags           : RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE,
+#endif
+    };
+
     static VALUE alloc(VALUE klass) {
-      return Data_Wrap_Struct(klass, mark, -1, ALLOC(engine));
+      auto e = ZALLOC(engine);
+      e->templ = Qnil;
+      e->name  = Qnil;
+#ifdef HAVE_RUBY_THREAD_NATIVE_H
+      rb_nativethread_lock_initialize(&e->lock);
+#endif
+      return TypedData_Wrap_Struct(klass, &engine_data_type, e);
+    }
+
+    static void lock(engine* e) {
+#ifdef HAVE_RUBY_THREAD_NATIVE_H
+      rb_nativethread_lock_lock(&e->lock);
+#else
+      (void)e;
+#endif
+      return;
+    }
+
+    static void unlock(engine* e) {
+#ifdef HAVE_RUBY_THREAD_NATIVE_H
+      rb_nativethread_lock_unlock(&e->lock);
+#else
+      (void)e;
+#endif
+      return;
+    }
+
+    // drop the compiled template, it will be built again by the next render
+    static void invalidate(engine* e) {
+      if (e->rendering > 0) {
+        rb_raise(rb_eRuntimeError, "can't modify the template while it is being rendered");
+      }
+      Converter::release(e->compiled);
+      e->compiled = NULL;
+      return;
+    }
+
+    // the compiled tree points into the mapping, so invalidate it first
+    static void unmap(engine* e) {
+#ifdef HAVE_SYS_MMAN_H
+      if (e->mapping != NULL) {
+        munmap(const_cast<char*>(e->mapping), static_cast<size_t>(e->mapping_length));
+      }
+#endif
+      e->mapping        = NULL;
+      e->mapping_length = 0;
+      return;
+    }
+
+    // map file_name read only, returns false if it should be read instead
+    static bool map(engine* e, VALUE file_name) {
+#ifdef HAVE_SYS_MMAN_H
+      auto path = StringValueCStr(file_name);
+      auto fd   = ::open(path, O_RDONLY);
+      if (fd < 0) {
+        rb_sys_fail(path);
+      }
+
+      struct stat st;
+      if (fstat(fd, &st) < 0) {
+        close(fd);
+        rb_sys_fail(path);
+      }
+      // mmap(2) refuses empty files and anything but regular ones can not be mapped
+      if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return false;
+      }
+
+      auto p = mmap(NULL, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if (p == MAP_FAILED) {
+        rb_sys_fail(path);
+      }
+
+      e->mapping        = static_cast<const char*>(p);
+      e->mapping_length = static_cast<long>(st.st_size);
+      e->templ          = Qnil;
+      return true;
+#else
+      (void)e;
+      (void)file_name;
+      return false;
+#endif
+    }
+
+    // bring a mapped template back into a ruby string
+    static void unmap_to_string(engine* e) {
+      if (e->mapping != NULL) {
+        invalidate(e);
+        e->templ = rb_str_new(e->mapping, e->mapping_length);
+        unmap(e);
+      }
+      return;
     }
 
     static int merge_option_body(VALUE key, VALUE value, VALUE self) {
@@ -126,6 +372,11 @@ namespace CHaml {
       if (!SYMBOL_P(key)) {
         key = METHOD_CALL(key, to_sym);
       }
+      // looked up by name when the template is compiled, so it is kept as it is
+      if (key == sym_partials) {
+        e->options.partials = value;
+        return ST_CONTINUE;
+      }
       // SPECIAL_CONST_P => true iff. value in [NilClass, TrueClass, FalseClass, Fixnum, Symbol]
       if (!SPECIAL_CONST_P(value)) {
         value = METHOD_CALL(value, to_sym);
@@ -161,6 +412,20 @@ namespace CHaml {
         }
       } else if (key == sym_default_indent_depth) {
         e->options.default_indent_depth = FIX2INT(value);
+      } else if (key == sym_arena_limit) {
+        e->options.arena_limit = NIL_P(value) ? 0 : NUM2LONG(value);
+      } else if (key == sym_compile_script) {
+        if (value == Qnil || value == Qfalse) {
+          e->options.compile_script = false;
+        } else {
+          e->options.compile_script = true;
+        }
+      } else if (key == sym_reloadable) {
+        if (value == Qnil || value == Qfalse) {
+          e->options.reloadable = false;
+        } else {
+          e->options.reloadable = true;
+        }
       } else {
         if (e->options.raise_unknown_option) {
           AT_STACK(rs, METHOD_CALL(key, METHOD(to_s)));
@@ -174,7 +439,10 @@ namespace CHaml {
 
     // def append_option(options) # options: Hash
     VALUE append_option(VALUE self, VALUE options) {
+      rb_check_frozen(self);
       Check_Type(options, T_HASH);
+      DATA_READY(engine, e, self);
+      invalidate(e);
 
       /*
        * @options.merge! options
@@ -191,11 +459,19 @@ namespace CHaml {
       .escape_html          = false,
       .raise_unknown_option = true,
       .default_indent_depth = 2,
+      .compile_script       = true,
+      .reloadable           = false,
+      .arena_limit          = 0,
+      .partials             = Qnil,
 #else
       format              : default_format,
       escape_html         : false,
       raise_unknown_option: true,
       default_indent_depth: 2,
+      compile_script      : true,
+      reloadable          : false,
+      arena_limit         : 0,
+      partials            : Qnil,
 #endif
     };
 
@@ -210,10 +486,12 @@ namespace CHaml {
 
       register auto options = options_;
       DATA_READY(engine, e, self);
+      invalidate(e);
+      unmap(e);
 
-      e->options = default_options;
-      e->templ   = templ_;
-      e->gc_pool = NULL;
+      e->options  = default_options;
+      e->templ    = templ_;
+      e->name     = Qnil;
 
       if (!NIL_P(options)) {
         append_option(self, options);
@@ -222,11 +500,32 @@ namespace CHaml {
       return Qnil;
     }
 
-    // def open(file_name) # file_name: String
-    VALUE open(VALUE self, VALUE file_name) {
+    // def open(file_name, options = {}) # file_name: String, options: Hash
+    //
+    // With `mmap: true' the file is mapped read only and parsed in place, no copy of it is made.
+    // The file must not be truncated or rewritten in place while the engine uses it.
+    VALUE open(int argc, VALUE* argv, VALUE self) {
+      volatile VALUE file_name_;
+      volatile VALUE options_;
+      rb_scan_args(argc, argv, "11", &file_name_, &options_);
+      register auto file_name = file_name_;
+      register auto options   = options_;
+
+      rb_check_frozen(self);
       Check_Type(file_name, T_STRING);
       DATA_READY(engine, e, self);
 
+      invalidate(e);
+      unmap(e);
+      e->name = rb_str_new_frozen(file_name);
+
+      if (!NIL_P(options)) {
+        Check_Type(options, T_HASH);
+        if (RTEST(rb_hash_aref(options, sym_mmap)) && map(e, file_name)) {
+          return self;
+        }
+      }
+
       /*
        * file   = File.open(file_name)
        * @templ = file.read
@@ -242,50 +541,1174 @@ namespace CHaml {
 
     // def concat(templ) # templ: String
     VALUE concat(VALUE self, VALUE templ) {
+      rb_check_frozen(self);
       Check_Type(templ, T_STRING);
       DATA_READY(engine, e, self);
+      invalidate(e);
 
       /*
        * @templ.concat(templ)
        */
+      unmap_to_string(e);
       METHOD_CALL(e->templ, METHOD(concat), templ);
 
       return self;
     }
 
-    // def render(location = self)
+    static double monotonic_seconds() {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return static_cast<double>(ts.tv_sec) + static_cast<double>(ts.tv_nsec) / 1e9;
+    }
+
+    // below this many bytes of template the work is cheaper than handing the gvl over
+    const long without_gvl_threshold = 16 * 1024;
+
+    struct without_gvl_t {
+      void (*f)(void*);
+      void* arg;
+      bool failed;
+    };
+
+    static void* without_gvl_body(void* arg) {
+      auto w = static_cast<without_gvl_t*>(arg);
+      try {
+        w->f(w->arg);
+      } catch (const std::bad_alloc&) {
+        w->failed = true;
+      }
+      return NULL;
+    }
+
+    // run f(arg) and let the other threads run meanwhile, if size bytes of work are worth it.
+    // f must not touch any ruby object, and may allocate only from pool.
+    static void without_gvl(void (*f)(void*), void* arg, GC::gc* pool, long size) {
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+      if (size >= without_gvl_threshold) {
+        without_gvl_t w = {f, arg, false};
+        pool->without_gvl = true;
+        rb_thread_call_without_gvl(without_gvl_body, &w, NULL, NULL);
+        pool->without_gvl = false;
+        if (w.failed) {
+          rb_memerror();
+        }
+        return;
+      }
+#else
+      (void)pool;
+      (void)size;
+#endif
+      f(arg);
+      return;
+    }
+
+    struct compile_t {
+      VALUE self;
+      Converter::compiled* compiled;
+      Converter::compiled* old;  // the blocks the recompile carries over, or NULL
+      engine::option_t options;
+      int parsed;
+      bool done;
+    };
+
+    static void compile_without_gvl(void* arg) {
+      auto c = static_cast<compile_t*>(arg);
+      PROBE(compile__start, c->compiled->name, c->compiled->length);
+      if (c->old != NULL) {
+        c->parsed = Converter::recompile(c->compiled, c->old, c->options);
+      } else {
+        Converter::compile(c->compiled, c->options);
+      }
+      PROBE(compile__done, c->compiled->name, c->compiled->slot_count);
+      return;
+    }
+
+    static VALUE compile_body(VALUE arg) {
+      auto c = reinterpret_cast<compile_t*>(arg);
+      without_gvl(compile_without_gvl, c, c->compiled->gc_pool, c->compiled->length);
+      c->done = true;
+      return Qnil;
+    }
+
+    // another thread may have compiled the template meanwhile, the first one wins
+    static VALUE compile_ensure(VALUE arg) {
+      auto c = reinterpret_cast<compile_t*>(arg);
+      DATA_READY(engine, e, c->self);
+
+      lock(e);
+      e->rendering--;
+      auto won = c->done && e->compiled == NULL;
+      if (won) {
+        e->compiled = c->compiled;
+      }
+      unlock(e);
+      if (!won) {
+        Converter::release(c->compiled);
+      }
+      return Qnil;
+    }
+
+    // the string null terminated in pool, for the code running without the gvl
+    static const char* copy_cstr(VALUE s, GC::gc* pool) {
+      auto length = RSTRING_LEN(s);
+      auto ret    = GC::gc_alloc_n_char(length + 1, pool);
+      memcpy(ret, RSTRING_PTR(s), static_cast<size_t>(length));
+      ret[length] = '\0';
+      return ret;
+    }
+
+    // lex and parse the template only once, later renders start from the parsed tree. with old,
+    // the blocks of its tree that did not change are carried over. return the blocks parsed.
+    static int build(VALUE self, Converter::compiled* old) {
+      DATA_READY(engine, e, self);
+
+      lock(e);
+      auto compiled = e->compiled;
+      unlock(e);
+      if (compiled == NULL) {
+        compile_t c;
+        c.self    = self;
+        c.old     = old;
+        c.options = e->options;
+        c.parsed  = 0;
+        c.done    = false;
+        if (e->mapping != NULL) {
+          // the mapping lives as long as the compiled tree, parse it in place
+          c.compiled = Converter::prepare(e->mapping, e->mapping_length, false);
+        } else {
+          auto templ = StringValuePtr(e->templ);
+          c.compiled = Converter::prepare(templ, RSTRING_LEN(e->templ), true);
+        }
+        if (!NIL_P(e->name)) {
+          c.compiled->name = copy_cstr(e->name, c.compiled->gc_pool);
+        }
+
+        // the template can not be changed until the tree is built
+        lock(e);
+        e->rendering++;
+        unlock(e);
+        rb_ensure(compile_body, reinterpret_cast<VALUE>(&c), compile_ensure, reinterpret_cast<VALUE>(&c));
+        return c.parsed;
+      }
+      return 0;
+    }
+
+    static void build(VALUE self) {
+      build(self, NULL);
+      return;
+    }
+
+    // partials nested deeper than this are taken for a cycle
+    const int max_partial_depth = 32;
+
+    struct link_t {
+      VALUE self;
+      Converter::compiled* compiled;
+      int depth;
+      bool done;
+    };
+
+    static void link(VALUE self, int depth);
+
+    // the html of c is the same every time, all of its slots are partials put into the tree
+    static bool is_static(Converter::compiled* c) {
+      for (auto p = c->slots; p != NULL; p = p->next) {
+        if (p->kind != SLOT_PARTIAL) {
+          return false;
+        }
+      }
+      return NIL_P(c->partials);
+    }
+
+    // look the partials of the template up in the partials option. a static one is rendered once
+    // and put into the tree, the others are rendered along with the template.
+    static VALUE link_body(VALUE arg) {
+      auto l = reinterpret_cast<link_t*>(arg);
+      DATA_READY(engine, e, l->self);
+      auto c = l->compiled;
+
+      AT_STACK(partials, rb_ary_new());
+      auto inlined = false;
+      auto i = 0;
+      for (auto p = c->slots; p != NULL; p = p->next, i++) {
+        if (p->kind != SLOT_PARTIAL || Converter::find_slot(c, i) == NULL) {
+          continue;
+        }
+        AT_STACK(name, rb_str_new(p->code->buffer, p->code->length));
+        AT_STACK(child, NIL_P(e->options.partials) ? Qnil : METHOD_CALL(e->options.partials, rb_intern("[]"), name));
+        if (!rb_obj_is_kind_of(child, ::engine)) {
+          // "+ more" in a text, no partial is named so
+          Converter::inline_text(c, i, p->lineno);
+          inlined = true;
+          continue;
+        }
+        if (l->depth >= max_partial_depth) {
+          rb_raise(rb_eRuntimeError, "partials nested more than %d deep at `%s', is it a cycle?",
+                   max_partial_depth, StringValueCStr(name));
+        }
+        build(child);
+        link(child, l->depth + 1);
+
+        DATA_READY(engine, ce, child);
+        if (is_static(ce->compiled)) {
+          AT_STACK(html, render(0, NULL, child));
+          Converter::inline_partial(c, i, RSTRING_PTR(html), RSTRING_LEN(html));
+          inlined = true;
+        } else {
+          rb_ary_store(partials, i, child);
+        }
+      }
+      if (inlined) {
+        // the html of the static partials joins the html segments around them
+        Converter::refold(c, e->options);
+      }
+      if (RARRAY_LEN(partials) > 0) {
+        c->partials = rb_obj_freeze(partials);
+      }
+      c->linked = true;
+      l->done   = true;
+      return Qnil;
+    }
+
+    static VALUE link_ensure(VALUE arg) {
+      auto l = reinterpret_cast<link_t*>(arg);
+      DATA_READY(engine, e, l->self);
+
+      lock(e);
+      e->rendering--;
+      auto won = l->done && e->compiled == NULL;
+      if (won) {
+        e->compiled = l->compiled;
+      }
+      unlock(e);
+      if (!won) {
+        Converter::release(l->compiled);
+      }
+      return Qnil;
+    }
+
+    // resolve the partials of the compiled template, once
+    static void link(VALUE self, int depth) {
+      DATA_READY(engine, e, self);
+
+      // no render starts from the tree until it is linked, and the template can not be changed
+      lock(e);
+      auto c = e->compiled;
+      if (c == NULL || c->linked) {
+        unlock(e);
+        return;
+      }
+      e->compiled = NULL;
+      e->rendering++;
+      unlock(e);
+
+      link_t l;
+      l.self     = self;
+      l.compiled = c;
+      l.depth    = depth;
+      l.done     = false;
+      rb_ensure(link_body, reinterpret_cast<VALUE>(&l), link_ensure, reinterpret_cast<VALUE>(&l));
+      return;
+    }
+
+    // the compiled and linked template of e, or NULL. with hold a render holds it until it
+    // decreases rendering again, the template is compiled by then.
+    static Converter::compiled* take(engine* e, bool hold) {
+      lock(e);
+      auto c = e->compiled;
+      if (c != NULL && !c->linked) {
+        c = NULL;
+      }
+      if (c != NULL && hold) {
+        e->rendering++;
+      }
+      unlock(e);
+      if (c == NULL && hold) {
+        rb_raise(rb_eRuntimeError, "the template is being compiled by another thread");
+      }
+      return c;
+    }
+
+    // Ractor.make_shareable freezes an engine without Engine#freeze. the ractors render such an
+    // engine at the same time and would compile it at the same time, so only the main one does.
+    static void check_shared(VALUE self) {
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+      if (OBJ_FROZEN(self)) {
+        CLASS_READY(Ractor);
+        if (METHOD_CALL(Ractor, METHOD(current)) != METHOD_CALL(Ractor, METHOD(main))) {
+          rb_raise(rb_eRuntimeError, "can't compile a frozen engine in a ractor, share it after Engine#freeze");
+        }
+      }
+#else
+      (void)self;
+#endif
+      return;
+    }
+
+    // def compile
+    VALUE compile(VALUE self) {
+      DATA_READY(engine, e, self);
+      if (take(e, false) != NULL) {
+        return self;
+      }
+      check_shared(self);
+      build(self);
+      link(self, 0);
+      return self;
+    }
+
+    struct reload_t {
+      VALUE self;
+      Converter::compiled* old;
+      const char* mapping;  // the old template, if it was mapped
+      long mapping_length;
+      bool incremental;
+      int parsed;
+    };
+
+    static VALUE reload_body(VALUE arg) {
+      auto r = reinterpret_cast<reload_t*>(arg);
+      r->parsed = build(r->self, r->incremental ? r->old : NULL);
+      link(r->self, 0);
+      return Qnil;
+    }
+
+    // the carried blocks are copied by now, the old tree and the template it points into go
+    static VALUE reload_ensure(VALUE arg) {
+      auto r = reinterpret_cast<reload_t*>(arg);
+      Converter::release(r->old);
+#ifdef HAVE_SYS_MMAN_H
+      if (r->mapping != NULL) {
+        munmap(const_cast<char*>(r->mapping), static_cast<size_t>(r->mapping_length));
+      }
+#endif
+      return Qnil;
+    }
+
+    // true iff. the blocks of c are all carried over by a recompile of the same template
+    static bool carries_all(Converter::compiled* c) {
+      for (auto b = c->blocks; b != NULL; b = b->next) {
+        if (b->partials) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // def reload(templ = nil) # templ: String
+    //
+    // Compile templ, or the file the template was opened from, in place of the template. An
+    // engine compiled with `reloadable: true' parses again only the blocks, a line at indent 0
+    // and the lines under it, that changed and the ones with partials, and returns how many it
+    // parsed. The others are compiled as a whole and return nil.
+    VALUE reload(int argc, VALUE* argv, VALUE self) {
+      volatile VALUE templ_;
+      rb_scan_args(argc, argv, "01", &templ_);
+      register auto templ = templ_;
+
+      rb_check_frozen(self);
+      DATA_READY(engine, e, self);
+      if (NIL_P(templ)) {
+        if (NIL_P(e->name)) {
+          rb_raise(rb_eArgError, "the template was not opened from a file");
+        }
+        templ = METHOD_CALL(CLASS(File), METHOD(read), e->name);
+      }
+      Check_Type(templ, T_STRING);
+      if (e->rendering > 0) {
+        rb_raise(rb_eRuntimeError, "can't modify the template while it is being rendered");
+      }
+
+      auto old = e->compiled;
+      auto incremental = old != NULL && old->blocks != NULL;
+      if (incremental && old->length == RSTRING_LEN(templ) &&
+          memcmp(old->templ, RSTRING_PTR(templ), static_cast<size_t>(old->length)) == 0 && carries_all(old)) {
+        return INT2FIX(0);
+      }
+
+      // the old tree is kept until the new one has taken its blocks
+      reload_t r;
+      r.self           = self;
+      r.old            = old;
+      r.mapping        = e->mapping;
+      r.mapping_length = e->mapping_length;
+      r.incremental    = incremental;
+      r.parsed         = 0;
+      e->compiled       = NULL;
+      e->mapping        = NULL;
+      e->mapping_length = 0;
+      e->templ          = templ;
+      rb_ensure(reload_body, reinterpret_cast<VALUE>(&r), reload_ensure, reinterpret_cast<VALUE>(&r));
+
+      return incremental ? INT2FIX(r.parsed) : Qnil;
+    }
+
+    // def relink
+    //
+    // Look the partials of the template up again, after a static one put into its tree changed.
+    VALUE relink(VALUE self) {
+      rb_check_frozen(self);
+      DATA_READY(engine, e, self);
+      auto c = e->compiled;
+      if (c == NULL || c->directive_count == 0) {
+        return self;
+      }
+      for (auto p = c->slots; p != NULL; p = p->next) {
+        if (p->kind == SLOT_PARTIAL) {
+          AT_STACK(templ, e->mapping != NULL ? rb_str_new(e->mapping, e->mapping_length) : e->templ);
+          VALUE argv[] = {templ};
+          reload(1, argv, self);
+          break;
+        }
+      }
+      return self;
+    }
+
+    // a render borrows an arena of the engine, there are as many of them as renders ran at once
+    static GC::gc* take_arena(engine* e) {
+      lock(e);
+      auto ret = e->arena;
+      if (ret != NULL) {
+        e->arena = ret->next;
+      }
+      unlock(e);
+      return ret != NULL ? ret : GC::init();
+    }
+
+    static void give_back_arena(engine* e, GC::gc* arena) {
+      GC::reset(arena, e->options.arena_limit);
+      lock(e);
+      arena->next = e->arena;
+      e->arena    = arena;
+      unlock(e);
+      return;
+    }
+
+    const long default_chunk_size = 16 * 1024;
+
+    struct render_t {
+      VALUE self;
+      VALUE location;
+      VALUE holder;  // marks the values referred from gc_pool while it is in use
+      VALUE result;
+      engine::option_t options;
+      Converter::compiled* compiled;
+      GC::gc* gc_pool;
+      Converter::slot_value* values;
+      Converter::tree* html;
+      long length;
+      engine::stats_t stats;
+      VALUE partials;  // the engines of the partials and the layout rendered, their compiled trees are held until the end
+      VALUE layout;  // the engine the html is put into, or nil
+      Converter::compiled* page;  // the template yielded by the layout and its values, set once it is built
+      Converter::slot_value* page_values;
+      Converter::tree* page_html;
+      // write_chunks and write_chunks_to only
+      VALUE flush_after;
+      long chunk_size;
+      Converter::chunk_emitter emit;
+      VALUE arg;
+    };
+
+    static void mark_pool(void* gc_pool) {
+      mark(static_cast<GC::gc*>(gc_pool));
+      return;
+    }
+
+    static void html_without_gvl(void* arg) {
+      auto r = static_cast<render_t*>(arg);
+      auto start       = monotonic_seconds();
+      auto haml        = Converter::clone(r->compiled->t, r->gc_pool);
+      auto static_haml = Converter::static_haml_from_haml(haml, r->values);
+      auto built       = monotonic_seconds();
+      PROBE(phase__done, r->compiled->name, "static_haml");
+      PROBE(phase__start, r->compiled->name, "html");
+      r->html   = Converter::html_from_static_haml(static_haml, r->options, r->gc_pool);
+      r->length = Converter::output_length(r->html);
+      PROBE(phase__done, r->compiled->name, "html");
+      r->stats.static_haml += built - start;
+      r->stats.html         = monotonic_seconds() - built;
+      return;
+    }
+
+    // a partial rendered along with a template
+    struct partial_t {
+      Converter::compiled* compiled;
+      engine::option_t options;
+      Converter::slot_value* values;
+      GC::gc* gc_pool;
+      Converter::tree* html;
+    };
+
+    static void partial_without_gvl(void* arg) {
+      auto p = static_cast<partial_t*>(arg);
+      auto haml = Converter::clone(p->compiled->t, p->gc_pool);
+      p->html   = Converter::html_from_static_haml(Converter::static_haml_from_haml(haml, p->values), p->options, p->gc_pool);
+      return;
+    }
+
+    static void render_partials(render_t* r, Converter::compiled* c, Converter::slot_value* values, int depth);
+
+    // compile child and hold its compiled tree until r returns
+    static engine* hold(render_t* r, VALUE child, Converter::compiled** compiled) {
+      compile(child);
+      DATA_READY(engine, e, child);
+      if (NIL_P(r->partials)) {
+        r->partials = rb_ary_new();
+      }
+      *compiled = take(e, true);
+      rb_ary_push(r->partials, child);
+      return e;
+    }
+
+    // the page and its contents go into the yields of the layout and of its partials
+    static void fill_yields(render_t* r, Converter::compiled* c, Converter::slot_value* values) {
+      if (r->page_html == NULL) {
+        return;
+      }
+      auto i = 0;
+      for (auto p = c->slots; p != NULL; p = p->next, i++) {
+        if (p->kind != SLOT_YIELD) {
+          continue;
+        }
+        if (p->code->length == 0) {
+          values[i].html = r->page_html;
+        } else {
+          values[i].html = Converter::content_html(r->page, r->page_values, p->code->buffer, p->code->length,
+                                                   r->options, r->gc_pool);
+        }
+      }
+      return;
+    }
+
+    // the html of the partial child built in the arena of r. its ruby runs in the location of r,
+    // its html goes into the output of r with no string in between.
+    static Converter::tree* render_partial(render_t* r, VALUE child, int depth) {
+      if (depth > max_partial_depth) {
+        rb_raise(rb_eRuntimeError, "partials nested more than %d deep, is it a cycle?", max_partial_depth);
+      }
+      Converter::eval_stats evals;
+      partial_t p;
+      auto e = hold(r, child, &p.compiled);
+      p.options  = e->options;
+      p.gc_pool  = r->gc_pool;
+      AT_STACK(values, Converter::evaluate(p.compiled, r->location, p.options, &evals));
+      r->stats.evals      += evals.calls;
+      r->stats.eval_bytes += evals.bytes;
+      p.values = Converter::slot_values(p.compiled, values, p.options, r->gc_pool);
+      fill_yields(r, p.compiled, p.values);
+      render_partials(r, p.compiled, p.values, depth);
+      without_gvl(partial_without_gvl, &p, r->gc_pool, p.compiled->length);
+      return p.html;
+    }
+
+    static void render_partials(render_t* r, Converter::compiled* c, Converter::slot_value* values, int depth) {
+      if (NIL_P(c->partials)) {
+        return;
+      }
+      for (long i = 0; i < RARRAY_LEN(c->partials); i++) {
+        AT_STACK(child, rb_ary_entry(c->partials, i));
+        if (!NIL_P(child)) {
+          values[i].html = render_partial(r, child, depth + 1);
+        }
+      }
+      return;
+    }
+
+    // the layout runs its ruby in the location of the page, the html of the page and of its
+    // contents is spliced into the html of the layout as it is, no string is made of them
+    static void render_layout(render_t* r) {
+      auto start = monotonic_seconds();
+      Converter::eval_stats evals;
+      partial_t p;
+      auto e = hold(r, r->layout, &p.compiled);
+      r->page        = r->compiled;
+      r->page_values = r->values;
+      r->page_html   = r->html;
+
+      p.options  = e->options;
+      p.gc_pool  = r->gc_pool;
+      AT_STACK(values, Converter::evaluate(p.compiled, r->location, p.options, &evals));
+      r->stats.evals      += evals.calls;
+      r->stats.eval_bytes += evals.bytes;
+      p.values = Converter::slot_values(p.compiled, values, p.options, r->gc_pool);
+      fill_yields(r, p.compiled, p.values);
+      render_partials(r, p.compiled, p.values, 0);
+      auto evaluated = monotonic_seconds();
+
+      without_gvl(partial_without_gvl, &p, r->gc_pool, p.compiled->length);
+      r->html   = p.html;
+      r->length = Converter::output_length(r->html);
+      r->stats.evaluate += evaluated - start;
+      r->stats.html     += monotonic_seconds() - evaluated;
+      return;
+    }
+
+    // run the ruby of the template, then build the html without the gvl
+    static void render_html(render_t* r) {
+      DATA_READY(engine, e, r->self);
+      Converter::eval_stats evals;
+      auto name  = r->compiled->name;
+      PROBE(render__start, name, r->compiled->length);
+      PROBE(phase__start, name, "evaluate");
+      auto start = monotonic_seconds();
+      AT_STACK(values, Converter::evaluate(r->compiled, r->location, r->options, &evals));
+      auto evaluated = monotonic_seconds();
+      PROBE(phase__done, name, "evaluate");
+      PROBE(phase__start, name, "static_haml");
+      r->stats.evals      = evals.calls;
+      r->stats.eval_bytes = evals.bytes;
+
+      r->gc_pool = take_arena(e);
+      DATA_PTR(r->holder) = r->gc_pool;
+      r->values = Converter::slot_values(r->compiled, values, r->options, r->gc_pool);
+      // the partials run their ruby too, it is counted as evaluate
+      auto valued = monotonic_seconds();
+      render_partials(r, r->compiled, r->values, 0);
+      r->stats.evaluate    = evaluated - start + (monotonic_seconds() - valued);
+      r->stats.static_haml = valued - evaluated;
+
+      auto size = r->compiled->length;
+      for (auto i = 0; r->values != NULL && i < r->compiled->slot_count; i++) {
+        if (r->values[i].s != NULL) {
+          size += r->values[i].s->length;
+        }
+      }
+      without_gvl(html_without_gvl, r, r->gc_pool, size);
+      if (!NIL_P(r->layout)) {
+        render_layout(r);
+      }
+      return;
+    }
+
+    static void write_without_gvl(void* arg) {
+      auto r = static_cast<render_t*>(arg);
+      Converter::write_output(r->html, RSTRING_PTR(r->result));
+      return;
+    }
+
+    // the arena is counted before it is reset for the next render
+    static void record_stats(render_t* r) {
+      r->stats.arena_chunks = 0;
+      r->stats.arena_bytes  = 0;
+      for (auto c = r->gc_pool->chunks; c != NULL; c = c->next) {
+        r->stats.arena_chunks++;
+        r->stats.arena_bytes += static_cast<long>(c->size);
+      }
+      r->stats.arena_used   = static_cast<long>(r->gc_pool->used);
+      r->stats.output_bytes = r->length;
+      PROBE(render__done, r->compiled->name, r->length);
+
+      DATA_READY(engine, e, r->self);
+      lock(e);
+      e->stats    = r->stats;
+      e->rendered = true;
+      unlock(e);
+      return;
+    }
+
+    static VALUE render_body(VALUE arg) {
+      auto r = reinterpret_cast<render_t*>(arg);
+      render_html(r);
+
+      // the size is known before writing, so the html goes straight into the result.
+      // r is on the stack, which keeps the result from being moved while it is written.
+      r->result  = rb_str_new(NULL, r->length);
+      PROBE(phase__start, r->compiled->name, "flatten");
+      auto start = monotonic_seconds();
+      without_gvl(write_without_gvl, r, r->gc_pool, r->length);
+      r->stats.flatten = monotonic_seconds() - start;
+      PROBE(phase__done, r->compiled->name, "flatten");
+      record_stats(r);
+      return r->result;
+    }
+
+    static VALUE chunks_body(VALUE arg) {
+      auto r = reinterpret_cast<render_t*>(arg);
+      render_html(r);
+      // the time the block or the io takes for the chunks is a part of flatten
+      PROBE(phase__start, r->compiled->name, "flatten");
+      auto start = monotonic_seconds();
+      Converter::flatten_each(r->html, r->chunk_size, r->flush_after, r->emit, r->arg);
+      r->stats.flatten = monotonic_seconds() - start;
+      PROBE(phase__done, r->compiled->name, "flatten");
+      record_stats(r);
+      return Qnil;
+    }
+
+    // the template or the block may raise or break, release the pool anyway
+    static VALUE render_ensure(VALUE arg) {
+      auto r = reinterpret_cast<render_t*>(arg);
+      DATA_READY(engine, e, r->self);
+
+      lock(e);
+      e->rendering--;
+      unlock(e);
+      if (!NIL_P(r->partials)) {
+        for (long i = 0; i < RARRAY_LEN(r->partials); i++) {
+          DATA_READY(engine, partial, rb_ary_entry(r->partials, i));
+          lock(partial);
+          partial->rendering--;
+          unlock(partial);
+        }
+      }
+      DATA_PTR(r->holder) = NULL;
+      if (r->gc_pool != NULL) {
+        give_back_arena(e, r->gc_pool);
+        r->gc_pool = NULL;
+      }
+      return Qnil;
+    }
+
+    static VALUE render(render_t* r, VALUE (*body)(VALUE)) {
+      AT_STACK(holder, Data_Wrap_Struct(0, mark_pool, NULL, NULL));
+      r->holder = holder;
+
+      compile(r->self);
+      DATA_READY(engine, e, r->self);
+      r->options = e->options;
+      // the renders hold the compiled tree until they return
+      r->compiled = take(e, true);
+      return rb_ensure(body, reinterpret_cast<VALUE>(r), render_ensure, reinterpret_cast<VALUE>(r));
+    }
+
+    static void init_render(render_t* r, VALUE self, VALUE location) {
+      r->self        = self;
+      r->location    = NIL_P(location) ? self : location;
+      r->result      = Qnil;
+      r->gc_pool     = NULL;
+      r->values      = NULL;
+      r->html        = NULL;
+      r->length      = 0;
+      r->partials    = Qnil;
+      r->layout      = Qnil;
+      r->page        = NULL;
+      r->page_values = NULL;
+      r->page_html   = NULL;
+      r->flush_after = Qnil;
+      r->chunk_size  = default_chunk_size;
+      r->emit        = NULL;
+      r->arg         = Qnil;
+      return;
+    }
+
+    // the engine given by layout: in options, or nil
+    static VALUE layout_of(VALUE options) {
+      if (NIL_P(options)) {
+        return Qnil;
+      }
+      AT_STACK(layout, rb_hash_aref(options, sym_layout));
+      if (!NIL_P(layout) && !rb_obj_is_kind_of(layout, ::engine)) {
+        rb_raise(rb_eTypeError, "layout must be a CHaml::Engine, %s given", rb_obj_classname(layout));
+      }
+      return layout;
+    }
+
+    // def render(location = self, layout: nil)
+    //
+    // With a layout, the layout is rendered in location too and `+ yield' in it writes the output
+    // of this template, `+ yield name' its `+ content_for name'.
     VALUE render(int argc, VALUE* argv, VALUE self) {
       // location ||= self
       volatile VALUE location_;
-      rb_scan_args(argc, argv, "01", &location_);
-      register auto location = location_;
-      if (NIL_P(location)) {
-        location = self;
+      volatile VALUE options_;
+      rb_scan_args(argc, argv, "01:", &location_, &options_);
+
+      render_t r;
+      init_render(&r, self, location_);
+      r.layout = layout_of(options_);
+      return render(&r, render_body);
+    }
+
+    // the document is rendered as a whole first, the script of the template evaluates every slot
+    // at once. only its write is split: the chunks are copied out of the html tree one at a time,
+    // so no String of the whole document is made, but the tree of it is in the arena meanwhile.
+    static void write_chunks(VALUE self, VALUE location, VALUE options, Converter::chunk_emitter emit, VALUE arg) {
+      render_t r;
+      init_render(&r, self, location);
+      r.emit   = emit;
+      r.arg    = arg;
+      r.layout = layout_of(options);
+
+      if (!NIL_P(options)) {
+        AT_STACK(chunk_size, rb_hash_aref(options, sym_chunk_size));
+        if (!NIL_P(chunk_size)) {
+          r.chunk_size = NUM2LONG(chunk_size);
+          if (r.chunk_size <= 0) {
+            rb_raise(rb_eArgError, "chunk_size must be positive, %ld given", r.chunk_size);
+          }
+        }
+        AT_STACK(flush_after, rb_hash_aref(options, sym_flush_after));
+        if (!NIL_P(flush_after)) {
+          r.flush_after = StringValue(flush_after);
+        }
+      }
+
+      // the chunks point into the compiled tree until the last one is emitted
+      render(&r, chunks_body);
+      return;
+    }
+
+    // def freeze
+    //
+    // A frozen engine is compiled and can not be changed, so that Ractor.make_shareable
+    // can share it between ractors. They render it at the same time.
+    VALUE freeze(VALUE self) {
+      compile(self);
+      DATA_READY(engine, e, self);
+
+      // the partials rendered along with it are shared with it
+      auto partials = e->compiled->partials;
+      for (long i = 0; !NIL_P(partials) && i < RARRAY_LEN(partials); i++) {
+        AT_STACK(child, rb_ary_entry(partials, i));
+        if (!NIL_P(child)) {
+          METHOD_CALL(child, METHOD(freeze));
+        }
       }
+      return rb_call_super(0, NULL);
+    }
 
-      // preload regexp for preservation
-      METHOD_CALL(location, METHOD(instance_eval), rb_str_new2(Converter::preservation_regexp));
+    // def dump
+    //
+    // The compiled template and the options in a string. Engine#load builds the same engine from
+    // it in another process without parsing the template.
+    VALUE dump(VALUE self) {
+      compile(self);
+      DATA_READY(engine, e, self);
+      return Converter::dump(e->compiled, e->options);
+    }
 
+    // def load(dump) # dump: String
+    VALUE load(VALUE self, VALUE dump) {
+      rb_check_frozen(self);
+      Check_Type(dump, T_STRING);
       DATA_READY(engine, e, self);
-      auto gc_pool = GC::init();
-      e->gc_pool = gc_pool;
+      invalidate(e);
+      unmap(e);
+
+      // raise_unknown_option and arena_limit are not a part of the dump
+      auto options = e->options;
+      String::string* iseq;
+      auto c = Converter::load(RSTRING_PTR(dump), RSTRING_LEN(dump), &options, &iseq);
+      if (c == NULL) {
+        rb_raise(rb_eArgError, "not a dump of CHaml::Engine version %d", Converter::dump_version);
+      }
+      e->options  = options;
+      e->templ    = rb_str_new(c->templ, c->length);
+      e->name     = Qnil;
+      e->compiled = c;
+      if (iseq != NULL) {
+        Converter::load_proc(c, iseq);
+      }
+      return self;
+    }
+
+    struct file_job {
+      const char* path;  // copied into the pool of compiled
+      Converter::compiled* compiled;
+      engine::option_t options;
+      double seconds;
+      int error;  // errno of reading the file, 0 if it was read
+      bool failed;  // ran out of memory
+      bool installed;  // compiled belongs to the engine now
+    };
+
+    struct compile_files_t {
+      VALUE paths;
+      VALUE engines;
+      VALUE results;
+      file_job* jobs;
+      long count;
+      long next;  // the first job no thread has taken yet
+      long threads;
+#ifdef HAVE_PTHREAD_H
+      pthread_t* workers;
+      pthread_mutex_t lock;
+#endif
+    };
+
+    // read the whole file into the pool of the job, returns errno if it fails
+    static int read_file(file_job* j) {
+      auto fd = ::open(j->path, O_RDONLY);
+      if (fd < 0) {
+        return errno;
+      }
+
+      struct stat st;
+      if (fstat(fd, &st) < 0) {
+        // without the gvl rb_sys_fail can not raise, the errno is raised by compile_files_body
+        auto error = errno;
+        close(fd);
+        return error;
+      }
+      if (S_ISDIR(st.st_mode)) {
+        close(fd);
+        return EISDIR;
+      }
+
+      auto c    = j->compiled;
+      auto size = static_cast<long>(st.st_size);
+      char* buffer;
+      try {
+        buffer = GC::gc_alloc_n_char(size + 1, c->gc_pool);
+      } catch (const std::bad_alloc&) {
+        close(fd);
+        throw;
+      }
+
+      long length = 0;
+      while (length < size) {
+        auto n = ::read(fd, buffer + length, static_cast<size_t>(size - length));
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        if (n < 0) {
+          auto error = errno;
+          close(fd);
+          return error;
+        }
+        if (n == 0) {
+          // truncated since fstat
+          break;
+        }
+        length += n;
+      }
+      close(fd);
+
+      buffer[length] = '\0';
+      c->templ  = buffer;
+      c->length = length;
+      return 0;
+    }
+
+    static void compile_file(file_job* j) {
+      auto start = monotonic_seconds();
+      try {
+        j->error = read_file(j);
+        if (j->error == 0) {
+          PROBE(compile__start, j->path, j->compiled->length);
+          Converter::compile(j->compiled, j->options);
+          PROBE(compile__done, j->path, j->compiled->slot_count);
+        }
+      } catch (const std::bad_alloc&) {
+        j->failed = true;
+      }
+      j->seconds = monotonic_seconds() - start;
+      return;
+    }
+
+    // take the jobs one by one until none is left
+    static void* compile_files_worker(void* arg) {
+      auto t = static_cast<compile_files_t*>(arg);
+      for (;;) {
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_lock(&t->lock);
+#endif
+        auto i = t->next++;
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_unlock(&t->lock);
+#endif
+        if (i >= t->count) {
+          break;
+        }
+        compile_file(&t->jobs[i]);
+      }
+      return NULL;
+    }
+
+    // the calling thread works too, so threads - 1 more are started
+    static void* compile_files_without_gvl(void* arg) {
+#ifdef HAVE_PTHREAD_H
+      auto t = static_cast<compile_files_t*>(arg);
+      long started = 0;
+      while (started < t->threads - 1 &&
+             pthread_create(&t->workers[started], NULL, compile_files_worker, t) == 0) {
+        started++;
+      }
+      compile_files_worker(t);
+      for (long i = 0; i < started; i++) {
+        pthread_join(t->workers[i], NULL);
+      }
+#else
+      compile_files_worker(arg);
+#endif
+      return NULL;
+    }
+
+    static VALUE compile_files_body(VALUE arg) {
+      auto t = reinterpret_cast<compile_files_t*>(arg);
+      for (long i = 0; i < t->count; i++) {
+        DATA_READY(engine, e, rb_ary_entry(t->engines, i));
+        AT_STACK(path, rb_ary_entry(t->paths, i));
+        auto j      = &t->jobs[i];
+        j->compiled = Converter::prepare(NULL, 0, false);
+        j->options  = e->options;
+
+        auto length = RSTRING_LEN(path);
+        auto buffer = GC::gc_alloc_n_char(length + 1, j->compiled->gc_pool);
+        memcpy(buffer, RSTRING_PTR(path), static_cast<size_t>(length));
+        buffer[length] = '\0';
+        j->path = j->compiled->name = buffer;
+        j->compiled->gc_pool->without_gvl = true;
+      }
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+      rb_thread_call_without_gvl(compile_files_without_gvl, t, NULL, NULL);
+#else
+      compile_files_without_gvl(t);
+#endif
+
+      for (long i = 0; i < t->count; i++) {
+        auto j       = &t->jobs[i];
+        auto seconds = DBL2NUM(j->seconds);
+        j->compiled->gc_pool->without_gvl = false;
+        if (j->error != 0) {
+          AT_STACK(path, rb_str_new_cstr(j->path));
+          rb_ary_push(t->results, rb_ary_new_from_args(3, Qnil, seconds, rb_syserr_new_str(j->error, path)));
+        } else if (j->failed) {
+          AT_STACK(error, rb_exc_new_cstr(rb_eNoMemError, "failed to allocate memory"));
+          rb_ary_push(t->results, rb_ary_new_from_args(3, Qnil, seconds, error));
+        } else {
+          auto self = rb_ary_entry(t->engines, i);
+          DATA_READY(engine, e, self);
+          e->templ     = rb_str_new(j->compiled->templ, j->compiled->length);
+          e->name      = rb_str_new_frozen(rb_ary_entry(t->paths, i));
+          e->compiled  = j->compiled;
+          j->installed = true;
+          rb_ary_push(t->results, rb_ary_new_from_args(3, self, seconds, Qnil));
+        }
+      }
+      return t->results;
+    }
+
+    static VALUE compile_files_ensure(VALUE arg) {
+      auto t = reinterpret_cast<compile_files_t*>(arg);
+      for (long i = 0; i < t->count; i++) {
+        // the jobs are zeroed, release does nothing for the ones not prepared
+        if (!t->jobs[i].installed) {
+          Converter::release(t->jobs[i].compiled);
+        }
+      }
+      xfree(t->jobs);
+#ifdef HAVE_PTHREAD_H
+      xfree(t->workers);
+      pthread_mutex_destroy(&t->lock);
+#endif
+      return Qnil;
+    }
+
+    // def self.compile_files(paths, options, threads) # paths: Array of String, options: Hash or nil
+    //
+    // Reads and compiles the files on threads native threads without the gvl, the ruby of the
+    // templates is compiled by their first render. Returns [engine, seconds, nil] for each file
+    // compiled and [nil, seconds, error] for each one that failed, in the order of paths.
+    VALUE compile_files(VALUE klass, VALUE paths, VALUE options, VALUE threads) {
+      Check_Type(paths, T_ARRAY);
+      auto thread_count = NUM2LONG(threads);
+      if (thread_count <= 0) {
+        rb_raise(rb_eArgError, "threads must be positive, %ld given", thread_count);
+      }
 
-      // templ.end_with_cr!
-      METHOD_CALL(e->templ, METHOD(concat), rb_str_new2("\n"));
+      // the options are checked by the engines before any file is read
+      auto count = RARRAY_LEN(paths);
+      AT_STACK(engines, rb_ary_new_capa(count));
+      for (long i = 0; i < count; i++) {
+        AT_STACK(path, rb_ary_entry(paths, i));
+        StringValueCStr(path);
+        VALUE args[] = {rb_str_new(NULL, 0), options};
+        rb_ary_push(engines, rb_class_new_instance(2, args, klass));
+      }
+      AT_STACK(results, rb_ary_new_capa(count));
 
-      auto templ = StringValuePtr(e->templ);
-      auto len = NUM2INT(METHOD_CALL(e->templ, METHOD(bytesize)));
+      compile_files_t t;
+      t.engines = engines;
+      t.results = results;
+      t.count   = count;
+      t.next    = 0;
+      t.threads = thread_count < count ? thread_count : count;
+      t.jobs    = ZALLOC_N(file_job, count);
+#ifdef HAVE_PTHREAD_H
+      t.workers = ALLOC_N(pthread_t, t.threads > 0 ? t.threads : 1);
+      pthread_mutex_init(&t.lock, NULL);
+#endif
+      t.paths   = paths;
+      return rb_ensure(compile_files_body, reinterpret_cast<VALUE>(&t),
+                       compile_files_ensure, reinterpret_cast<VALUE>(&t));
+    }
 
-      int max_indent_depth = 0;
-      auto haml        = Converter::haml_from_haml_plaintext(templ, len, e->options, gc_pool);
-      auto static_haml = Converter::static_haml_from_haml(haml, location, e->options, gc_pool);
-      auto html        = Converter::html_from_static_haml(static_haml, &max_indent_depth, e->options, gc_pool);
-      auto ret         = Converter::flatten(html, max_indent_depth, gc_pool);
+    // def last_render_stats
+    //
+    // The seconds each phase of the last render of the engine took, the calls into ruby it made,
+    // the arena it used and the bytes of its output. Renders running at once overwrite each other's.
+    VALUE last_render_stats(VALUE self) {
+      DATA_READY(engine, e, self);
+      lock(e);
+      auto rendered = e->rendered;
+      auto stats    = e->stats;
+      unlock(e);
+      if (!rendered) {
+        return Qnil;
+      }
 
-      e->gc_pool = NULL;
-      GC::final(gc_pool);
+      auto ret = rb_hash_new();
+      rb_hash_aset(ret, sym_evaluate,    DBL2NUM(stats.evaluate));
+      rb_hash_aset(ret, sym_static_haml, DBL2NUM(stats.static_haml));
+      rb_hash_aset(ret, sym_html,        DBL2NUM(stats.html));
+      rb_hash_aset(ret, sym_flatten,     DBL2NUM(stats.flatten));
+      rb_hash_aset(ret, sym_total,       DBL2NUM(stats.evaluate + stats.static_haml + stats.html + stats.flatten));
+      rb_hash_aset(ret, sym_evals,        LONG2NUM(stats.evals));
+      rb_hash_aset(ret, sym_eval_bytes,   LONG2NUM(stats.eval_bytes));
+      rb_hash_aset(ret, sym_arena_chunks, LONG2NUM(stats.arena_chunks));
+      rb_hash_aset(ret, sym_arena_bytes,  LONG2NUM(stats.arena_bytes));
+      rb_hash_aset(ret, sym_arena_used,   LONG2NUM(stats.arena_used));
+      rb_hash_aset(ret, sym_output_bytes, LONG2NUM(stats.output_bytes));
       return ret;
     }
 
+    // def name
+    VALUE name(VALUE self) {
+      DATA_READY(engine, e, self);
+      return e->name;
+    }
+
+    static void yield_chunk(VALUE chunk, VALUE) {
+      rb_yield(chunk);
+      return;
+    }
+
+    static void write_chunk(VALUE chunk, VALUE io) {
+      METHOD_CALL(io, METHOD(write), chunk);
+      return;
+    }
+
+    // def write_chunks(location = self, chunk_size: 16384, flush_after: nil, layout: nil)
+    //
+    // Render the whole document, then yield it in chunks instead of one String. Only the write
+    // is chunked: the first chunk comes once every line is evaluated and the html of the
+    // document is built in the arena.
+    VALUE write_chunks(int argc, VALUE* argv, VALUE self) {
+      RETURN_ENUMERATOR(self, argc, argv);
+
+      volatile VALUE location_;
+      volatile VALUE options_;
+      rb_scan_args(argc, argv, "01:", &location_, &options_);
+
+      write_chunks(self, location_, options_, yield_chunk, Qnil);
+      return self;
+    }
+
+    // def write_chunks_to(io, location = self, chunk_size: 16384, flush_after: nil, layout: nil)
+    //
+    // Write the output to io in the chunks of write_chunks.
+    VALUE write_chunks_to(int argc, VALUE* argv, VALUE self) {
+      volatile VALUE io_;
+      volatile VALUE location_;
+      volatile VALUE options_;
+      rb_scan_args(argc, argv, "11:", &io_, &location_, &options_);
+
+      write_chunks(self, location_, options_, write_chunk, io_);
+      return io_;
+    }
+
   }
 }
@@ -70,5 +70,27 @@ if requirements[compiler]
 end
 
 RbConfig::MAKEFILE_CONFIG.merge! config
+# mkmf has read CXXFLAGS already when it is required, so the C++ flags have to be given here
+$CXXFLAGS << ' $(optflags) $(debugflags) ' << config['CXXFLAGS']
+
+# Engine#open maps templates with mmap(2) if available, otherwise it falls back to File#read
+have_header('sys/mman.h')
+
+# the lexing, the parsing and the html building run without the gvl where it is available
+have_header('ruby/thread.h')
+have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+
+# Engine.compile_files spreads the files over native threads, one at a time without pthreads
+have_header('pthread.h')
+
+# the USDT probes of probes.h are compiled in where systemtap's sys/sdt.h is installed
+have_header('sys/sdt.h')
+
+# CHaml::Watcher waits for the templates to be written with inotify, it polls them without it
+have_header('sys/inotify.h')
+
+# a frozen engine is shared between ractors, renders of it take the lock of the engine
+have_header('ruby/thread_native.h')
+have_func('rb_ext_ractor_safe', 'ruby.h')
 
 create_makefile('chaml/engine')
@@ -1,54 +1,117 @@
 #include "./chaml.h"
+#include <new>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
-#define DEFINE_GC(ns, t)                                                              \
-ns::t* GCNEW_NAME(ns, t)(gc* pool) {                                                  \
-  if (pool->MEMBER_NAME(ns, t) == NULL) {                                             \
-    pool->MEMBER_NAME(ns, t) = alloc<MEMBER_TYPE(ns, t)>();                           \
-  } else if (pool->MEMBER_NAME(ns, t)->max_using_heap_index == GC_POOL_SIZE(ns, t)) { \
-    auto new_pool  = alloc<MEMBER_TYPE(ns, t)>();                                     \
-    new_pool->next = pool->MEMBER_NAME(ns, t);                                        \
-    pool->MEMBER_NAME(ns, t) = new_pool;                                              \
-  }                                                                                   \
-                                                                                      \
-  auto index = ++pool->MEMBER_NAME(ns, t)->max_using_heap_index;                      \
-  return &pool->MEMBER_NAME(ns, t)->pool[index];                                      \
+#define DEFINE_GC(ns, t)                                                        \
+ns::t* GCNEW_NAME(ns, t)(gc* pool) {                                            \
+  return static_cast<ns::t*>(alloc(pool, sizeof(ns::t), alignof(ns::t)));       \
 }
 
-#define READY(ns, t) ret->MEMBER_NAME(ns, t) = NULL
-#define FINAL(ns, t) final(gc_pool->MEMBER_NAME(ns, t))
-
 namespace CHaml {
   namespace GC {
 
-    template <typename T>
-    T* alloc() {
-      auto ret = ALLOC(T);
-      ret->max_using_heap_index = -1;
+    const size_t chunk_min_size = 4 * 1024;
+    const size_t chunk_max_size = 1024 * 1024;
+
+    static size_t page_size() {
+#ifdef HAVE_SYS_MMAN_H
+      static size_t size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+      return size;
+#else
+      return 4096;
+#endif
+    }
+
+    static size_t round_up(size_t size, size_t unit) {
+      return (size + unit - 1) / unit * unit;
+    }
+
+    // the chunks are mapped if possible, so that reset can give their pages back
+    static chunk_t* new_chunk(size_t size) {
+      auto length = round_up(sizeof(chunk_t) + size, page_size());
+      chunk_t* ret = NULL;
+#ifdef HAVE_SYS_MMAN_H
+      auto p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p != MAP_FAILED) {
+        ret = static_cast<chunk_t*>(p);
+        ret->mapped = true;
+      }
+#endif
+      if (ret == NULL) {
+        ret = static_cast<chunk_t*>(malloc(length));
+        if (ret == NULL) {
+          return NULL;
+        }
+        ret->mapped = false;
+      }
       ret->next = NULL;
+      ret->size = length - sizeof(chunk_t);
       return ret;
     }
 
-    template <typename T>
-    void final(T* pool) {
-      while (pool) {
-        auto next = pool->next;
-        xfree(pool);
-        pool = next;
+    static void free_chunk(chunk_t* c) {
+#ifdef HAVE_SYS_MMAN_H
+      if (c->mapped) {
+        munmap(c, sizeof(chunk_t) + c->size);
+        return;
       }
+#endif
+      free(c);
+      return;
+    }
+
+    static void use_chunk(gc* pool, chunk_t* c) {
+      c->next      = pool->chunks;
+      pool->chunks = c;
+      pool->cursor = c->data;
+      pool->limit  = c->data + c->size;
       return;
     }
 
+    static void* alloc(gc* pool, size_t size, size_t align) {
+      auto p = reinterpret_cast<char*>(round_up(reinterpret_cast<uintptr_t>(pool->cursor), align));
+      if (pool->cursor == NULL || p + size > pool->limit) {
+        // every chunk is twice as large as the last one, up to chunk_max_size
+        auto next_size = pool->chunks ? pool->chunks->size * 2 : chunk_min_size;
+        if (next_size > chunk_max_size) {
+          next_size = chunk_max_size;
+        }
+        if (next_size < size + align) {
+          next_size = size + align;
+        }
+        auto c = new_chunk(next_size);
+        if (c == NULL) {
+          // rb_memerror can not be called without the gvl, the caller raises it after taking it back
+          if (pool->without_gvl) {
+            throw std::bad_alloc();
+          }
+          rb_memerror();
+        }
+        use_chunk(pool, c);
+        p = reinterpret_cast<char*>(round_up(reinterpret_cast<uintptr_t>(pool->cursor), align));
+      }
+      pool->used  += static_cast<size_t>(p + size - pool->cursor);
+      pool->cursor = p + size;
+      return p;
+    }
+
     DEFINE_GC(String, string);
     DEFINE_GC(Converter, string_chain);
     DEFINE_GC(Converter, line);
     DEFINE_GC(Converter, lines);
     DEFINE_GC(Converter, tree);
+    DEFINE_GC(Converter, slot);
+    DEFINE_GC(Converter, attr);
+    DEFINE_GC(Converter, attr_set);
+    DEFINE_GC(Converter, block);
 
     void gc_register_value(const VALUE& value, gc* pool) {
-      if (pool->value == NULL) {
-        pool->value = alloc<VALUE_t>();
-      } else if (pool->value->max_using_heap_index == VALUE_pool_size) {
-        auto new_pool  = alloc<VALUE_t>();
+      if (pool->value == NULL || pool->value->max_using_heap_index == VALUE_pool_size - 1) {
+        auto new_pool = static_cast<VALUE_t*>(alloc(pool, sizeof(VALUE_t), alignof(VALUE_t)));
+        new_pool->max_using_heap_index = -1;
         new_pool->next = pool->value;
         pool->value    = new_pool;
       }
@@ -59,32 +122,78 @@ namespace CHaml {
     }
 
     char* gc_alloc_n_char(long length, gc* pool) {
-      auto new_pool = static_cast<char_t*>(xmalloc(sizeof(char_t) + sizeof(char) * static_cast<size_t>(length)));
-      new_pool->next = pool->ch;
-      pool->ch = new_pool;
-      return pool->ch->pool;
+      return static_cast<char*>(alloc(pool, static_cast<size_t>(length), 1));
+    }
+
+    String::string** gc_alloc_n_string(long length, gc* pool) {
+      return static_cast<String::string**>(alloc(pool, sizeof(String::string*) * static_cast<size_t>(length), alignof(String::string*)));
+    }
+
+    Converter::slot_value* gc_alloc_n_slot_value(long length, gc* pool) {
+      return static_cast<Converter::slot_value*>(alloc(pool, sizeof(Converter::slot_value) * static_cast<size_t>(length), alignof(Converter::slot_value)));
     }
 
     gc* init() {
       auto ret = ALLOC(gc);
-      READY(String, string);
-      READY(Converter, string_chain);
-      READY(Converter, line);
-      READY(Converter, lines);
-      READY(Converter, tree);
-      ret->value = NULL;
-      ret->ch    = NULL;
+      ret->chunks = NULL;
+      ret->cursor = NULL;
+      ret->limit  = NULL;
+      ret->used   = 0;
+      ret->peak   = 0;
+      ret->value  = NULL;
+      ret->without_gvl = false;
+      ret->next   = NULL;
       return ret;
     }
 
+    // forget every object of pool but keep its memory. the chunks are merged into one that
+    // fits the peak, so the next render does not grow it. pages past limit bytes (if limit > 0)
+    // are given back to the os.
+    void reset(gc* pool, long limit) {
+      if (pool->peak < pool->used) {
+        pool->peak = pool->used;
+      }
+      if (pool->chunks != NULL && (pool->chunks->next != NULL || pool->chunks->size < pool->peak)) {
+        for (auto c = pool->chunks; c != NULL;) {
+          auto next = c->next;
+          free_chunk(c);
+          c = next;
+        }
+        pool->chunks = NULL;
+        auto c = new_chunk(pool->peak);
+        if (c == NULL) {
+          pool->cursor = pool->limit = NULL;
+          rb_memerror();
+        }
+        use_chunk(pool, c);
+      } else if (pool->chunks != NULL) {
+        pool->cursor = pool->chunks->data;
+      }
+      pool->used  = 0;
+      pool->value = NULL;
+      pool->without_gvl = false;
+
+#ifdef HAVE_SYS_MMAN_H
+      auto c = pool->chunks;
+      if (limit > 0 && c != NULL && c->mapped) {
+        // the chunk starts at a page, keep limit bytes of it
+        auto keep = round_up(sizeof(chunk_t) + static_cast<size_t>(limit), page_size());
+        if (keep < sizeof(chunk_t) + c->size) {
+          madvise(reinterpret_cast<char*>(c) + keep, sizeof(chunk_t) + c->size - keep, MADV_DONTNEED);
+        }
+      }
+#else
+      (void)limit;
+#endif
+      return;
+    }
+
     void final(gc* gc_pool) {
-      FINAL(String, string);
-      FINAL(Converter, string_chain);
-      FINAL(Converter, line);
-      FINAL(Converter, lines);
-      FINAL(Converter, tree);
-      final(gc_pool->value);
-      final(gc_pool->ch);
+      for (auto c = gc_pool->chunks; c != NULL;) {
+        auto next = c->next;
+        free_chunk(c);
+        c = next;
+      }
       xfree(gc_pool);
       return;
     }
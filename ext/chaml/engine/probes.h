@@ -0,0 +1,27 @@
+#ifndef CHAML_PROBES_H_
+#define CHAML_PROBES_H_
+
+// USDT probes of the provider chaml, listed by `bpftrace -l 'usdt:path/to/engine.so:chaml:*'`.
+// Each one carries the path of the template, "" for the ones not read from a file.
+//
+//   compile__start(name, length)    compile__done(name, slot_count)
+//   render__start(name, length)     render__done(name, output_bytes)
+//   phase__start(name, phase)       phase__done(name, phase)
+//   eval__start(name, lineno)       eval__done(name, lineno)
+//
+// phase is one of "evaluate", "static_haml", "html" and "flatten". lineno is the line of the
+// template a slot evaluated by instance_eval replaces, 0 for the compiled script of all slots.
+// A probe is a nop until a tracer attaches to it. Without sys/sdt.h the probes are left out.
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define PROBE(name, arg1, arg2) DTRACE_PROBE2(chaml, name, arg1, arg2)
+#else
+#define PROBE(name, arg1, arg2) \
+  do {                          \
+    (void)(arg1);               \
+    (void)(arg2);               \
+  } while (0)
+#endif
+
+#endif  // CHAML_PROBES_H_
@@ -2,6 +2,13 @@
 
 #define GCNEW(t, pool) GCNEW_NAME(String, t)(pool)
 
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define CHAML_ESCAPE_X86
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 namespace CHaml {
   namespace String {
 
@@ -56,12 +63,70 @@ namespace CHaml {
       return s2[s1->length] == '\0';
     }
 
+    // character classes of the scanners
+    //
+    // the short runs (indents, tag names, tag options) are scanned byte by byte on the table,
+    // the long ones (text, quoted strings) 16 bytes at a time by find_either.
+
+    enum {
+      CLASS_SPACE      = 1 << 0,  // ' ', '\t', '\n'
+      CLASS_DELIMITER  = 1 << 1,  // the end of a tag name, a class or an id
+      CLASS_TAG_OPTION = 1 << 2,  // '=', '~', '<', '>', '/'
+    };
+
+    static unsigned char char_class[256];
+
+    static bool ready_char_class() {
+      for (auto p = " \t\n"; *p; p++) {
+        char_class[static_cast<unsigned char>(*p)] |= CLASS_SPACE | CLASS_DELIMITER;
+      }
+      for (auto p = ".#{}()=~<>/"; *p; p++) {
+        char_class[static_cast<unsigned char>(*p)] |= CLASS_DELIMITER;
+      }
+      for (auto p = "=~<>/"; *p; p++) {
+        char_class[static_cast<unsigned char>(*p)] |= CLASS_TAG_OPTION;
+      }
+      return true;
+    }
+
+    static const bool char_class_ready = ready_char_class();
+
+    static inline bool is_class(char ch, int klass) {
+      return (char_class[static_cast<unsigned char>(ch)] & klass) != 0;
+    }
+
+    // return the index of the first a or b in p[0...n], or n
+    static long find_either(const char* p, long n, char a, char b) {
+      long i = 0;
+#ifdef __SSE2__
+      const __m128i va = _mm_set1_epi8(a);
+      const __m128i vb = _mm_set1_epi8(b);
+      for (; i + 16 <= n; i += 16) {
+        auto v    = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        auto bits = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+        if (bits != 0) {
+          return i + __builtin_ctz(static_cast<unsigned>(bits));
+        }
+      }
+#endif
+      for (; i < n; i++) {
+        if (p[i] == a || p[i] == b) {
+          return i;
+        }
+      }
+      return n;
+    }
+
     bool find(string* s, long* index, char ch) {
       auto p = s->buffer;
       for (auto i = *index; i < s->length; i++) {
+        i += find_either(p + i, s->length - i, '\\', ch);
+        if (i >= s->length) {
+          break;
+        }
         if (p[i] == '\\') {
           i++;
-        } else if (p[i] == ch) {
+        } else {
           *index = i;
           return true;
         }
@@ -73,7 +138,7 @@ namespace CHaml {
     bool find_first_valid_index(string* s, long* index) {
       auto p = s->buffer;
       for (auto i = *index; i < s->length; i++) {
-        if (!(p[i] == ' ' || p[i] == '\t' || p[i] == '\n')) {
+        if (!is_class(p[i], CLASS_SPACE)) {
           *index = i;
           return true;
         }
@@ -85,12 +150,9 @@ namespace CHaml {
     static void find_end_of_doctype(string* s, long* index) {
       auto p = s->buffer;
       for (auto i = *index; i < s->length; i++) {
-        switch (p[i]) {
-          case ' ':
-          case '\t':
-          case '\n':
-            *index = i;
-            return;
+        if (is_class(p[i], CLASS_SPACE)) {
+          *index = i;
+          return;
         }
       }
       *index = s->length;
@@ -100,23 +162,9 @@ namespace CHaml {
     bool find_first_invalid_index(string* s, long* index) {
       auto p = s->buffer;
       for (auto i = *index; i < s->length; i++) {
-        switch (p[i]) {
-          case ' ':
-          case '\t':
-          case '\n':
-          case '.':
-          case '#':
-          case '{':
-          case '}':
-          case '(':
-          case ')':
-          case '=':
-          case '~':
-          case '<':
-          case '>':
-          case '/':
-            *index = i;
-            return true;
+        if (is_class(p[i], CLASS_DELIMITER)) {
+          *index = i;
+          return true;
         }
       }
       *index = s->length;
@@ -126,20 +174,30 @@ namespace CHaml {
     bool find_last_valid_index(string* s, long* index) {
       auto p = s->buffer;
       for (auto i = *index; i >= 0; i--) {
-        switch (p[i]) {
-          case ' ':
-          case '\t':
-          case '\n':
-            break;
-          default:
-            *index = i;
-            return true;
+        if (!is_class(p[i], CLASS_SPACE)) {
+          *index = i;
+          return true;
         }
       }
       *index = -1;
       return false;
     }
 
+    // return true iff. s[index..] ~ /\\|#{/
+    bool has_dynamic_part(string* s, long index) {
+      auto p = s->buffer;
+      for (; index < s->length; index++) {
+        index += find_either(p + index, s->length - index, '\\', '#');
+        if (index >= s->length) {
+          break;
+        }
+        if (p[index] == '\\' || (index + 1 < s->length && p[index + 1] == '{')) {
+          return true;
+        }
+      }
+      return false;
+    }
+
     long find_last_valid_index(string* s) {
       auto index = s->length - 1;
       find_last_valid_index(s, &index);
@@ -150,18 +208,12 @@ namespace CHaml {
       auto p = s->buffer;
       long ret = -1;
       for (auto i = *index; i < s->length; i++) {
-        switch (p[i]) {
-          case '=':
-          case '~':
-            ret = i;
-            break;
-          case '<':
-          case '>':
-          case '/':
-            break;
-          default:
-            *index = i;
-            return ret;
+        if (!is_class(p[i], CLASS_TAG_OPTION)) {
+          *index = i;
+          return ret;
+        }
+        if (p[i] == '=' || p[i] == '~') {
+          ret = i;
         }
       }
       *index = s->length;
@@ -185,18 +237,24 @@ namespace CHaml {
       return gcnew(s->buffer + first_valid_index, *index - first_valid_index, gc_pool);
     }
 
-    string* lcase(string* s) {
+    // the source may be read only, so lower the case on a copy
+    static string* lcase(string* s, GC::gc* gc_pool) {
       auto p = s->buffer;
+      char* buffer = NULL;
       for (auto i = 0; i < s->length; i++) {
         if ('A' <= p[i] && p[i] <= 'Z') {
-          p[i] += 'a' - 'A';
+          if (buffer == NULL) {
+            buffer = GC::gc_alloc_n_char(s->length, gc_pool);
+            memcpy(buffer, p, static_cast<size_t>(s->length));
+          }
+          buffer[i] = static_cast<char>(p[i] + 'a' - 'A');
         }
       }
-      return s;
+      return buffer == NULL ? s : gcnew(buffer, s->length, gc_pool);
     }
 
     string* tok_lcase(string* s, long* index, GC::gc* gc_pool) {
-      return lcase(tok(s, index, gc_pool));
+      return lcase(tok(s, index, gc_pool), gc_pool);
     }
 
     string* doctype(string* s, long* index, GC::gc* gc_pool) {
@@ -207,7 +265,7 @@ namespace CHaml {
 
       ++*index;
       find_end_of_doctype(s, index);
-      return lcase(gcnew(s->buffer + doctype_start, *index - doctype_start, gc_pool));
+      return lcase(gcnew(s->buffer + doctype_start, *index - doctype_start, gc_pool), gc_pool);
     }
 
     string* rest(string* s, long* index, GC::gc* gc_pool) {
@@ -222,6 +280,279 @@ namespace CHaml {
       return rest(s, &index, gc_pool);
     }
 
+    // html escaping
+    //
+    // & < > " ' are replaced by entities. the bytes are scanned 16 or 32 at a time with
+    // SSE2 or AVX2, picked at the first call, so the long runs that need no escaping are
+    // skipped quickly. others use the scalar scanner.
+
+    static const char* entity_of(char ch) {
+      switch (ch) {
+        case '&':
+          return "&amp;";
+        case '<':
+          return "&lt;";
+        case '>':
+          return "&gt;";
+        case '"':
+          return "&quot;";
+        case '\'':
+          return "&#39;";
+      }
+      return NULL;
+    }
+
+    // return the index of the first byte of p[0...n] to be escaped, or n
+    static long find_escape_scalar(const char* p, long n) {
+      for (long i = 0; i < n; i++) {
+        switch (p[i]) {
+          case '&':
+          case '<':
+          case '>':
+          case '"':
+          case '\'':
+            return i;
+        }
+      }
+      return n;
+    }
+
+#ifdef CHAML_ESCAPE_X86
+    __attribute__((target("sse2")))
+    static long find_escape_sse2(const char* p, long n) {
+      const __m128i amp  = _mm_set1_epi8('&');
+      const __m128i lt   = _mm_set1_epi8('<');
+      const __m128i gt   = _mm_set1_epi8('>');
+      const __m128i quot = _mm_set1_epi8('"');
+      const __m128i apos = _mm_set1_epi8('\'');
+      long i = 0;
+      for (; i + 16 <= n; i += 16) {
+        auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        auto m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, lt)),
+                              _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, gt), _mm_cmpeq_epi8(v, quot)),
+                                           _mm_cmpeq_epi8(v, apos)));
+        auto bits = _mm_movemask_epi8(m);
+        if (bits != 0) {
+          return i + __builtin_ctz(static_cast<unsigned>(bits));
+        }
+      }
+      return i + find_escape_scalar(p + i, n - i);
+    }
+
+    __attribute__((target("avx2")))
+    static long find_escape_avx2(const char* p, long n) {
+      const __m256i amp  = _mm256_set1_epi8('&');
+      const __m256i lt   = _mm256_set1_epi8('<');
+      const __m256i gt   = _mm256_set1_epi8('>');
+      const __m256i quot = _mm256_set1_epi8('"');
+      const __m256i apos = _mm256_set1_epi8('\'');
+      long i = 0;
+      for (; i + 32 <= n; i += 32) {
+        auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        auto m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, amp), _mm256_cmpeq_epi8(v, lt)),
+                                 _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, gt), _mm256_cmpeq_epi8(v, quot)),
+                                                 _mm256_cmpeq_epi8(v, apos)));
+        auto bits = _mm256_movemask_epi8(m);
+        if (bits != 0) {
+          return i + __builtin_ctz(static_cast<unsigned>(bits));
+        }
+      }
+      return i + find_escape_sse2(p + i, n - i);
+    }
+#endif
+
+    typedef long (*escape_finder)(const char* p, long n);
+
+    // chosen when the extension is loaded, ractors and threads without the gvl only read it.
+    // CHAML_ESCAPE=scalar or sse2 takes a slower one, so that bench/escape.rb compares them.
+    static escape_finder select_find_escape() {
+      auto name = getenv("CHAML_ESCAPE");
+      if (name != NULL && strcmp(name, "scalar") == 0) {
+        return find_escape_scalar;
+      }
+#ifdef CHAML_ESCAPE_X86
+      __builtin_cpu_init();
+      if ((name == NULL || strcmp(name, "sse2") != 0) && __builtin_cpu_supports("avx2")) {
+        return find_escape_avx2;
+      }
+      return find_escape_sse2;
+#else
+      return find_escape_scalar;
+#endif
+    }
+
+    static const escape_finder find_escape = select_find_escape();
+
+    // return s with html escaped, s itself if nothing has to be escaped
+    string* escape_html(string* s, GC::gc* gc_pool) {
+      auto p = s->buffer;
+      auto n = s->length;
+      auto i = find_escape(p, n);
+      if (i == n) {
+        return s;
+      }
+
+      // the exact length first, then write into a buffer of that size
+      auto length = n;
+      for (auto j = i; j < n; j++) {
+        j += find_escape(p + j, n - j);
+        if (j < n) {
+          length += static_cast<long>(strlen(entity_of(p[j]))) - 1;
+        }
+      }
+
+      auto buffer = GC::gc_alloc_n_char(length, gc_pool);
+      auto out    = buffer;
+      memcpy(out, p, static_cast<size_t>(i));
+      out += i;
+      while (i < n) {
+        auto entity = entity_of(p[i]);
+        auto m      = static_cast<long>(strlen(entity));
+        memcpy(out, entity, static_cast<size_t>(m));
+        out += m;
+        i++;
+
+        auto run = find_escape(p + i, n - i);
+        memcpy(out, p + i, static_cast<size_t>(run));
+        out += run;
+        i += run;
+      }
+      return gcnew(buffer, length, gc_pool);
+    }
+
+    // whitespace preservation
+    //
+    // the newlines in the contents of textarea, pre and code tags are encoded as &#x000A; so that
+    // indenting the html does not change them. a tag matches as /<(textarea|pre|code)[^>]*>.*?<\/\1>/im
+    // does, its last newline is dropped and \r is removed from it.
+
+    static const char* preserve_tags[] = {"textarea", "pre", "code"};
+
+    static bool eq_lcase(const char* p, const char* name, long length) {
+      for (long i = 0; i < length; i++) {
+        auto ch = p[i];
+        if ('A' <= ch && ch <= 'Z') {
+          ch = static_cast<char>(ch - 'A' + 'a');
+        }
+        if (ch != name[i]) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // the preserved tag at s[index] == '<': its name, its content [*first, *last) and its end
+    static bool find_preserve_tag(string* s, long index, long* name_length, long* first, long* last, long* end) {
+      auto p = s->buffer;
+      for (auto name : preserve_tags) {
+        auto n = static_cast<long>(strlen(name));
+        if (index + 1 + n > s->length || !eq_lcase(p + index + 1, name, n)) {
+          continue;
+        }
+        auto gt = static_cast<const char*>(memchr(p + index + 1 + n, '>', static_cast<size_t>(s->length - index - 1 - n)));
+        if (gt == NULL) {
+          return false;
+        }
+        *first = gt + 1 - p;
+        for (auto i = *first; i + 3 + n <= s->length; i++) {
+          if (p[i] == '<' && p[i + 1] == '/' && eq_lcase(p + i + 2, name, n) && p[i + 2 + n] == '>') {
+            *name_length = n;
+            *last = i;
+            *end  = i + 3 + n;
+            return true;
+          }
+        }
+        return false;
+      }
+      return false;
+    }
+
+    // the length of the newlines in p encoded, or they are written to out
+    static long encode_newlines(const char* p, long length, char* out) {
+      long n = 0;
+      for (long i = 0; i < length; i++) {
+        switch (p[i]) {
+          case '\n':
+            if (out != NULL) {
+              memcpy(out + n, "&#x000A;", 8);
+            }
+            n += 8;
+            break;
+          case '\r':
+            break;
+          default:
+            if (out != NULL) {
+              out[n] = p[i];
+            }
+            n++;
+        }
+      }
+      return n;
+    }
+
+    // the length of preserve(s), or it is written to out
+    static long preserve_to(string* s, char* out) {
+      auto p = s->buffer;
+      long n = 0, copied = 0;
+      for (long i = 0; i < s->length;) {
+        auto lt = static_cast<const char*>(memchr(p + i, '<', static_cast<size_t>(s->length - i)));
+        if (lt == NULL) {
+          break;
+        }
+        i = lt - p;
+        long name_length, first, last, end;
+        if (!find_preserve_tag(s, i, &name_length, &first, &last, &end)) {
+          i++;
+          continue;
+        }
+        // the open tag as it is
+        if (out != NULL) {
+          memcpy(out + n, p + copied, static_cast<size_t>(first - copied));
+        }
+        n += first - copied;
+        // chomp
+        if (last > first && p[last - 1] == '\n') {
+          last--;
+          if (last > first && p[last - 1] == '\r') {
+            last--;
+          }
+        }
+        n += encode_newlines(p + first, last - first, out != NULL ? out + n : NULL);
+        // the close tag in the case of the open one
+        if (out != NULL) {
+          out[n] = '<';
+          out[n + 1] = '/';
+          memcpy(out + n + 2, p + i + 1, static_cast<size_t>(name_length));
+          out[n + 2 + name_length] = '>';
+        }
+        n += 3 + name_length;
+        i = copied = end;
+      }
+      if (out != NULL) {
+        memcpy(out + n, p + copied, static_cast<size_t>(s->length - copied));
+      }
+      return n + s->length - copied;
+    }
+
+    string* preserve(string* s, GC::gc* gc_pool) {
+      if (memchr(s->buffer, '<', static_cast<size_t>(s->length)) == NULL) {
+        return s;
+      }
+      auto length = preserve_to(s, NULL);
+      auto buffer = GC::gc_alloc_n_char(length, gc_pool);
+      preserve_to(s, buffer);
+      return gcnew(buffer, length, gc_pool);
+    }
+
+    // every newline encoded and \r removed, then a newline put at the end
+    string* preserve_all(string* s, GC::gc* gc_pool) {
+      auto length = encode_newlines(s->buffer, s->length, NULL);
+      auto buffer = GC::gc_alloc_n_char(length + 1, gc_pool);
+      encode_newlines(s->buffer, s->length, buffer);
+      buffer[length] = '\n';
+      return gcnew(buffer, length + 1, gc_pool);
+    }
+
     void chomp(string* s) {
       if (s == NULL) {
         return;
@@ -0,0 +1,174 @@
+#include "./chaml.h"
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#endif
+
+/* # abstruct
+ *
+ * module CHaml
+ *   class Watcher
+ *     def initialize
+ *       # an inotify instance, non blocking ...
+ *     end
+ *
+ *     def fileno
+ *       # the descriptor to wait on with IO.select ...
+ *     end
+ *
+ *     def close
+ *     end
+ *
+ *     private
+ *
+ *     def watch(dir)
+ *       # the watch descriptor of dir, reporting the files written into it ...
+ *     end
+ *
+ *     def read_events
+ *       # [[watch descriptor, file name], ...] read so far, [] if there are none ...
+ *     end
+ *   end
+ * end
+ *
+ * lib/chaml/watcher.rb maps the events to the paths of the templates. Without sys/inotify.h the
+ * class is left empty and lib/chaml/watcher.rb polls the files instead.
+ */
+
+namespace CHaml {
+  namespace Watcher {
+#ifdef HAVE_SYS_INOTIFY_H
+    struct watcher {
+      int fd;
+    };
+
+    static void final(void* w) {
+      auto p = static_cast<watcher*>(w);
+      if (p->fd >= 0) {
+        ::close(p->fd);
+      }
+      xfree(p);
+      return;
+    }
+
+    static const rb_data_type_t watcher_data_type = {
+#ifdef __CLANG__
+      .wrap_struct_name = "CHaml::Watcher",
+      .function         = {
+        .dmark = NULL,
+        .dfree = final,
+      },
+      .flags            = RUBY_TYPED_FREE_IMMEDIATELY,
+#else
+      wrap_struct_name: "CHaml::Watcher",
+      function        : {
+        dmark: NULL,
+        dfree: final,
+      },
+      parent          : NULL,
+      data            : NULL,
+      flags           : RUBY_TYPED_FREE_IMMEDIATELY,
+#endif
+    };
+
+    static VALUE alloc(VALUE klass) {
+      auto w = ZALLOC(watcher);
+      w->fd = -1;
+      return TypedData_Wrap_Struct(klass, &watcher_data_type, w);
+    }
+
+    static watcher* opened(VALUE self) {
+      DATA_READY(watcher, w, self);
+      if (w->fd < 0) {
+        rb_raise(rb_eIOError, "closed watcher");
+      }
+      return w;
+    }
+
+    // def initialize
+    static VALUE initialize(VALUE self) {
+      DATA_READY(watcher, w, self);
+      w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+      if (w->fd < 0) {
+        rb_sys_fail("inotify_init1");
+      }
+      return Qnil;
+    }
+
+    // def fileno
+    static VALUE fileno(VALUE self) {
+      return INT2FIX(opened(self)->fd);
+    }
+
+    // def close
+    static VALUE close(VALUE self) {
+      DATA_READY(watcher, w, self);
+      if (w->fd >= 0) {
+        ::close(w->fd);
+        w->fd = -1;
+      }
+      return Qnil;
+    }
+
+    // def watch(dir) # dir: String
+    //
+    // Editors replace a file by renaming another one over it or write it in place, so the
+    // directory is watched for both. A directory watched twice has the same descriptor.
+    static VALUE watch(VALUE self, VALUE dir) {
+      auto w    = opened(self);
+      auto path = StringValueCStr(dir);
+      auto wd   = inotify_add_watch(w->fd, path, IN_CLOSE_WRITE | IN_MOVED_TO);
+      if (wd < 0) {
+        rb_sys_fail(path);
+      }
+      return INT2FIX(wd);
+    }
+
+    // def read_events
+    static VALUE read_events(VALUE self) {
+      auto w = opened(self);
+      AT_STACK(ret, rb_ary_new());
+      // aligned for struct inotify_event, room for at least one event of the longest name
+      char buffer[4096 + sizeof(struct inotify_event) + NAME_MAX + 1]
+          __attribute__((aligned(__alignof__(struct inotify_event))));
+      for (;;) {
+        auto length = read(w->fd, buffer, sizeof(buffer));
+        if (length < 0) {
+          if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+          }
+          if (errno == EINTR) {
+            continue;
+          }
+          rb_sys_fail("read");
+        }
+        for (auto p = buffer; p < buffer + length;) {
+          auto event = reinterpret_cast<struct inotify_event*>(p);
+          if (event->len > 0) {
+            rb_ary_push(ret, rb_assoc_new(INT2FIX(event->wd), rb_str_new_cstr(event->name)));
+          }
+          p += sizeof(struct inotify_event) + event->len;
+        }
+      }
+      return ret;
+    }
+#endif
+
+    void define(VALUE chaml) {
+      auto watcher = rb_define_class_under(chaml, "Watcher", rb_cObject);
+#ifdef HAVE_SYS_INOTIFY_H
+      rb_define_alloc_func(watcher, alloc);
+      rb_define_private_method(watcher, "initialize", RUBY_METHOD_FUNC(initialize), 0);
+      rb_define_method(watcher, "fileno", RUBY_METHOD_FUNC(fileno), 0);
+      rb_define_method(watcher, "close", RUBY_METHOD_FUNC(close), 0);
+      rb_define_private_method(watcher, "watch", RUBY_METHOD_FUNC(watch), 1);
+      rb_define_private_method(watcher, "read_events", RUBY_METHOD_FUNC(read_events), 0);
+#else
+      (void)watcher;
+#endif
+      return;
+    }
+  }
+}
@@ -1,7 +1,20 @@
 require "chaml/version"
 require "chaml/engine"
+require "chaml/cache"
+require "chaml/bundle"
+require "chaml/registry"
+require "chaml/watcher"
+require "etc"
 
 module CHaml
+  @cache = CHaml::Cache.new
+
+  class << self
+    # The cache used by CHaml.read, nil disables caching
+    # @return [CHaml::Cache, nil]
+    attr_accessor :cache
+  end
+
   # Constructs an instance of CHaml::Engine
   # @param template [String] The Haml template
   # @param options [Hash] An options hash
@@ -11,9 +24,44 @@ module CHaml
   end
 
   # Reads string as a haml template, and passes it to CHaml::Engine
+  # The engine is taken from CHaml.cache while the file is unchanged.
+  # The cache belongs to the main Ractor, the others parse the file every time.
   # @param path [String] A path of the haml template
+  # @param options [Hash] An options hash
   # @return [CHaml::Engine]
-  def self.read(path)
-    CHaml.parse(File.read(path))
+  def self.read(path, options = {})
+    if main_ractor? && cache
+      cache.fetch(path, options)
+    else
+      CHaml.parse(File.read(path), options)
+    end
+  end
+
+  # Reads and compiles the templates matching glob on native threads without the GVL
+  # The Ruby of each template is compiled by its first render. The partials of the
+  # templates are looked up in the registry returned, unless :partials is given.
+  # @param glob [String, Array<String>] Patterns of the haml templates
+  # @param options [Hash] An options hash, :threads is the number of threads compiling at once
+  #   and :root the directory the names of partials are relative to
+  # @return [CHaml::Registry] The engines by the absolute path of their templates
+  def self.precompile(glob, options = {})
+    options = options.dup
+    threads = options.delete(:threads) || Etc.nprocessors
+    root    = options.delete(:root) || Dir.pwd
+    paths   = Dir.glob(glob).map { |path| File.expand_path(path) }.uniq.sort
+    paths.reject! { |path| File.directory?(path) }
+
+    registry = CHaml::Registry.new(root)
+    options[:partials] ||= registry
+    started  = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    results  = CHaml::Engine.compile_files(paths, options, threads)
+    paths.zip(results) { |path, (engine, seconds, error)| registry.add(path, engine, seconds, error) }
+    registry.elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - started
+    registry
+  end
+
+  def self.main_ractor?
+    !defined?(Ractor) || Ractor.current == Ractor.main
   end
+  private_class_method :main_ractor?
 end
@@ -0,0 +1,91 @@
+require "zlib"
+
+module CHaml
+  # A file of compiled engines, written once before a deploy and loaded by
+  # every worker at boot, so that no template is parsed again.
+  # The file is rejected unless its checksum matches and it was written by the
+  # same versions of CHaml, Engine#dump and Ruby on the same platform.
+  class Bundle
+    MAGIC = "CHAMLBDL".b
+
+    class StaleError < StandardError; end
+
+    include Enumerable
+
+    # The versions a bundle has to be written by to be loaded
+    # @return [String]
+    def self.stamp
+      [CHaml::VERSION, CHaml::Engine::DUMP_VERSION, RUBY_ENGINE, RUBY_VERSION, RUBY_PLATFORM].join(" ")
+    end
+
+    # Writes the engines to path, the file is replaced by rename
+    # @param path [String] A path of the bundle
+    # @param engines [Hash{String => CHaml::Engine}] The engines by name
+    # @return [Integer] The number of engines written
+    def self.write(path, engines)
+      body = Marshal.dump(engines.map { |name, engine| [name.to_s, engine.dump] })
+      tmp  = "#{path}.#{Process.pid}.tmp"
+      File.open(tmp, "wb") do |file|
+        file.write(MAGIC, [stamp.bytesize].pack("N"), stamp)
+        file.write([Zlib.crc32(body), body.bytesize].pack("NQ>"), body)
+      end
+      File.rename(tmp, path)
+      engines.size
+    ensure
+      File.unlink(tmp) if tmp && File.exist?(tmp)
+    end
+
+    # Reads the bundle at path
+    # The partials of its engines are looked up in the bundle by name.
+    # @param path [String] A path of the bundle
+    # @return [CHaml::Bundle]
+    # @raise [CHaml::Bundle::StaleError] if the bundle is broken or was written by other versions
+    def self.load(path)
+      data = File.binread(path)
+      raise StaleError, "#{path} is not a chaml bundle" unless data.start_with?(MAGIC)
+
+      index = MAGIC.bytesize
+      size  = data.byteslice(index, 4).to_s.unpack("N")[0].to_i
+      index += 4
+      written = data.byteslice(index, size)
+      raise StaleError, "#{path} was written by #{written}, not by #{stamp}" unless written == stamp
+
+      index += size
+      crc, length = data.byteslice(index, 12).to_s.unpack("NQ>")
+      body = data.byteslice(index + 12, length.to_i)
+      unless body && body.bytesize == length && Zlib.crc32(body) == crc
+        raise StaleError, "#{path} is broken, its checksum does not match"
+      end
+      bundle = allocate
+      bundle.send(:initialize, Marshal.load(body).map { |name, dump|
+        [name, CHaml::Engine.new("", :partials => bundle).load(dump)]
+      })
+      bundle
+    end
+
+    # @param entries [Array<Array(String, CHaml::Engine)>]
+    def initialize(entries)
+      @engines = Hash[entries]
+    end
+
+    # @param name [String] The name the engine was written with
+    # @return [CHaml::Engine, nil]
+    def [](name)
+      @engines[name.to_s]
+    end
+
+    # @return [Array<String>]
+    def names
+      @engines.keys
+    end
+
+    # @return [Integer]
+    def size
+      @engines.size
+    end
+
+    def each(&block)
+      @engines.each(&block)
+    end
+  end
+end
@@ -0,0 +1,74 @@
+require "thread"
+
+module CHaml
+  # A size-bounded LRU cache of compiled engines.
+  # An entry is keyed by the absolute path of its template and the options,
+  # and is built again when the mtime, size or inode of the file has changed.
+  class Cache
+    DEFAULT_CAPACITY = 1024
+
+    attr_reader :capacity, :hits, :misses, :evictions
+
+    # @param capacity [Integer] The maximum number of engines to keep
+    def initialize(capacity = DEFAULT_CAPACITY)
+      raise ArgumentError, "capacity must be positive" unless capacity > 0
+      @capacity  = capacity
+      @entries   = {}
+      @mutex     = Mutex.new
+      @hits      = 0
+      @misses    = 0
+      @evictions = 0
+    end
+
+    # Returns the compiled engine for the template at path
+    # @param path [String] A path of the haml template
+    # @param options [Hash] An options hash
+    # @return [CHaml::Engine] An engine shared by every caller, do not modify it
+    def fetch(path, options = {})
+      path  = File.expand_path(path)
+      key   = [path, options]
+      stat  = File.stat(path)
+      stamp = [stat.mtime.to_i, stat.mtime.nsec, stat.size, stat.ino, stat.dev]
+
+      @mutex.synchronize do
+        entry = @entries.delete(key)
+        if entry && entry[0] == stamp
+          @hits += 1
+          @entries[key] = entry
+          return entry[1]
+        end
+        @misses += 1
+      end
+
+      engine = CHaml::Engine.new(File.read(path), options).compile
+      @mutex.synchronize do
+        @entries.delete(key)
+        @entries[key] = [stamp, engine]
+        while @entries.size > @capacity
+          @entries.delete(@entries.first[0])
+          @evictions += 1
+        end
+      end
+      engine
+    end
+
+    # @return [Integer] The number of cached engines
+    def size
+      @mutex.synchronize { @entries.size }
+    end
+
+    # @return [Hash] The counters of the cache
+    def stats
+      @mutex.synchronize do
+        {:size => @entries.size, :capacity => @capacity,
+         :hits => @hits, :misses => @misses, :evictions => @evictions}
+      end
+    end
+
+    # Drops every cached engine, the counters are kept
+    def clear
+      @mutex.synchronize { @entries.clear }
+      self
+    end
+  end
+end
@@ -0,0 +1,104 @@
+module CHaml
+  # Compiled engines by the absolute path of their templates, with the seconds
+  # each one took to read and compile and the errors of the ones that failed.
+  # It resolves the partials of the engines of CHaml.precompile, "+ shared/header"
+  # finds root/shared/header.haml.
+  class Registry
+    include Enumerable
+
+    # @return [Hash{String => Float}] The seconds each template took, failed ones included
+    attr_reader :timings
+
+    # @return [Hash{String => Exception}] The errors of the templates that failed
+    attr_reader :failures
+
+    # @return [Float, nil] The wall clock seconds all of the templates took
+    attr_accessor :elapsed
+
+    # @return [String] The directory relative paths are expanded from
+    attr_reader :root
+
+    # @param root [String] The directory relative paths are expanded from
+    def initialize(root = Dir.pwd)
+      @root     = File.expand_path(root)
+      @engines  = {}
+      @timings  = {}
+      @failures = {}
+      @elapsed  = nil
+    end
+
+    # @param path [String] An absolute path of the template
+    # @param engine [CHaml::Engine, nil] The engine, nil if the template failed
+    # @param seconds [Float, nil]
+    # @param error [Exception, nil]
+    # @return [CHaml::Registry] self
+    def add(path, engine, seconds = nil, error = nil)
+      @timings[path] = seconds if seconds
+      if engine
+        @engines[path] = engine
+        @failures.delete(path)
+      else
+        @engines.delete(path)
+        @failures[path] = error
+      end
+      self
+    end
+
+    # @param path [String] A path of the template, relative ones are expanded from root
+    #   and ".haml" may be left out
+    # @return [CHaml::Engine, nil]
+    def [](path)
+      path = path.to_s
+      @engines[path] || @engines[File.expand_path(path, @root)] || @engines[File.expand_path("#{path}.haml", @root)]
+    end
+
+    # @param path [String] A path of the template, relative ones are expanded
+    # @return [CHaml::Engine]
+    # @raise [KeyError] if the template is not in the registry
+    def fetch(path)
+      self[path] or raise KeyError, "#{path} is not in the registry"
+    end
+
+    # @return [Array<String>]
+    def paths
+      @engines.keys
+    end
+
+    # @return [Integer] The number of engines
+    def size
+      @engines.size
+    end
+
+    def each(&block)
+      @engines.each(&block)
+    end
+
+    # @param count [Integer]
+    # @return [Array<Array(String, Float)>] The slowest templates, the slowest first
+    def slowest(count = 10)
+      @timings.sort_by { |_, seconds| -seconds }.first(count)
+    end
+
+    # Watches the templates of the engines, #reload picks up the ones written since
+    # @return [CHaml::Registry] self
+    def watch
+      @watcher ||= CHaml::Watcher.new
+      @engines.each_key { |path| @watcher.add(path) }
+      self
+    end
+
+    # Reloads the engines whose templates were written since the last call, then
+    # relinks the others so that they put the new html of static partials in place.
+    # Engines of CHaml.precompile(glob, reloadable: true) parse only the blocks changed.
+    # @param timeout [Numeric] Seconds to wait for a template to be written
+    # @return [Array<String>] The paths of the engines reloaded
+    def reload(timeout = 0)
+      return [] unless @watcher
+      changed = @watcher.changes(timeout).select { |path| @engines.key?(path) }
+      return changed if changed.empty?
+      changed.each { |path| @engines[path].reload }
+      @engines.each_value(&:relink)
+      changed
+    end
+  end
+end
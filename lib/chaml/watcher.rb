@@ -0,0 +1,67 @@
+module CHaml
+  # Reports the templates written since the last call of #changes. Where the extension
+  # was built with inotify the directories of the templates are watched, elsewhere the
+  # files are polled for a new mtime, size or inode.
+  class Watcher
+    # Seconds between two polls of the files
+    POLL_INTERVAL = 0.1
+
+    # @return [Boolean] Whether the files are watched with inotify
+    def self.native?
+      private_method_defined?(:read_events)
+    end
+
+    # @param path [String] A path of the template, watched from now on
+    # @return [CHaml::Watcher] self
+    def add(path)
+      path = File.expand_path(path)
+      if Watcher.native?
+        @dirs ||= {}
+        (@dirs[watch(File.dirname(path))] ||= {})[File.basename(path)] = path
+      else
+        @stamps ||= {}
+        @stamps[path] = stamp(path)
+      end
+      self
+    end
+
+    # @param timeout [Numeric] Seconds to wait for a template to be written, 0 returns at once
+    # @return [Array<String>] The absolute paths of the templates written since the last call
+    def changes(timeout = 0)
+      Watcher.native? ? native_changes(timeout) : polled_changes(timeout)
+    end
+
+    unless native?
+      def close
+      end
+    end
+
+    private
+
+    def native_changes(timeout)
+      return [] unless @dirs
+      @io ||= IO.for_fd(fileno, autoclose: false)
+      return [] unless IO.select([@io], nil, nil, timeout)
+      read_events.map { |wd, name| @dirs[wd] && @dirs[wd][name] }.compact.uniq
+    end
+
+    def polled_changes(timeout)
+      return [] unless @stamps
+      deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + timeout
+      loop do
+        changed = @stamps.select { |path, stamp| stamp(path) != stamp }.keys
+        changed.each { |path| @stamps[path] = stamp(path) }
+        remaining = deadline - Process.clock_gettime(Process::CLOCK_MONOTONIC)
+        return changed if !changed.empty? || remaining <= 0
+        sleep [remaining, POLL_INTERVAL].min
+      end
+    end
+
+    def stamp(path)
+      stat = File.stat(path)
+      [stat.mtime.to_i, stat.mtime.nsec, stat.size, stat.ino]
+    rescue SystemCallError
+      nil
+    end
+  end
+end
@@ -0,0 +1,69 @@
+require 'helper'
+require 'tmpdir'
+
+describe CHaml::Bundle do
+  before do
+    @dir  = Dir.mktmpdir
+    @path = File.join(@dir, "templates.bundle")
+  end
+
+  after do
+    FileUtils.remove_entry(@dir)
+  end
+
+  def scope
+    scope = Object.new
+    def scope.who; 'chaml'; end
+    scope
+  end
+
+  it "loads engines rendering like the ones written" do
+    engines = {
+      "a" => CHaml::Engine.new("%p.a{:title => who}= who\n%div hi #{'#{who}'}\n"),
+      "b" => CHaml::Engine.new("%br\n%input{:checked => true}\n", :format => :xhtml),
+      "c" => CHaml::Engine.new(":preserve\n  x\n  y\n~ \"<pre>a\\nb</pre>\"\n", :compile_script => false),
+    }
+    assert_equal 3, CHaml::Bundle.write(@path, engines)
+
+    bundle = CHaml::Bundle.load(@path)
+    assert_equal %w(a b c), bundle.names
+    engines.each do |name, engine|
+      assert_equal engine.render(scope), bundle[name].render(scope)
+    end
+  end
+
+  it "resolves the partials of loaded engines in the bundle" do
+    partials = {"item" => CHaml::Engine.new("%li= who\n"), "title" => CHaml::Engine.new("%h1 Title\n")}
+    engines  = partials.merge("list" => CHaml::Engine.new("+ title\n%ul\n  + item\n", :partials => partials))
+    CHaml::Bundle.write(@path, engines)
+
+    bundle = CHaml::Bundle.load(@path)
+    assert_equal engines["list"].render(scope), bundle["list"].render(scope)
+  end
+
+  it "keeps the template of a loaded engine" do
+    CHaml::Bundle.write(@path, "a" => CHaml::Engine.new("%p a\n"))
+    engine = CHaml::Bundle.load(@path)["a"]
+    engine.concat("%p b\n")
+    assert_equal "<p>a</p>\n<p>b</p>", engine.render.strip
+  end
+
+  it "rejects a bundle written by another version" do
+    CHaml::Bundle.write(@path, "a" => CHaml::Engine.new("%p a\n"))
+    data = File.binread(@path)
+    File.binwrite(@path, data.sub(CHaml::Bundle.stamp, CHaml::Bundle.stamp.tr("0-9", "9")))
+    assert_raises(CHaml::Bundle::StaleError) { CHaml::Bundle.load(@path) }
+  end
+
+  it "rejects a broken bundle" do
+    CHaml::Bundle.write(@path, "a" => CHaml::Engine.new("%p= 1 + 1\n"))
+    data = File.binread(@path)
+    data.setbyte(data.bytesize - 8, data.getbyte(data.bytesize - 8) ^ 1)
+    File.binwrite(@path, data)
+    assert_raises(CHaml::Bundle::StaleError) { CHaml::Bundle.load(@path) }
+  end
+
+  it "rejects a dump of another version" do
+    assert_raises(ArgumentError) { CHaml::Engine.new("").load("not a dump") }
+  end
+end
@@ -0,0 +1,60 @@
+require 'helper'
+require 'tmpdir'
+
+describe CHaml::Cache do
+  before do
+    @dir = Dir.mktmpdir
+  end
+
+  after do
+    FileUtils.remove_entry(@dir)
+  end
+
+  def write(name, haml, mtime = Time.now)
+    path = File.join(@dir, name)
+    File.write(path, haml)
+    File.utime(mtime, mtime, path)
+    path
+  end
+
+  it "returns the same engine while the file is unchanged" do
+    cache = CHaml::Cache.new
+    path  = write("a.haml", "%p a\n")
+    engine = cache.fetch(path)
+    assert_same engine, cache.fetch(path)
+    assert_equal "<p>a</p>", engine.render.strip
+    assert_equal 1, cache.hits
+    assert_equal 1, cache.misses
+  end
+
+  it "compiles the file again when it has changed" do
+    cache = CHaml::Cache.new
+    path  = write("a.haml", "%p a\n", Time.at(1_000_000))
+    cache.fetch(path)
+    write("a.haml", "%p bb\n", Time.at(2_000_000))
+    assert_equal "<p>bb</p>", cache.fetch(path).render.strip
+    assert_equal 2, cache.misses
+  end
+
+  it "evicts the least recently used engine" do
+    cache = CHaml::Cache.new(2)
+    a = write("a.haml", "a\n")
+    b = write("b.haml", "b\n")
+    c = write("c.haml", "c\n")
+    cache.fetch(a)
+    cache.fetch(b)
+    cache.fetch(a)
+    cache.fetch(c)
+    assert_equal 1, cache.evictions
+    assert_equal 2, cache.size
+    cache.fetch(a)
+    assert_equal 2, cache.hits
+    cache.fetch(b)
+    assert_equal 4, cache.misses
+  end
+
+  it "is used by CHaml.read" do
+    path = write("a.haml", "%p a\n")
+    assert_same CHaml.read(path), CHaml.read(File.join(@dir, ".", "a.haml"))
+  end
+end
@@ -0,0 +1,496 @@
+require 'helper'
+require 'tmpdir'
+require 'stringio'
+
+describe CHaml::Engine do
+  it "renders the same output on every call" do
+    engine = CHaml::Engine.new("%p{:a => 'b'}= 1 + 1\n%div.foo<= 'bar'\n")
+    first  = engine.render
+    assert_equal first, engine.render
+    assert_equal first, engine.render
+  end
+
+  it "does not modify the given template" do
+    haml   = "%p{:a => 'b'} hello"
+    engine = CHaml::Engine.new(haml)
+    engine.render
+    assert_equal "%p{:a => 'b'} hello", haml
+  end
+
+  it "folds long runs of static siblings into one segment" do
+    engine = CHaml::Engine.new("%p row\n" * 50_000 + "%p= 1\n")
+    assert_equal "<p>row</p>\n" * 50_000 + "<p>1</p>\n", engine.render
+  end
+
+  it "compiles again after the template is changed" do
+    engine = CHaml::Engine.new("%p a\n")
+    assert_equal "<p>a</p>", engine.render.strip
+    engine.concat("%p b\n")
+    assert_equal "<p>a</p>\n<p>b</p>", engine.render.strip
+  end
+
+  it "renders the same output with a capped arena" do
+    engine = CHaml::Engine.new((1..300).map { |i| "%p= #{i} * 2\n" }.join, :arena_limit => 4096)
+    first  = engine.render(Object.new)
+    assert_equal first, engine.render(Object.new)
+  end
+
+  it "compiles again after the options are changed" do
+    engine = CHaml::Engine.new("%br\n")
+    assert_equal "<br>", engine.render.strip
+    engine.append_option(:format => :xhtml)
+    assert_equal "<br />", engine.render.strip
+  end
+
+  it "keeps the stats of the last render" do
+    engine = CHaml::Engine.new("%p= 1 + 1\n%div hello\n")
+    assert_nil engine.last_render_stats
+    output = engine.render
+    stats  = engine.last_render_stats
+    phases = [:evaluate, :static_haml, :html, :flatten]
+    assert phases.all? { |phase| stats[phase] >= 0 }
+    assert_in_delta stats.values_at(*phases).inject(:+), stats[:total], 1e-9
+    assert_equal 1, stats[:evals]
+    assert_operator stats[:eval_bytes], :>, 0
+    assert_operator stats[:arena_chunks], :>=, 1
+    assert_operator stats[:arena_used], :<=, stats[:arena_bytes]
+    assert_equal output.bytesize, stats[:output_bytes]
+
+    # the script is parsed by the first render only
+    engine.render
+    assert_equal 0, engine.last_render_stats[:eval_bytes]
+
+    engine = CHaml::Engine.new("%p= 1 + 1\n- x = 2\n", :compile_script => false)
+    engine.render(Object.new)
+    # each slot resets @_ before it runs
+    assert_equal 4, engine.last_render_stats[:evals]
+    assert_equal engine.write_chunks(Object.new).to_a.join.bytesize, engine.last_render_stats[:output_bytes]
+  end
+end
+
+describe "CHaml::Engine#open" do
+  def with_template(haml)
+    path = File.join(Dir.tmpdir, "chaml_open_#{$$}.haml")
+    File.open(path, 'wb') { |f| f.write(haml) }
+    yield path
+  ensure
+    File.unlink(path) if File.exist?(path)
+  end
+
+  it "renders a mapped template like a read one" do
+    with_template("%html\n  %body\n    %p{:a => 'b'} hello\n") do |path|
+      read   = CHaml::Engine.new('').open(path).render
+      mapped = CHaml::Engine.new('').open(path, :mmap => true)
+      assert_equal read, mapped.render
+      assert_equal read, mapped.render
+    end
+  end
+
+  it "handles a mapped template without the trailing cr" do
+    with_template("%div\n  %p{:a => 1,\n     :b => 2} x |\n    y |\n%P last") do |path|
+      read = CHaml::Engine.new('').open(path).render
+      assert_equal read, CHaml::Engine.new('').open(path, :mmap => true).render
+      assert_match(/last/, read)
+    end
+  end
+
+  it "concats onto a mapped template" do
+    with_template("%p a") do |path|
+      engine = CHaml::Engine.new('').open(path, :mmap => true)
+      engine.concat("\n%p b\n")
+      assert_equal "<p>a</p>\n<p>b</p>", engine.render.strip
+    end
+  end
+
+  it "accepts an empty file" do
+    with_template("") do |path|
+      assert_equal "", CHaml::Engine.new('').open(path, :mmap => true).render.strip
+    end
+  end
+
+  it "is named after the file for the probes" do
+    with_template("%p a") do |path|
+      assert_nil CHaml::Engine.new('').name
+      engine = CHaml::Engine.new('').open(path, :mmap => true)
+      assert_equal path, engine.name
+      assert engine.name.frozen?
+      assert_equal "<p>a</p>", engine.render.strip
+    end
+  end
+end
+
+describe "CHaml::Engine#write_chunks" do
+  def haml
+    "%html\n  %head\n    %title= title\n  %body\n" + (1..50).map { |i| "    %p= #{i}\n" }.join
+  end
+
+  def scope
+    scope = Object.new
+    def scope.title; 'chunked'; end
+    scope
+  end
+
+  it "yields the same document as render in bounded chunks" do
+    engine = CHaml::Engine.new(haml)
+    chunks = []
+    engine.write_chunks(scope, :chunk_size => 64) { |chunk| chunks << chunk }
+    assert_operator chunks.size, :>, 1
+    assert chunks.all? { |chunk| chunk.bytesize <= 64 }
+    assert_equal engine.render(scope), chunks.join
+  end
+
+  it "ends a chunk right after flush_after" do
+    engine = CHaml::Engine.new(haml)
+    chunks = engine.write_chunks(scope, :flush_after => '</head>').to_a
+    assert chunks.first.end_with?('</head>')
+    assert_equal engine.render(scope), chunks.join
+  end
+
+  it "ends a chunk right after a flush_after split between chunks" do
+    engine = CHaml::Engine.new(haml)
+    whole  = engine.render(scope)
+    head   = whole.index('</head>') + '</head>'.bytesize
+    [2, 3, 7, 16, 100].each do |size|
+      chunks = engine.write_chunks(scope, :chunk_size => size, :flush_after => '</head>').to_a
+      ends   = chunks.inject([]) { |sums, chunk| sums << (sums.last || 0) + chunk.bytesize }
+      assert_includes ends, head
+      assert chunks.all? { |chunk| chunk.bytesize <= size }
+      assert_equal whole, chunks.join
+    end
+  end
+
+  it "writes the chunks to an io" do
+    engine = CHaml::Engine.new(haml)
+    io = StringIO.new
+    assert_same io, engine.write_chunks_to(io, scope, :chunk_size => 100)
+    assert_equal engine.render(scope), io.string
+  end
+
+  it "renders the engine again inside its own chunks" do
+    engine = CHaml::Engine.new(haml)
+    whole  = engine.render(scope)
+    inner  = []
+    chunks = []
+    engine.write_chunks(scope, :chunk_size => 256) do |chunk|
+      inner << engine.render(scope)
+      chunks << chunk
+    end
+    assert_equal whole, chunks.join
+    assert inner.all? { |html| html == whole }
+  end
+
+  it "refuses to change the template while rendering" do
+    engine = CHaml::Engine.new(haml)
+    assert_raises(RuntimeError) do
+      engine.write_chunks(scope) { engine.concat("%p\n") }
+    end
+    engine.concat("%p x\n")
+    assert_match(/<p>x<\/p>/, engine.render(scope))
+  end
+end
+
+describe "CHaml::Engine escaping" do
+  it "escapes & < > \" and ' at any offset of long strings" do
+    scope = Object.new
+    def scope.text(i, ch); 'x' * i + ch + 'y' * (70 - i); end
+    %w(& < > " ').zip(%w(&amp; &lt; &gt; &quot; &#39;)).each do |ch, entity|
+      [0, 1, 15, 16, 17, 31, 32, 33, 63, 64, 70].each do |i|
+        engine = CHaml::Engine.new("&= text(#{i}, #{ch.inspect})\n")
+        assert_equal 'x' * i + entity + 'y' * (70 - i), engine.render(scope).strip
+      end
+    end
+  end
+
+  it "keeps strings that need no escaping" do
+    engine = CHaml::Engine.new("&= 'plain text ' * 10\n")
+    assert_equal 'plain text ' * 9 + 'plain text', engine.render.strip
+  end
+end
+
+describe "CHaml::Engine attributes" do
+  it "merges classes and ids from the shorthand and the hashes" do
+    engine = CHaml::Engine.new(".a.b{:class => ['z', 'c']}#i{:id => 'j'} hi\n")
+    assert_equal "<div class='a b c z' id='i_j'>hi</div>", engine.render.strip
+  end
+
+  it "drops false and nil attributes and keeps true ones bare" do
+    haml = "%input{:checked => true, :disabled => false, :value => nil}\n"
+    assert_equal "<input checked>", CHaml::Engine.new(haml).render.strip
+    assert_equal "<input checked='checked' />", CHaml::Engine.new(haml, :format => :xhtml).render.strip
+  end
+
+  it "escapes the values and expands data hashes" do
+    scope = Object.new
+    def scope.q; %q(a'b<c>&d); end
+    engine = CHaml::Engine.new("%p{:q => q, :data => {:user_id => 5}}\n")
+    assert_equal "<p q='a&#39;b&lt;c&gt;&amp;d' data-user-id='5'></p>", engine.render(scope).strip
+  end
+
+  it "renders literal attributes without evaluating them" do
+    scope = Object.new
+    def scope.instance_eval(*); raise 'evaluated'; end
+    haml   = "%div.row.b#main{:class => 'a', id: :x, 'n' => 5, :c => true, :d => nil}(e='it\\'s') hi\n"
+    engine = CHaml::Engine.new(haml, :compile_script => false)
+    assert_equal "<div n='5' c e='it&#39;s' class='a b row' id='main_x'>hi</div>", engine.render(scope).strip
+  end
+end
+
+describe "CHaml::Engine scripts" do
+  it "evaluates every line of the template in one scope" do
+    engine = CHaml::Engine.new("- x = 1\n= x + 1\n")
+    assert_equal "2", engine.render(Object.new).strip
+  end
+
+  it "evaluates each line on its own without compile_script" do
+    scope = Object.new
+    def scope.foo; 'bar'; end
+    engine = CHaml::Engine.new("%p= foo\n%p #{'#{foo}'}\n", :compile_script => false)
+    assert_equal "<p>bar</p>\n<p>bar</p>", engine.render(scope).strip
+  end
+
+  it "sees the methods of the scope, not the locals of the code rendering" do
+    scope = Object.new
+    def scope.secret; 'scope'; end
+    [{}, {:compile_script => false}].each do |options|
+      engine = CHaml::Engine.new("- x = secret\n%p= x\n", options)
+      first  = lambda { secret = 'first'; engine.render(scope) }
+      second = lambda { secret = 'second'; engine.render(scope) }
+      assert_equal "<p>scope</p>", first.call.strip
+      assert_equal "<p>scope</p>", second.call.strip
+    end
+  end
+
+  it "finds the constants of the class of the scope" do
+    view = Class.new { const_set(:INNER, 'inner') }
+    sub  = Class.new(view) { const_set(:INNER, 'sub') }
+    [{}, {:compile_script => false}].each do |options|
+      engine = CHaml::Engine.new("%p= INNER\n", options)
+      assert_equal "<p>inner</p>", engine.render(view.new).strip
+      assert_equal "<p>sub</p>", engine.render(sub.new).strip
+    end
+  end
+
+  it "raises from the line of the template" do
+    [{}, {:compile_script => false}].each do |options|
+      engine = CHaml::Engine.new("%p a\n\n%p= 1\n-# b\n= raise 'boom'\n", options)
+      error  = assert_raises(RuntimeError) { engine.render(Object.new) }
+      assert_match(/\A\(chaml\):5:/, error.backtrace.first)
+    end
+  end
+
+  it "evaluates only the expressions interpolated into text" do
+    scope = Object.new
+    def scope.x; 'X<'; end
+    engine = CHaml::Engine.new("a #{'#{x}'} b #{'#{1 + 1 # two}'}\n:plain\n  c #{'#{x}'}\\t\n& d #{'#{x}'}\n")
+    assert_equal "a X< b 2\nc X<\t\nd X&lt;", engine.render(scope).strip
+  end
+
+  it "encodes the newlines of preserved tags" do
+    scope = Object.new
+    def scope.x; "<pre>a\nb\n</pre>\n<TEXTAREA rows=2>c\r\nd</TEXTAREA>"; end
+    engine = CHaml::Engine.new("~ x\n%div~ x\n")
+    html   = "<pre>a&#x000A;b</pre>\n<TEXTAREA rows=2>c&#x000A;d</TEXTAREA>"
+    assert_equal "#{html}\n<div>#{html}</div>", engine.render(scope).strip
+  end
+
+  it "encodes every newline of a preserve filter" do
+    engine = CHaml::Engine.new(":preserve\n  a\n  b #{'#{1 + 1}'}\n%p c\n")
+    assert_equal "a&#x000A;b 2&#x000A;\n<p>c</p>", engine.render.strip
+  end
+
+  it "reads escapes in text without evaluating them" do
+    scope = Object.new
+    def scope.instance_eval(*); raise 'evaluated'; end
+    engine = CHaml::Engine.new("a\\tb\\u00e9\\x41 \\\#{c}\n", :compile_script => false)
+    assert_equal "a\tb\u00e9A \#{c}", engine.render(scope).strip.force_encoding('UTF-8')
+  end
+end
+
+describe "CHaml::Engine partials" do
+  def partials
+    @partials ||= {
+      'header' => CHaml::Engine.new("%header\n  %h1 Title\n"),
+      'item'   => CHaml::Engine.new("%li= name\n%li\n  %b= name.upcase\n"),
+    }
+  end
+
+  def scope
+    scope = Object.new
+    def scope.name; 'bob'; end
+    scope
+  end
+
+  it "inlines a static partial at compile time" do
+    engine = CHaml::Engine.new("%div\n  + header\n%p x\n", :partials => partials)
+    assert_equal "<div>\n  <header>\n    <h1>Title</h1>\n  </header>\n</div>\n<p>x</p>", engine.render.strip
+    assert_equal 0, engine.last_render_stats[:evals]
+  end
+
+  it "renders a dynamic partial in the scope and at the indent of its line" do
+    engine = CHaml::Engine.new("%ul\n  + item\n%p= name\n", :partials => partials)
+    html   = "<ul>\n  <li>bob</li>\n  <li>\n    <b>BOB</b>\n  </li>\n</ul>\n<p>bob</p>"
+    assert_equal html, engine.render(scope).strip
+    assert_equal 2, engine.last_render_stats[:evals]
+    assert_equal html, engine.write_chunks(scope, :chunk_size => 5).to_a.join.strip
+  end
+
+  it "raises if the partials are nested in a cycle" do
+    cycle = {}
+    cycle['a'] = CHaml::Engine.new("%p= 1\n+ b\n", :partials => cycle)
+    cycle['b'] = CHaml::Engine.new("+ a\n", :partials => cycle)
+    assert_raises(RuntimeError) { cycle['a'].render }
+  end
+
+  it "leaves other lines starting with + as text" do
+    assert_equal "<p>\n  + 1 = 2\n</p>\n+", CHaml::Engine.new("%p\n  + 1 = 2\n+\n").render.strip
+  end
+
+  it "leaves a + line naming no partial as text" do
+    assert_equal "<p>\n  +  more\n</p>\n+ 1", CHaml::Engine.new("%p\n  +  more \n+ 1\n").render.strip
+    engine = CHaml::Engine.new("%ul\n  + item\n  + nope\n", :partials => partials)
+    assert_equal "<ul>\n  <li>bob</li>\n  <li>\n    <b>BOB</b>\n  </li>\n  + nope\n</ul>", engine.render(scope).strip
+  end
+end
+
+describe "CHaml::Engine layouts" do
+  def layout
+    CHaml::Engine.new("%html\n  %head\n    + yield head\n  %body\n    + yield\n    + yield missing\n")
+  end
+
+  def page
+    CHaml::Engine.new("+ content_for head\n  %title= title\n%h1= title\n%p\n  text\n")
+  end
+
+  def scope
+    scope = Object.new
+    def scope.title; 'T'; end
+    scope
+  end
+
+  it "splices the page and its contents into the layout" do
+    html = "<html>\n  <head>\n    <title>T</title>\n  </head>\n  <body>\n    <h1>T</h1>\n    <p>\n      text\n    </p>\n  </body>\n</html>"
+    engine = page
+    assert_equal html, engine.render(scope, :layout => layout).strip
+    # the layout has no ruby of its own, only the page is evaluated
+    assert_equal 1, engine.last_render_stats[:evals]
+    assert_equal html, engine.write_chunks(scope, :layout => layout, :chunk_size => 7).to_a.join.strip
+  end
+
+  it "leaves the contents out without a layout" do
+    assert_equal "<h1>T</h1>\n<p>\n  text\n</p>", page.render(scope).strip
+    assert_raises(TypeError) { page.render(scope, :layout => "%p") }
+  end
+end
+
+describe "CHaml::Engine reload" do
+  def haml
+    "%header\n  %h1= 1 + 1\n%ul\n  %li a\n  %li= :b\n%footer{:class => 'x',\n:id => 'f'} end\n"
+  end
+
+  it "parses again only the blocks that changed" do
+    engine = CHaml::Engine.new(haml, :reloadable => true)
+    engine.render
+    changed = "%p new\n" + haml.sub("%li a", "%li c")
+    assert_equal 2, engine.reload(changed)
+    assert_equal CHaml::Engine.new(changed).render, engine.render
+    assert_equal 0, engine.reload(changed)
+    assert_equal 0, engine.reload(changed.sub("%p new\n", ""))
+    assert_equal CHaml::Engine.new(changed.sub("%p new\n", "")).render, engine.render
+  end
+
+  it "compiles the whole template unless it is reloadable" do
+    engine = CHaml::Engine.new(haml)
+    assert_nil engine.reload("%p= 2 * 3\n")
+    assert_equal "<p>6</p>", engine.render.strip
+    assert_raises(ArgumentError) { engine.reload }
+  end
+
+  it "reads the file again and relinks the static partials" do
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "t.haml")
+      File.write(path, "%p one\n")
+      partials = {"item" => CHaml::Engine.new("%li x\n")}
+      engine = CHaml::Engine.new("", :reloadable => true, :partials => partials).open(path)
+      assert_equal "<p>one</p>", engine.render.strip
+      File.write(path, "%p two\n%ul\n  + item\n")
+      assert_equal 2, engine.reload
+      assert_equal "<p>two</p>\n<ul>\n  <li>x</li>\n</ul>", engine.render.strip
+      partials["item"].reload("%li y\n")
+      engine.relink
+      assert_equal "<p>two</p>\n<ul>\n  <li>y</li>\n</ul>", engine.render.strip
+    end
+  end
+end
+
+describe "CHaml::Engine in threads" do
+  # large enough to be compiled and rendered without the gvl
+  def haml
+    "%table\n" + (1..2000).map { |i| "  %tr\n    %td= #{i}\n    %td x & y\n" }.join
+  end
+
+  it "renders the same document from several threads at once" do
+    engine = CHaml::Engine.new(haml)
+    whole  = CHaml::Engine.new(haml).render(Object.new)
+    threads = 4.times.map { Thread.new { 5.times.map { engine.render(Object.new) } } }
+    assert threads.flat_map(&:value).all? { |html| html == whole }
+  end
+
+  it "compiles the same template from several threads at once" do
+    engine = CHaml::Engine.new(haml)
+    4.times.map { Thread.new { engine.compile } }.each(&:join)
+    assert_match(/<td>2000<\/td>/, engine.render(Object.new))
+  end
+end
+
+if defined?(Ractor)
+  describe "CHaml::Engine in ractors" do
+    before { Warning[:experimental] = false }
+
+    it "is shared between ractors once frozen" do
+      engine = CHaml::Engine.new("%p= n * 2\n~ \"<pre>a\\nb</pre>\"\n- x = n\n%b= x\n").freeze
+      assert Ractor.shareable?(Ractor.make_shareable(engine))
+      ractors = 4.times.map do |i|
+        Ractor.new(engine, i) do |engine, i|
+          scope = Object.new
+          scope.define_singleton_method(:n) { i }
+          50.times.map { engine.render(scope) }.uniq
+        end
+      end
+      ractors.each_with_index do |ractor, i|
+        assert_equal ["<p>#{i * 2}</p>\n<pre>a&#x000A;b</pre>\n<b>#{i}</b>\n"], ractor.take
+      end
+    end
+
+    it "is compiled by the main ractor only when shared without freeze" do
+      # Kernel#freeze leaves the engine as it is, unlike Engine#freeze
+      engine = Ractor.make_shareable(Kernel.instance_method(:freeze).bind_call(CHaml::Engine.new("%p= 1 + 1\n")))
+      render = lambda do
+        Ractor.new(engine) do |engine|
+          begin
+            engine.render(Object.new)
+          rescue RuntimeError => e
+            e.class
+          end
+        end.take
+      end
+      assert_equal RuntimeError, render.call
+      assert_equal "<p>2</p>", engine.render(Object.new).strip
+      assert_equal "<p>2</p>", render.call.strip
+    end
+
+    it "can not be changed once frozen" do
+      engine = CHaml::Engine.new("%p x\n").freeze
+      assert_raises(FrozenError) { engine.concat("%p y\n") }
+      assert_raises(FrozenError) { engine.append_option(:format => :xhtml) }
+      assert_equal "<p>x</p>", engine.render.strip
+    end
+
+    it "reads templates in other ractors" do
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, "t.haml")
+        File.write(path, "%p ractor\n")
+        assert_equal "<p>ractor</p>", Ractor.new(path) { |path| CHaml.read(path).render.strip }.take
+      end
+    end
+  end
+end
@@ -0,0 +1,82 @@
+require 'helper'
+require 'tmpdir'
+
+describe CHaml::Registry do
+  before do
+    @dir = Dir.mktmpdir
+  end
+
+  after do
+    FileUtils.remove_entry(@dir)
+  end
+
+  def write(name, haml)
+    path = File.join(@dir, name)
+    FileUtils.mkdir_p(File.dirname(path))
+    File.write(path, haml)
+    path
+  end
+
+  it "precompiles every template matching the glob" do
+    templates = {
+      "a.haml"       => "%p.a{:title => 'x'} a\n%div= 1 + 2\n",
+      "b.haml"       => "%br\n",
+      "sub/c.haml"   => "%ul\n  - 3.times do |i|\n    %li= i\n",
+      "large.haml"   => "%p hello\n" * 4096,
+    }
+    templates.each { |name, haml| write(name, haml) }
+    registry = CHaml.precompile(File.join(@dir, "**/*.haml"), :threads => 3, :format => :xhtml)
+
+    assert_equal 4, registry.size
+    assert_empty registry.failures
+    assert_equal registry.paths.sort, registry.timings.keys.sort
+    assert_operator registry.elapsed, :>=, 0
+    templates.each do |name, haml|
+      path = File.join(@dir, name)
+      assert_equal CHaml::Engine.new(haml, :format => :xhtml).render, registry.fetch(path).render
+    end
+    assert_equal "<br />", registry[File.join(@dir, "b.haml")].render.strip
+    assert_equal File.join(@dir, "b.haml"), registry[File.join(@dir, "b.haml")].name
+  end
+
+  it "reports the templates that failed and keeps the others" do
+    write("a.haml", "%p a\n")
+    File.symlink(File.join(@dir, "missing.haml"), File.join(@dir, "b.haml"))
+    registry = CHaml.precompile(File.join(@dir, "*.haml"), :threads => 1)
+
+    assert_equal [File.join(@dir, "a.haml")], registry.paths
+    error = registry.failures[File.join(@dir, "b.haml")]
+    assert_kind_of Errno::ENOENT, error
+    assert_includes error.message, "b.haml"
+    assert_raises(KeyError) { registry.fetch(File.join(@dir, "b.haml")) }
+    assert_equal 2, registry.slowest.size
+  end
+
+  it "resolves the partials of the templates relative to the root" do
+    write("shared/header.haml", "%h1 Title\n")
+    write("shared/item.haml", "%li= 1 + 1\n")
+    index = write("index.haml", "%div\n  + shared/header\n  %ul\n    + shared/item.haml\n")
+    registry = CHaml.precompile(File.join(@dir, "**/*.haml"), :root => @dir)
+
+    assert_equal "<div>\n  <h1>Title</h1>\n  <ul>\n    <li>2</li>\n  </ul>\n</div>", registry[index].render.strip
+    assert_same registry[index], registry["index"]
+  end
+
+  it "reloads the templates written since it started watching them" do
+    write("shared/item.haml", "%li one\n")
+    index = write("index.haml", "%h1 Title\n%ul\n  + shared/item\n")
+    registry = CHaml.precompile(File.join(@dir, "**/*.haml"), :root => @dir, :reloadable => true).watch
+    assert_equal "<h1>Title</h1>\n<ul>\n  <li>one</li>\n</ul>", registry[index].render.strip
+    assert_empty registry.reload
+
+    write("shared/item.haml", "%li two\n")
+    assert_equal [File.join(@dir, "shared/item.haml")], registry.reload(5)
+    assert_equal "<h1>Title</h1>\n<ul>\n  <li>two</li>\n</ul>", registry[index].render.strip
+  end
+
+  it "checks the options before reading any file" do
+    write("a.haml", "%p a\n")
+    assert_raises(CHaml::UnknownOptionError) { CHaml.precompile(File.join(@dir, "*.haml"), :nope => 1) }
+    assert_raises(ArgumentError) { CHaml.precompile(File.join(@dir, "*.haml"), :threads => 0) }
+  end
+end